@@ -74,6 +74,7 @@ int ignore_reduce_failures = 0;
 bool decompress_input = false;
 std::string combine = "";
 bool compress_output = false;
+bool local_shuffle = false;
 }
 
 const std::string error_message = "shuttle client - A fast computing framework base on Galaxy\n"
@@ -117,6 +118,7 @@ const std::string error_message = "shuttle client - A fast computing framework b
         "\t  mapred.ignore.reduce.failures\t\tSpecify the maximum number of failed-reduce ignored\n"
         "\t  mapred.decompress.input \t\t Allow decompress input file\n"
         "\t  mapred.output.compress \t\t Allow compress output file\n"
+        "\t  mapred.shuffle.local \t\t Keep map output on the map hosts for the reducers to fetch\n"
         "\t  mapred.map.max.attempts\t\tSpecify the maximum number of retries per each map task\n"
         "\t  mapred.job.check.counters\t\tEnable checking job counters\n"
         "\t  mapred.reduce.max.attempts\t\tSpecify the maximum number of retries per each reduce tasks\n"
@@ -471,6 +473,9 @@ static void ParseJobConfig() {
         } else if(boost::starts_with(*it, "mapred.output.compress=")) {
             config::compress_output = 
                ParseBooleanValue(it->substr(strlen("mapred.output.compress=")));
+        } else if(boost::starts_with(*it, "mapred.shuffle.local=")) {
+            config::local_shuffle =
+               ParseBooleanValue(it->substr(strlen("mapred.shuffle.local=")));
         }
     }
 }
@@ -850,6 +855,7 @@ static int SubmitJob() {
     job_desc.ignore_reduce_failures = config::ignore_reduce_failures;
     job_desc.decompress_input = config::decompress_input;
     job_desc.compress_output = config::compress_output;
+    job_desc.local_shuffle = config::local_shuffle;
     job_desc.cmdenvs = config::cmdenvs;
 
     std::string jobid;
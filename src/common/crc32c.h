@@ -0,0 +1,68 @@
+#ifndef _BAIDU_SHUTTLE_COMMON_CRC32C_H_
+#define _BAIDU_SHUTTLE_COMMON_CRC32C_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#ifdef __SSE4_2__
+#include <nmmintrin.h>
+#endif
+
+namespace baidu {
+namespace shuttle {
+namespace crc32c {
+
+// CRC-32C (Castagnoli), the checksum of the sort file blocks.
+// Uses the SSE4.2 instruction when the build enables it.
+
+struct Table {
+    uint32_t entries[256];
+    Table() {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t crc = i;
+            for (int j = 0; j < 8; j++) {
+                crc = (crc >> 1) ^ (0x82F63B78 & (0 - (crc & 1)));
+            }
+            entries[i] = crc;
+        }
+    }
+};
+
+inline const uint32_t* GetTable() {
+    static Table table;
+    return table.entries;
+}
+
+// Return the crc32c of data[0,n-1] appended to the data whose crc is init_crc
+inline uint32_t Extend(uint32_t init_crc, const char* data, size_t n) {
+    uint32_t crc = init_crc ^ 0xFFFFFFFFu;
+    const unsigned char* p = reinterpret_cast<const unsigned char*>(data);
+#ifdef __SSE4_2__
+    uint64_t crc64 = crc;
+    for (; n >= 8; n -= 8, p += 8) {
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+        crc64 = _mm_crc32_u64(crc64, v);
+    }
+    crc = static_cast<uint32_t>(crc64);
+    for (; n > 0; n--, p++) {
+        crc = _mm_crc32_u8(crc, *p);
+    }
+#else
+    const uint32_t* table = GetTable();
+    for (; n > 0; n--, p++) {
+        crc = table[(crc ^ *p) & 0xFF] ^ (crc >> 8);
+    }
+#endif
+    return crc ^ 0xFFFFFFFFu;
+}
+
+inline uint32_t Value(const char* data, size_t n) {
+    return Extend(0, data, n);
+}
+
+} //namespace crc32c
+} //namespace shuttle
+} //namespace baidu
+
+#endif
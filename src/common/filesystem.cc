@@ -1,6 +1,11 @@
+#include <algorithm>
 #include <deque>
+#include <dirent.h>
+#include <errno.h>
 #include <fcntl.h> 
 #include <stdio.h> 
+#include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h> 
 #include <sys/types.h> 
 #include <unistd.h> 
@@ -39,6 +44,7 @@ public:
     bool Glob(const std::string& dir, std::vector<FileInfo>* children);
     bool Mkdirs(const std::string& dir);
     bool Exist(const std::string& path);
+    bool Stat(const std::string& path, FileInfo* info);
 private:
     hdfsFS fs_;
     hdfsFile fd_;
@@ -63,31 +69,54 @@ public:
     int64_t Tell();
     int64_t GetSize();
     bool Rename(const std::string& old_name, const std::string& new_name);
-    bool Remove(const std::string& /*path*/) {
-        //TODO, not implementation
-        return false;
-    }
-    bool List(const std::string& /*dir*/, std::vector<FileInfo>* /*children*/) {
-        //TODO, not implementation
-        return false;
-    }
+    bool Remove(const std::string& path);
+    bool List(const std::string& dir, std::vector<FileInfo>* children);
     bool Glob(const std::string& /*dir*/, std::vector<FileInfo>* /*children*/) {
         //TODO, not implementation
         return false;
     }
-    bool Mkdirs(const std::string& /*dir*/) {
-        //TODO, not implementation
-        return false;
-    }
-    bool Exist(const std::string& /*path*/) {
-        //TODO, not implementation
-        return false;
+    bool Mkdirs(const std::string& dir);
+    bool Exist(const std::string& path) {
+        return ::access(path.c_str(), F_OK) == 0;
     }
-private:
+    bool Stat(const std::string& path, FileInfo* info);
+protected:
     int fd_;
     std::string path_;
 };
 
+// Files opened for reading are mapped, reads are served from memory and
+// ReadMapped hands out the bytes without a copy. Anything else, or a file
+// that fails to map, goes through LocalFs.
+class MmapFs : public LocalFs {
+public:
+    MmapFs();
+    virtual ~MmapFs();
+    bool Open(const std::string& path,
+              OpenMode mode);
+    bool Open(const std::string& path,
+              Param& param,
+              OpenMode mode);
+    bool Close();
+    bool Seek(int64_t pos);
+    int32_t Read(void* buf, size_t len);
+    int64_t Tell();
+    int64_t GetSize();
+    int32_t ReadMapped(const char** data, size_t len);
+    void WillRead(int64_t offset, int64_t len);
+private:
+    void AdviseAhead();
+    char* base_;
+    int64_t size_;
+    int64_t pos_;
+    // pages up to advise_end_ are asked for, the scan ends at range_end_
+    int64_t advise_end_;
+    int64_t range_end_;
+};
+
+// Pages asked for ahead of the read position
+static const int64_t sWillNeedBytes = (4 << 20);
+
 FileSystem* FileSystem::CreateInfHdfs() {
     return new InfHdfs();
 }
@@ -102,6 +131,10 @@ FileSystem* FileSystem::CreateLocalFs() {
     return new LocalFs();
 }
 
+FileSystem* FileSystem::CreateMmapFs() {
+    return new MmapFs();
+}
+
 bool FileSystem::WriteAll(void* buf, size_t len) {
     size_t start = 0;
     char* str = (char*)buf;
@@ -349,6 +382,20 @@ bool InfHdfs::Exist(const std::string& path) {
     return hdfsExists(fs_, path.c_str()) == 0;
 }
 
+bool InfHdfs::Stat(const std::string& path, FileInfo* info) {
+    if (info == NULL) {
+        return false;
+    }
+    hdfsFileInfo* hdfs_info = hdfsGetPathInfo(fs_, path.c_str());
+    if (hdfs_info == NULL) {
+        LOG(WARNING, "failed to get info of %s", path.c_str());
+        return false;
+    }
+    *info = FileInfo(*hdfs_info);
+    hdfsFreeFileInfo(hdfs_info, 1);
+    return true;
+}
+
 LocalFs::LocalFs() : fd_(0) {
 
 }
@@ -413,6 +460,202 @@ bool LocalFs::Rename(const std::string& old_name, const std::string& new_name) {
     return ::rename(old_name.c_str(), new_name.c_str()) == 0;
 }
 
+// Directories are removed with everything in them, like on the dfs
+bool LocalFs::Remove(const std::string& path) {
+    struct stat buf;
+    if (::lstat(path.c_str(), &buf) != 0) {
+        return false;
+    }
+    if (!S_ISDIR(buf.st_mode)) {
+        return unlink(path.c_str()) == 0;
+    }
+    std::vector<FileInfo> children;
+    if (!List(path, &children)) {
+        return false;
+    }
+    for (size_t i = 0; i < children.size(); i++) {
+        if (!Remove(children[i].name)) {
+            return false;
+        }
+    }
+    return rmdir(path.c_str()) == 0;
+}
+
+bool LocalFs::List(const std::string& dir, std::vector<FileInfo>* children) {
+    if (children == NULL) {
+        return false;
+    }
+    DIR* dp = ::opendir(dir.c_str());
+    if (dp == NULL) {
+        LOG(WARNING, "error in listing directory: %s", dir.c_str());
+        return false;
+    }
+    struct dirent* entry = NULL;
+    while ((entry = ::readdir(dp)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        FileInfo info;
+        if (Stat(dir + "/" + entry->d_name, &info)) {
+            children->push_back(info);
+        }
+    }
+    ::closedir(dp);
+    return true;
+}
+
+bool LocalFs::Mkdirs(const std::string& dir) {
+    std::string path;
+    std::vector<std::string> parts;
+    boost::split(parts, dir, boost::is_any_of("/"));
+    for (size_t i = 0; i < parts.size(); i++) {
+        path += (i == 0 ? "" : "/") + parts[i];
+        if (path.empty() || path == ".") {
+            continue;
+        }
+        if (::mkdir(path.c_str(), 0755) != 0 && errno != EEXIST) {
+            LOG(WARNING, "fail to make directory: %s", path.c_str());
+            return false;
+        }
+    }
+    return true;
+}
+
+bool LocalFs::Stat(const std::string& path, FileInfo* info) {
+    struct stat buf;
+    if (info == NULL || ::stat(path.c_str(), &buf) != 0) {
+        return false;
+    }
+    info->kind = S_ISDIR(buf.st_mode) ? 'D' : 'F';
+    info->name = path;
+    info->size = buf.st_size;
+    info->mtime = buf.st_mtime;
+    return true;
+}
+
+MmapFs::MmapFs() : base_(NULL), size_(0), pos_(0), advise_end_(0), range_end_(0) {
+
+}
+
+MmapFs::~MmapFs() {
+    if (base_ != NULL) {
+        ::munmap(base_, size_);
+    }
+}
+
+bool MmapFs::Open(const std::string& path,
+                  OpenMode mode) {
+    if (base_ != NULL) {
+        ::munmap(base_, size_);
+        base_ = NULL;
+    }
+    size_ = 0;
+    pos_ = 0;
+    advise_end_ = 0;
+    range_end_ = 0;
+    if (!LocalFs::Open(path, mode)) {
+        return false;
+    }
+    struct stat buf;
+    if (mode != kReadFile || ::fstat(fd_, &buf) != 0 || buf.st_size <= 0) {
+        return true;
+    }
+    void* addr = ::mmap(NULL, buf.st_size, PROT_READ, MAP_SHARED, fd_, 0);
+    if (addr == MAP_FAILED) {
+        LOG(WARNING, "mmap %s fail, %s, read it instead", path.c_str(), strerror(errno));
+        return true;
+    }
+    base_ = (char*)addr;
+    size_ = buf.st_size;
+    return true;
+}
+
+bool MmapFs::Open(const std::string& path,
+                  Param& /*param*/,
+                  OpenMode mode) {
+    return Open(path, mode);
+}
+
+bool MmapFs::Close() {
+    if (base_ != NULL) {
+        ::munmap(base_, size_);
+        base_ = NULL;
+    }
+    return LocalFs::Close();
+}
+
+bool MmapFs::Seek(int64_t pos) {
+    if (base_ == NULL) {
+        return LocalFs::Seek(pos);
+    }
+    if (pos < 0 || pos > size_) {
+        return false;
+    }
+    pos_ = pos;
+    return true;
+}
+
+int32_t MmapFs::Read(void* buf, size_t len) {
+    const char* data = NULL;
+    int32_t n_read = ReadMapped(&data, len);
+    if (n_read < 0) {
+        return LocalFs::Read(buf, len);
+    }
+    memcpy(buf, data, n_read);
+    return n_read;
+}
+
+int64_t MmapFs::Tell() {
+    if (base_ == NULL) {
+        return LocalFs::Tell();
+    }
+    return pos_;
+}
+
+int64_t MmapFs::GetSize() {
+    if (base_ == NULL) {
+        return LocalFs::GetSize();
+    }
+    return size_;
+}
+
+int32_t MmapFs::ReadMapped(const char** data, size_t len) {
+    if (base_ == NULL) {
+        return -1;
+    }
+    int32_t n_read = std::min((int64_t)len, size_ - pos_);
+    *data = base_ + pos_;
+    pos_ += n_read;
+    AdviseAhead();
+    return n_read;
+}
+
+void MmapFs::WillRead(int64_t offset, int64_t len) {
+    if (base_ == NULL || offset < 0 || offset >= size_ || len <= 0) {
+        return;
+    }
+    static const int64_t page_size = ::sysconf(_SC_PAGESIZE);
+    int64_t start = offset / page_size * page_size;
+    range_end_ = std::min(offset + len, size_);
+    ::madvise(base_ + start, range_end_ - start, MADV_SEQUENTIAL);
+    advise_end_ = start;
+    AdviseAhead();
+}
+
+// Keep the next sWillNeedBytes of the advised range on their way in
+void MmapFs::AdviseAhead() {
+    if (advise_end_ >= range_end_ || pos_ + sWillNeedBytes / 2 < advise_end_) {
+        return;
+    }
+    static const int64_t page_size = ::sysconf(_SC_PAGESIZE);
+    int64_t start = std::max(advise_end_, pos_ / page_size * page_size);
+    int64_t end = std::min(start + sWillNeedBytes, range_end_);
+    if (start < end) {
+        ::madvise(base_ + start, end - start, MADV_WILLNEED);
+    }
+    advise_end_ = end;
+}
+
 InfSeqFile::InfSeqFile() : fs_(NULL), sf_(NULL) {
 
 }
@@ -19,11 +19,13 @@ struct FileInfo {
     char kind;
     std::string name;
     int64_t size;
+    int64_t mtime;
     FileInfo() { }
     FileInfo(const hdfsFileInfo& hdfsfile) :
             kind(hdfsfile.mKind),
             name(hdfsfile.mName),
-            size(hdfsfile.mSize) {
+            size(hdfsfile.mSize),
+            mtime(hdfsfile.mLastMod) {
     }
 };
 
@@ -33,6 +35,8 @@ public:
     static FileSystem* CreateInfHdfs();
     static FileSystem* CreateInfHdfs(Param& param);
     static FileSystem* CreateLocalFs();
+    // Read-only local files mapped into memory
+    static FileSystem* CreateMmapFs();
 
     virtual bool Open(const std::string& path,
                       OpenMode mode) = 0;
@@ -52,6 +56,14 @@ public:
     virtual bool Glob(const std::string& dir, std::vector<FileInfo>* children) = 0;
     virtual bool Mkdirs(const std::string& dir) = 0;
     virtual bool Exist(const std::string& path) = 0;
+    virtual bool Stat(const std::string& path, FileInfo* info) = 0;
+    // Point data at the next len bytes in place and move on, return the
+    // bytes available or -1 if the file is not mapped into memory
+    virtual int32_t ReadMapped(const char** /*data*/, size_t /*len*/) {
+        return -1;
+    }
+    // Hint that [offset, offset + len) is going to be read sequentially
+    virtual void WillRead(int64_t /*offset*/, int64_t /*len*/) { }
     virtual ~FileSystem() { }
 };
 
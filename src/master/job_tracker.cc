@@ -33,6 +33,9 @@ DECLARE_int32(retry_bound);
 DECLARE_int32(left_percent);
 DECLARE_int32(max_counters_per_job);
 DECLARE_int32(parallel_attempts);
+DECLARE_int32(tuo_owner_timeout);
+DECLARE_int32(merge_lease_initial);
+DECLARE_int32(merge_lease_min);
 
 namespace baidu {
 namespace shuttle {
@@ -63,7 +66,15 @@ JobTracker::JobTracker(MasterImpl* master, ::baidu::galaxy::sdk::AppMaster* gala
                       start_time_(0),
                       finish_time_(0),
                       ignored_map_failures_(0),
-                      ignored_reduce_failures_(0) {
+                      ignored_reduce_failures_(0),
+                      tuo_size_(0),
+                      tuo_ready_(0),
+                      tuo_closed_(false),
+                      tuo_timer_(NULL),
+                      lease_limit_(FLAGS_merge_lease_initial),
+                      lease_peak_rate_(0),
+                      //a restarted master goes on from a version never used
+                      map_output_version_(common::timer::get_micros()) {
     job_descriptor_.CopyFrom(job);
     job_id_ = GenerateJobId();
 
@@ -80,6 +91,7 @@ JobTracker::JobTracker(MasterImpl* master, ::baidu::galaxy::sdk::AppMaster* gala
         }
     }
     monitor_ = new ThreadPool(1);
+    tuo_timer_ = new ThreadPool(1);
 
     map_allow_duplicates_ = job_descriptor_.map_allow_duplicates();
     reduce_allow_duplicates_ = job_descriptor_.reduce_allow_duplicates();
@@ -107,6 +119,10 @@ JobTracker::~JobTracker() {
     if (fs_ != NULL) {
         delete fs_;
     }
+    if (tuo_timer_ != NULL) {
+        delete tuo_timer_;
+    }
+    CloseTuoWaiters();
 }
 
 void JobTracker::BuildOutputFsPointer() {
@@ -212,6 +228,7 @@ Status JobTracker::Start() {
         return kNoMore;
     }
     BuildEndGameCounters();
+    BuildTuoTable();
     rpc_client_ = new RpcClient();
     map_ = new Gru(galaxy_, &job_descriptor_, job_id_,
             (job_descriptor_.job_type() == kMapOnlyJob) ? kMapOnly : kMap);
@@ -285,6 +302,7 @@ Status JobTracker::Kill(JobState end_state) {
 
         state_ = end_state;
     }
+    CloseTuoWaiters();
 
     MutexLock lock(&alloc_mu_);
     for (std::vector<AllocateItem*>::iterator it = allocation_table_.begin();
@@ -386,12 +404,14 @@ ResourceItem* JobTracker::AssignMap(const std::string& endpoint, Status* status)
             map_slug_.push(cur->no);
         }
     }
+    bool rerun = false;
     {
         MutexLock lock(&mu_);
         if (cur->no >= map_end_game_begin_ && !map_monitoring_) {
             monitor_->AddTask(boost::bind(&JobTracker::KeepMonitoring, this, true));
             map_monitoring_ = true;
         }
+        rerun = lost_maps_.find(cur->no) != lost_maps_.end();
     }
     AllocateItem* alloc = new AllocateItem();
     alloc->endpoint = endpoint;
@@ -405,7 +425,10 @@ ResourceItem* JobTracker::AssignMap(const std::string& endpoint, Status* status)
     MutexLock lock(&alloc_mu_);
     allocation_table_.push_back(alloc);
     map_index_[alloc->resource_no][alloc->attempt] = alloc;
-    time_heap_.push(alloc);
+    //the monitor of the reduce phase does not look after maps
+    if (!rerun) {
+        time_heap_.push(alloc);
+    }
     LOG(INFO, "assign map: < no - %d, attempt - %d >, to %s: %s",
             alloc->resource_no, alloc->attempt, endpoint.c_str(), job_id_.c_str());
     if (status != NULL) {
@@ -563,7 +586,8 @@ Status JobTracker::FinishMap(int no, int attempt, TaskState state,
             LOG(WARNING, "make %s,%d to be fake-completed", job_id_.c_str(), 
                 cur->resource_no);
             state = kTaskCompleted;
-            if (job_descriptor_.job_type() != kMapOnlyJob) {//mapper of map-reduce
+            if (job_descriptor_.job_type() != kMapOnlyJob
+                && !job_descriptor_.local_shuffle()) {//mapper of map-reduce
                 Status w_status;
                 SortFileWriter* writer = SortFileWriter::Create(kHdfsFile, &w_status);
                 if (w_status == kOk) {
@@ -595,10 +619,21 @@ Status JobTracker::FinishMap(int no, int attempt, TaskState state,
                 state = kTaskCanceled;
                 break;
             }
-            AccumulateCounters(counters);
+            bool rerun = lost_maps_.erase(cur->resource_no) > 0;
+            lost_map_failures_.erase(cur->resource_no);
+            if (!rerun) {
+                AccumulateCounters(counters);
+            }
+            FinishTuoMap(cur->resource_no);
             int completed = map_manager_->Done();
             LOG(INFO, "complete a map task(%d/%d): %s",
                     completed, map_manager_->SumOfItem(), job_id_.c_str());
+            if (rerun) {
+                //the reduce phase is going on already
+                LOG(INFO, "lost output of map %d is made again: %s",
+                        cur->resource_no, job_id_.c_str());
+                break;
+            }
             if (completed == reduce_begin_ && job_descriptor_.job_type() != kMapOnlyJob) {
                 LOG(INFO, "map phrase nearly ends, pull up reduce tasks: %s", job_id_.c_str());
                 reduce_ = new Gru(galaxy_, &job_descriptor_, job_id_, kReduce);
@@ -655,7 +690,8 @@ Status JobTracker::FinishMap(int no, int attempt, TaskState state,
                         monitor_->AddTask(boost::bind(&JobTracker::KeepMonitoring,
                                     this, false));
                     }
-                    if (map_ != NULL) {
+                    //the map minions serve their output to the reducers
+                    if (map_ != NULL && !job_descriptor_.local_shuffle()) {
                         LOG(INFO, "map minion finished, kill: %s", job_id_.c_str());
                         delete map_;
                         map_ = NULL;
@@ -666,6 +702,28 @@ Status JobTracker::FinishMap(int no, int attempt, TaskState state,
             break;
         case kTaskFailed:
             map_manager_->ReturnBackItem(cur->resource_no);
+            if (lost_maps_.find(cur->resource_no) != lost_maps_.end()) {
+                //failed_count_ counts the reduces now, the runs for a lost
+                //output have their own count under the same bound
+                ++ map_failed_;
+                int failed = ++ lost_map_failures_[cur->resource_no];
+                LOG(WARNING, "failed rerun of map: job_id: %s, no: %d, aid: %d, node: %s, %d times",
+                    job_id_.c_str(), cur->resource_no, cur->attempt, cur_node.c_str(), failed);
+                if (failed < job_descriptor_.map_retry()) {
+                    break;
+                }
+                LOG(INFO, "lost output of map %d can not be made again, kill job: %s",
+                    cur->resource_no, job_id_.c_str());
+                LOG(WARNING, "=== error msg ===");
+                LOG(WARNING, "%s", err_msg.c_str());
+                error_msg_ = err_msg;
+                mu_.Unlock();
+                master_->RetractJob(job_id_, kFailed);
+                mu_.Lock();
+                finished = true;
+                state_ = kFailed;
+                break;
+            }
             //only increment failed_count when fail on different nodes
             if (failed_nodes_[cur->resource_no].find(cur_node) == failed_nodes_[cur->resource_no].end()) {
                 ++ failed_count_[cur->resource_no];
@@ -710,6 +768,9 @@ Status JobTracker::FinishMap(int no, int attempt, TaskState state,
         MutexLock lock(&alloc_mu_);
         cur->state = state;
         cur->period = std::time(NULL) - cur->alloc_time;
+        if (state == kTaskCompleted) {
+            ++ map_output_version_;
+        }
         if (map_allow_duplicates_ &&
             (state == kTaskKilled || state == kTaskFailed) ) {
             map_slug_.push(cur->resource_no);
@@ -863,6 +924,9 @@ Status JobTracker::FinishReduce(int no, int attempt, TaskState state,
             reduce_slug_.push(cur->resource_no);
         }
     }
+    //tuos still merged by this attempt go to the other reducers
+    ReleaseTuos(no, attempt);
+    ReleaseMergeLease(no, attempt);
     if (state != kTaskCompleted) {
         return kOk;
     }
@@ -878,6 +942,455 @@ Status JobTracker::FinishReduce(int no, int attempt, TaskState state,
     return kOk;
 }
 
+void JobTracker::BuildTuoTable() {
+    int map_total = job_descriptor_.map_total();
+    if (job_descriptor_.job_type() != kMapReduceJob || map_total < 1
+        || job_descriptor_.local_shuffle()) {
+        return;
+    }
+    MutexLock lock(&tuo_mu_);
+    tuo_size_ = std::min((int)::ceil(::sqrt(map_total)), 300);
+    int tuo_total = (map_total + tuo_size_ - 1) / tuo_size_;
+    if (tuo_total < 100) {
+        tuo_size_ = std::max((int)::ceil(::sqrt(tuo_size_)), 10);
+        tuo_total = (map_total + tuo_size_ - 1) / tuo_size_;
+    }
+    tuo_table_.assign(tuo_total, TuoItem());
+    for (int i = 0; i < tuo_total; ++i) {
+        tuo_table_[i].maps_left = std::min(tuo_size_, map_total - i * tuo_size_);
+    }
+    //a reloaded job may have done maps, its merged tuos are found by
+    //the reducers they are assigned to again
+    if (map_manager_ != NULL) {
+        for (int no = 0; no < map_total; ++no) {
+            if (map_manager_->IsDone(no)) {
+                --tuo_table_[no / tuo_size_].maps_left;
+            }
+        }
+    }
+    for (int i = 0; i < tuo_total; ++i) {
+        if (tuo_table_[i].maps_left <= 0) {
+            tuo_table_[i].state = kTuoPending;
+        }
+    }
+    tuo_ready_ = 0;
+    tuo_ready_order_.clear();
+    LOG(INFO, "tuo table: %d tuos of %d maps: %s", tuo_total, tuo_size_, job_id_.c_str());
+}
+
+void JobTracker::FinishTuoMap(int no) {
+    {
+        MutexLock lock(&tuo_mu_);
+        if (tuo_size_ <= 0 || no / tuo_size_ >= (int)tuo_table_.size()) {
+            return;
+        }
+        TuoItem& tuo = tuo_table_[no / tuo_size_];
+        if (tuo.state != kTuoWaitMaps || --tuo.maps_left > 0) {
+            return;
+        }
+        tuo.state = kTuoPending;
+        LOG(INFO, "maps of tuo %d are done: %s", no / tuo_size_, job_id_.c_str());
+    }
+    WakeTuoWaiters();
+}
+
+void JobTracker::ReleaseTuos(int no, int attempt) {
+    bool released = false;
+    {
+        MutexLock lock(&tuo_mu_);
+        for (size_t i = 0; i < tuo_table_.size(); ++i) {
+            TuoItem& tuo = tuo_table_[i];
+            if (tuo.state == kTuoMerging && tuo.owner_no == no
+                && tuo.owner_attempt == attempt) {
+                LOG(INFO, "release tuo %d of reduce < no - %d, attempt - %d >: %s",
+                    (int)i, no, attempt, job_id_.c_str());
+                tuo.state = kTuoPending;
+                released = true;
+            }
+        }
+        tuo_owner_seen_.erase(std::make_pair(no, attempt));
+    }
+    if (released) {
+        WakeTuoWaiters();
+    }
+}
+
+// Caller holds tuo_mu_
+void JobTracker::ReleaseIdleTuos() {
+    time_t now = std::time(NULL);
+    for (size_t i = 0; i < tuo_table_.size(); ++i) {
+        TuoItem& tuo = tuo_table_[i];
+        if (tuo.state != kTuoMerging) {
+            continue;
+        }
+        std::map<std::pair<int, int>, time_t>::iterator it =
+            tuo_owner_seen_.find(std::make_pair(tuo.owner_no, tuo.owner_attempt));
+        if (it == tuo_owner_seen_.end() || it->second + FLAGS_tuo_owner_timeout < now) {
+            LOG(WARNING, "reduce < no - %d, attempt - %d > is gone, release tuo %d: %s",
+                tuo.owner_no, tuo.owner_attempt, (int)i, job_id_.c_str());
+            tuo.state = kTuoPending;
+        }
+    }
+}
+
+// Caller holds tuo_mu_. The own tuo of the reducer goes first, then the
+// others from where its number points, the reducers spread over the table
+void JobTracker::AssignTuos(const TuoMergeRequest* request, TuoMergeResponse* response) {
+    response->Clear();
+    response->set_status(kOk);
+    response->set_tuo_size(tuo_size_);
+    response->set_tuo_total(tuo_table_.size());
+    int slots = request->free_slots();
+    int total = tuo_table_.size();
+    std::set<int> failed(request->failed_tuos().begin(), request->failed_tuos().end());
+    for (int i = 0; i < total && slots > 0; ++i) {
+        int no = (request->reduce_no() + i) % total;
+        TuoItem& tuo = tuo_table_[no];
+        //a failed tuo goes to the others first
+        if (tuo.state != kTuoPending || failed.find(no) != failed.end()) {
+            continue;
+        }
+        tuo.state = kTuoMerging;
+        tuo.owner_no = request->reduce_no();
+        tuo.owner_attempt = request->attempt_id();
+        response->add_assigned_tuos(no);
+        --slots;
+        LOG(INFO, "assign tuo %d to reduce < no - %d, attempt - %d >: %s",
+            no, tuo.owner_no, tuo.owner_attempt, job_id_.c_str());
+    }
+    response->set_ready_count(tuo_ready_);
+    //a caller knowing more than this table, e.g. of the master before
+    //a restart, is told all of them
+    int known = request->ready_known() <= tuo_ready_ ? request->ready_known() : 0;
+    for (int i = known; i < tuo_ready_; ++i) {
+        response->add_ready_tuos(tuo_ready_order_[i]);
+    }
+}
+
+void JobTracker::SyncTuoMerge(const TuoMergeRequest* request, TuoMergeResponse* response,
+                              ::google::protobuf::Closure* done) {
+    bool changed = false;
+    bool held = false;
+    {
+        MutexLock lock(&tuo_mu_);
+        if (tuo_closed_ || tuo_table_.empty()) {
+            response->set_status(tuo_closed_ ? kNoSuchJob : kNoMore);
+        } else {
+            std::pair<int, int> owner(request->reduce_no(), request->attempt_id());
+            tuo_owner_seen_[owner] = std::time(NULL);
+            int total = tuo_table_.size();
+            for (int i = 0; i < request->merged_tuos_size(); ++i) {
+                int no = request->merged_tuos(i);
+                if (no < 0 || no >= total || tuo_table_[no].state == kTuoReady) {
+                    continue;
+                }
+                tuo_table_[no].state = kTuoReady;
+                ++tuo_ready_;
+                tuo_ready_order_.push_back(no);
+                changed = true;
+                LOG(INFO, "tuo %d is ready(%d/%d): %s", no, tuo_ready_, total, job_id_.c_str());
+            }
+            for (int i = 0; i < request->failed_tuos_size(); ++i) {
+                int no = request->failed_tuos(i);
+                if (no < 0 || no >= total || tuo_table_[no].state != kTuoMerging
+                    || tuo_table_[no].owner_no != owner.first
+                    || tuo_table_[no].owner_attempt != owner.second) {
+                    continue;
+                }
+                LOG(WARNING, "reduce < no - %d, attempt - %d > fail to merge tuo %d: %s",
+                    owner.first, owner.second, no, job_id_.c_str());
+                tuo_table_[no].state = kTuoPending;
+                changed = true;
+            }
+            ReleaseIdleTuos();
+            AssignTuos(request, response);
+            if (response->assigned_tuos_size() == 0
+                && tuo_ready_ == request->ready_known()
+                && request->wait_time() > 0) {
+                TuoWaiter waiter;
+                waiter.request = request;
+                waiter.response = response;
+                waiter.done = done;
+                waiter.deadline = common::timer::get_micros()
+                                  + request->wait_time() * 1000000L;
+                tuo_waiters_.push_back(waiter);
+                tuo_timer_->DelayTask(request->wait_time() * 1000,
+                                      boost::bind(&JobTracker::WakeTuoWaiters, this));
+                held = true;
+            }
+        }
+    }
+    if (!held) {
+        done->Run();
+    }
+    if (changed) {
+        WakeTuoWaiters();
+    }
+}
+
+// Answer the held calls that have something new or wait no longer,
+// the callers whose own tuo is pending get it before the others
+void JobTracker::WakeTuoWaiters() {
+    std::vector< ::google::protobuf::Closure*> answered;
+    {
+        MutexLock lock(&tuo_mu_);
+        int64_t now = common::timer::get_micros();
+        for (int pass = 0; pass < 2; ++pass) {
+            std::list<TuoWaiter>::iterator it = tuo_waiters_.begin();
+            while (it != tuo_waiters_.end()) {
+                int own = it->request->reduce_no();
+                bool own_pending = own < (int)tuo_table_.size()
+                                   && tuo_table_[own].state == kTuoPending;
+                if (pass == 0 && !own_pending) {
+                    ++it;
+                    continue;
+                }
+                AssignTuos(it->request, it->response);
+                if (it->response->assigned_tuos_size() == 0
+                    && tuo_ready_ == it->request->ready_known()
+                    && it->deadline > now) {
+                    ++it;
+                    continue;
+                }
+                tuo_owner_seen_[std::make_pair(own, it->request->attempt_id())] = std::time(NULL);
+                answered.push_back(it->done);
+                it = tuo_waiters_.erase(it);
+            }
+        }
+    }
+    for (size_t i = 0; i < answered.size(); ++i) {
+        answered[i]->Run();
+    }
+}
+
+void JobTracker::CloseTuoWaiters() {
+    std::vector< ::google::protobuf::Closure*> answered;
+    {
+        MutexLock lock(&tuo_mu_);
+        tuo_closed_ = true;
+        std::list<TuoWaiter>::iterator it;
+        for (it = tuo_waiters_.begin(); it != tuo_waiters_.end(); ++it) {
+            it->response->Clear();
+            it->response->set_status(kNoSuchJob);
+            answered.push_back(it->done);
+        }
+        tuo_waiters_.clear();
+        std::list<LeaseWaiter>::iterator jt;
+        for (jt = lease_waiters_.begin(); jt != lease_waiters_.end(); ++jt) {
+            jt->response->Clear();
+            jt->response->set_status(kNoSuchJob);
+            answered.push_back(jt->done);
+        }
+        lease_waiters_.clear();
+    }
+    for (size_t i = 0; i < answered.size(); ++i) {
+        answered[i]->Run();
+    }
+}
+
+// Caller holds tuo_mu_. An attempt keeps the lease it holds already
+bool JobTracker::GrantMergeLease(const MergeLeaseRequest* request,
+                                 MergeLeaseResponse* response) {
+    std::pair<int, int> holder(request->reduce_no(), request->attempt_id());
+    bool granted = lease_holders_.find(holder) != lease_holders_.end();
+    if (!granted && (int)lease_holders_.size() < lease_limit_) {
+        lease_holders_.insert(holder);
+        granted = true;
+        LOG(INFO, "grant merge lease to reduce < no - %d, attempt - %d >(%d/%d): %s",
+            holder.first, holder.second, (int)lease_holders_.size(), lease_limit_,
+            job_id_.c_str());
+    }
+    response->set_status(kOk);
+    response->set_granted(granted);
+    response->set_lease_limit(lease_limit_);
+    return granted;
+}
+
+// Caller holds tuo_mu_. One more lease after every good read, fewer when
+// a read fails or goes much slower than the best ones did, as the dfs
+// is shared by too many readers then
+void JobTracker::AdjustLeaseLimit(const MergeLeaseRequest* request) {
+    const static int64_t sMinJudgedBytes = 16L << 20;
+    int max_limit = std::max(job_descriptor_.reduce_total(), FLAGS_merge_lease_min);
+    int old_limit = lease_limit_;
+    if (request->read_failed()) {
+        lease_limit_ = std::max(lease_limit_ / 2, FLAGS_merge_lease_min);
+    } else if (request->read_micros() > 0 && request->read_bytes() >= sMinJudgedBytes) {
+        double rate = request->read_bytes() * 1000000.0 / request->read_micros();
+        if (rate < lease_peak_rate_ / 2) {
+            lease_limit_ = std::max(lease_limit_ * 3 / 4, FLAGS_merge_lease_min);
+        } else {
+            lease_limit_ = std::min(lease_limit_ + 1, max_limit);
+        }
+        lease_peak_rate_ = std::max(rate, lease_peak_rate_ * 0.95);
+    } else {
+        lease_limit_ = std::min(lease_limit_ + 1, max_limit);
+    }
+    if (lease_limit_ != old_limit) {
+        LOG(INFO, "merge lease limit %d -> %d, peak rate %.1fMB/s: %s",
+            old_limit, lease_limit_, lease_peak_rate_ / (1 << 20), job_id_.c_str());
+    }
+}
+
+void JobTracker::SyncMergeLease(const MergeLeaseRequest* request, MergeLeaseResponse* response,
+                                ::google::protobuf::Closure* done) {
+    bool released = false;
+    bool held = false;
+    {
+        MutexLock lock(&tuo_mu_);
+        std::pair<int, int> holder(request->reduce_no(), request->attempt_id());
+        if (tuo_closed_ || tuo_table_.empty()) {
+            response->set_status(tuo_closed_ ? kNoSuchJob : kNoMore);
+        } else if (request->release()) {
+            released = lease_holders_.erase(holder) > 0;
+            if (released) {
+                AdjustLeaseLimit(request);
+            }
+            response->set_status(kOk);
+            response->set_lease_limit(lease_limit_);
+        } else if (!GrantMergeLease(request, response) && request->wait_time() > 0) {
+            LeaseWaiter waiter;
+            waiter.request = request;
+            waiter.response = response;
+            waiter.done = done;
+            waiter.deadline = common::timer::get_micros()
+                              + request->wait_time() * 1000000L;
+            lease_waiters_.push_back(waiter);
+            tuo_timer_->DelayTask(request->wait_time() * 1000,
+                                  boost::bind(&JobTracker::WakeLeaseWaiters, this));
+            held = true;
+        }
+    }
+    if (!held) {
+        done->Run();
+    }
+    if (released) {
+        WakeLeaseWaiters();
+    }
+}
+
+// Give the leases to the held calls in the order they came, the others
+// are answered when they wait no longer
+void JobTracker::WakeLeaseWaiters() {
+    std::vector< ::google::protobuf::Closure*> answered;
+    {
+        MutexLock lock(&tuo_mu_);
+        int64_t now = common::timer::get_micros();
+        std::list<LeaseWaiter>::iterator it = lease_waiters_.begin();
+        while (it != lease_waiters_.end()) {
+            if (!GrantMergeLease(it->request, it->response) && it->deadline > now) {
+                ++it;
+                continue;
+            }
+            answered.push_back(it->done);
+            it = lease_waiters_.erase(it);
+        }
+    }
+    for (size_t i = 0; i < answered.size(); ++i) {
+        answered[i]->Run();
+    }
+}
+
+// The lease of an ended attempt goes to the others, so do its held calls
+void JobTracker::ReleaseMergeLease(int no, int attempt) {
+    std::vector< ::google::protobuf::Closure*> answered;
+    bool released = false;
+    {
+        MutexLock lock(&tuo_mu_);
+        std::pair<int, int> holder(no, attempt);
+        released = lease_holders_.erase(holder) > 0;
+        std::list<LeaseWaiter>::iterator it = lease_waiters_.begin();
+        while (it != lease_waiters_.end()) {
+            if (it->request->reduce_no() != no || it->request->attempt_id() != attempt) {
+                ++it;
+                continue;
+            }
+            it->response->set_status(kOk);
+            it->response->set_granted(false);
+            answered.push_back(it->done);
+            it = lease_waiters_.erase(it);
+        }
+    }
+    for (size_t i = 0; i < answered.size(); ++i) {
+        answered[i]->Run();
+    }
+    if (released) {
+        LOG(INFO, "release merge lease of reduce < no - %d, attempt - %d >: %s",
+            no, attempt, job_id_.c_str());
+        WakeLeaseWaiters();
+    }
+}
+
+Status JobTracker::LocateMapOutput(const LocateMapOutputRequest* request,
+                                   LocateMapOutputResponse* response) {
+    if (!job_descriptor_.local_shuffle()) {
+        return kNoMore;
+    }
+    for (int i = 0; i < request->lost_outputs_size(); ++i) {
+        const MapOutputLocation& lost = request->lost_outputs(i);
+        LOG(WARNING, "reduce %d lost the output of map %d, attempt %d: %s",
+            request->reduce_no(), lost.map_no(), lost.attempt_id(), job_id_.c_str());
+        RedoMap(lost.map_no(), lost.attempt_id());
+    }
+    std::set<int> ignored;
+    {
+        MutexLock lock(&mu_);
+        if (state_ != kRunning) {
+            return kNoSuchJob;
+        }
+        ignored = ignore_failure_mappers_;
+    }
+    response->set_map_total(job_descriptor_.map_total());
+    MutexLock lock(&alloc_mu_);
+    response->set_version(map_output_version_);
+    if (request->version() == map_output_version_) {
+        return kOk;
+    }
+    std::map<int, std::map<int, AllocateItem*> >::iterator it;
+    std::map<int, AllocateItem*>::iterator jt;
+    for (it = map_index_.begin(); it != map_index_.end(); ++it) {
+        for (jt = it->second.begin(); jt != it->second.end(); ++jt) {
+            AllocateItem* candidate = jt->second;
+            if (candidate->state != kTaskCompleted) {
+                continue;
+            }
+            MapOutputLocation* output = response->add_outputs();
+            output->set_map_no(candidate->resource_no);
+            output->set_attempt_id(candidate->attempt);
+            //a failed map made completed has no output to fetch
+            if (ignored.find(candidate->resource_no) == ignored.end()) {
+                output->set_endpoint(candidate->endpoint);
+            }
+            break;
+        }
+    }
+    return kOk;
+}
+
+void JobTracker::RedoMap(int no, int attempt) {
+    {
+        MutexLock lock(&alloc_mu_);
+        std::map<int, std::map<int, AllocateItem*> >::iterator it = map_index_.find(no);
+        if (it == map_index_.end()) {
+            return;
+        }
+        std::map<int, AllocateItem*>::iterator jt = it->second.find(attempt);
+        //reported by another reducer before
+        if (jt == it->second.end() || jt->second->state != kTaskCompleted) {
+            return;
+        }
+        jt->second->state = kTaskFailed;
+        ++ map_output_version_;
+    }
+    MutexLock lock(&mu_);
+    if (state_ != kRunning || !map_manager_->RedoItem(no)) {
+        return;
+    }
+    lost_maps_.insert(no);
+    ++ map_failed_;
+    LOG(INFO, "run map %d again: %s", no, job_id_.c_str());
+}
+
 void JobTracker::CancelCallback(const CancelTaskRequest* request, CancelTaskResponse* response, bool fail, int eno) {
     delete request;
     delete response;
@@ -993,6 +1506,7 @@ bool JobTracker::Load(const std::string& jobid, const JobState state,
         reduce_manager_->Load(id_data);
     }
     BuildEndGameCounters();
+    BuildTuoTable();
     bool is_map = true;
     failed_count_.resize(job_descriptor_.map_total());
     if (map_manager_ && map_manager_->Done() == job_descriptor_.map_total()) {
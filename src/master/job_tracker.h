@@ -1,6 +1,7 @@
 #ifndef _BAIDU_SHUTTLE_JOB_TRACKER_H_
 #define _BAIDU_SHUTTLE_JOB_TRACKER_H_
 #include <string>
+#include <list>
 #include <queue>
 #include <vector>
 #include <utility>
@@ -38,11 +39,45 @@ struct AllocateItemComparator {
     }
 };
 
+// A tuo is the merged output of tuo_size consecutive maps, it is merged
+// by one reduce attempt as soon as all of its maps are done
+enum TuoState {
+    kTuoWaitMaps = 0,
+    kTuoPending = 1,
+    kTuoMerging = 2,
+    kTuoReady = 3
+};
+
+struct TuoItem {
+    TuoState state;
+    int maps_left;
+    int owner_no;
+    int owner_attempt;
+    TuoItem() : state(kTuoWaitMaps), maps_left(0), owner_no(-1), owner_attempt(-1) { }
+};
+
+// A SyncTuoMerge call held until a tuo is assigned or ready
+struct TuoWaiter {
+    const TuoMergeRequest* request;
+    TuoMergeResponse* response;
+    ::google::protobuf::Closure* done;
+    int64_t deadline;
+};
+
+// A SyncMergeLease call held until a merge-read lease is free
+struct LeaseWaiter {
+    const MergeLeaseRequest* request;
+    MergeLeaseResponse* response;
+    ::google::protobuf::Closure* done;
+    int64_t deadline;
+};
+
 class CancelTaskRequest;
 class CancelTaskResponse;
 
 class JobTracker {
-
+    // drives the tuo table and the merge leases in the unit tests
+    friend class JobTrackerTest;
 public:
     JobTracker(MasterImpl* master, ::baidu::galaxy::sdk::AppMaster* galaxy_sdk,
                const JobDescriptor& job);
@@ -59,6 +94,15 @@ public:
     Status FinishReduce(int no, int attempt, TaskState state, 
                         const std::string& err_msg,
                         const std::map<std::string, int64_t>& counters);
+    void SyncTuoMerge(const TuoMergeRequest* request, TuoMergeResponse* response,
+                      ::google::protobuf::Closure* done);
+    // Reducers read the merged tuos only under a lease, the number of
+    // leases follows how fast the reads go
+    void SyncMergeLease(const MergeLeaseRequest* request, MergeLeaseResponse* response,
+                        ::google::protobuf::Closure* done);
+    // Where the reducers of a local shuffle job fetch the map outputs
+    Status LocateMapOutput(const LocateMapOutputRequest* request,
+                           LocateMapOutputResponse* response);
     bool AccumulateCounters(const std::map<std::string, int64_t>& counters);
     void FillCounters(ShowJobResponse* response);
     
@@ -128,6 +172,18 @@ private:
                              int no, int attempt) ;
     void CanReduceDismiss(Status* status, const std::string& endpoint);
     void CanMapDismiss(Status* status, const std::string& endpoint);
+    void BuildTuoTable();
+    void FinishTuoMap(int no);
+    void ReleaseTuos(int no, int attempt);
+    void ReleaseIdleTuos();
+    void AssignTuos(const TuoMergeRequest* request, TuoMergeResponse* response);
+    void WakeTuoWaiters();
+    void CloseTuoWaiters();
+    void ReleaseMergeLease(int no, int attempt);
+    bool GrantMergeLease(const MergeLeaseRequest* request, MergeLeaseResponse* response);
+    void AdjustLeaseLimit(const MergeLeaseRequest* request);
+    void WakeLeaseWaiters();
+    void RedoMap(int no, int attempt);
 private:
     MasterImpl* master_;
     ::baidu::galaxy::sdk::AppMaster* galaxy_;
@@ -181,6 +237,30 @@ private:
     int32_t ignored_map_failures_;
     int32_t ignored_reduce_failures_;
     FileSystem::Param output_param_;
+    // Tuo merge table
+    Mutex tuo_mu_;
+    int tuo_size_;
+    std::vector<TuoItem> tuo_table_;
+    int tuo_ready_;
+    // tuos in the order they got ready
+    std::vector<int> tuo_ready_order_;
+    bool tuo_closed_;
+    // last call of every reduce attempt merging tuos, <no, attempt> -> time
+    std::map<std::pair<int, int>, time_t> tuo_owner_seen_;
+    std::list<TuoWaiter> tuo_waiters_;
+    ThreadPool* tuo_timer_;
+    // Merge-read leases, guarded by tuo_mu_: <no, attempt> of the holders,
+    // and the best read rate of a lease lately in bytes per second
+    std::set<std::pair<int, int> > lease_holders_;
+    int lease_limit_;
+    double lease_peak_rate_;
+    std::list<LeaseWaiter> lease_waiters_;
+    // Local shuffle: maps run again for lost outputs and their failures
+    // so far, guarded by mu_, and the version of the completed map
+    // attempts, guarded by alloc_mu_
+    std::set<int> lost_maps_;
+    std::map<int, int> lost_map_failures_;
+    int64_t map_output_version_;
 };
 
 }
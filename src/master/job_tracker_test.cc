@@ -0,0 +1,278 @@
+#include "job_tracker.h"
+
+#include <gtest/gtest.h>
+#include <gflags/gflags.h>
+#include <google/protobuf/service.h>
+#include <algorithm>
+#include <vector>
+#include <boost/scoped_ptr.hpp>
+
+DECLARE_int32(tuo_owner_timeout);
+DECLARE_int32(merge_lease_initial);
+DECLARE_int32(merge_lease_min);
+
+namespace baidu {
+namespace shuttle {
+
+static void CountDone(int* done) {
+    ++*done;
+}
+
+// 30 maps make 3 tuos of 10 maps, tuo i waits for maps 10*i to 10*i+9
+class JobTrackerTest : public ::testing::Test {
+protected:
+    virtual void SetUp() {
+        FLAGS_merge_lease_initial = 4;
+        FLAGS_merge_lease_min = 2;
+        Build(6);
+        done_ = 0;
+    }
+    void Build(int reduce_total) {
+        JobDescriptor job;
+        job.set_name("job_tracker_test");
+        job.set_job_type(kMapReduceJob);
+        job.set_map_total(30);
+        job.set_reduce_total(reduce_total);
+        tracker_.reset(new JobTracker(NULL, NULL, job));
+        tracker_->BuildTuoTable();
+    }
+    void FinishMaps(int from, int to) {
+        for (int no = from; no <= to; ++no) {
+            tracker_->FinishTuoMap(no);
+        }
+    }
+    TuoState State(int tuo_no) {
+        return tracker_->tuo_table_[tuo_no].state;
+    }
+    int Owner(int tuo_no) {
+        return tracker_->tuo_table_[tuo_no].owner_no;
+    }
+    // makes the last call of the attempt older than the owner timeout
+    void Forget(int no, int attempt) {
+        tracker_->tuo_owner_seen_[std::make_pair(no, attempt)] -= FLAGS_tuo_owner_timeout + 1;
+    }
+    int LeaseLimit() {
+        return tracker_->lease_limit_;
+    }
+    void SyncTuo(int no, int attempt, int free_slots, int ready_known,
+                 const std::vector<int>& merged, const std::vector<int>& failed,
+                 TuoMergeResponse* response) {
+        TuoMergeRequest request;
+        request.set_jobid("job_tracker_test");
+        request.set_reduce_no(no);
+        request.set_attempt_id(attempt);
+        request.set_free_slots(free_slots);
+        request.set_ready_known(ready_known);
+        request.set_wait_time(0);
+        for (size_t i = 0; i < merged.size(); ++i) {
+            request.add_merged_tuos(merged[i]);
+        }
+        for (size_t i = 0; i < failed.size(); ++i) {
+            request.add_failed_tuos(failed[i]);
+        }
+        tracker_->SyncTuoMerge(&request, response,
+                               google::protobuf::NewCallback(&CountDone, &done_));
+    }
+    void AcquireLease(int no, MergeLeaseResponse* response) {
+        MergeLeaseRequest request;
+        request.set_jobid("job_tracker_test");
+        request.set_reduce_no(no);
+        request.set_attempt_id(1);
+        request.set_wait_time(0);
+        tracker_->SyncMergeLease(&request, response,
+                                 google::protobuf::NewCallback(&CountDone, &done_));
+    }
+    void ReleaseLease(int no, int64_t read_bytes, int64_t read_micros, bool read_failed,
+                      MergeLeaseResponse* response) {
+        MergeLeaseRequest request;
+        request.set_jobid("job_tracker_test");
+        request.set_reduce_no(no);
+        request.set_attempt_id(1);
+        request.set_release(true);
+        request.set_read_bytes(read_bytes);
+        request.set_read_micros(read_micros);
+        request.set_read_failed(read_failed);
+        tracker_->SyncMergeLease(&request, response,
+                                 google::protobuf::NewCallback(&CountDone, &done_));
+    }
+    boost::scoped_ptr<JobTracker> tracker_;
+    int done_;
+};
+
+static std::vector<int> Tuos(const google::protobuf::RepeatedField<int32_t>& tuos) {
+    return std::vector<int>(tuos.begin(), tuos.end());
+}
+
+static std::vector<int> Tuos(int first, int second) {
+    std::vector<int> tuos;
+    tuos.push_back(first);
+    tuos.push_back(second);
+    return tuos;
+}
+
+TEST_F(JobTrackerTest, AssignOnlyTuosWithDoneMaps) {
+    const std::vector<int> none;
+    TuoMergeResponse response;
+    SyncTuo(0, 1, 3, 0, none, none, &response);
+    EXPECT_EQ(response.status(), kOk);
+    EXPECT_EQ(response.tuo_total(), 3);
+    EXPECT_EQ(response.tuo_size(), 10);
+    EXPECT_EQ(response.assigned_tuos_size(), 0);
+    FinishMaps(0, 9);
+    FinishMaps(20, 28);
+    EXPECT_EQ(State(0), kTuoPending);
+    EXPECT_EQ(State(2), kTuoWaitMaps);
+    SyncTuo(2, 1, 3, 0, none, none, &response);
+    //the own tuo of reduce 2 still waits for map 29
+    ASSERT_EQ(response.assigned_tuos_size(), 1);
+    EXPECT_EQ(response.assigned_tuos(0), 0);
+    EXPECT_EQ(State(0), kTuoMerging);
+    FinishMaps(29, 29);
+    FinishMaps(10, 19);
+    SyncTuo(1, 1, 1, 0, none, none, &response);
+    ASSERT_EQ(response.assigned_tuos_size(), 1);
+    EXPECT_EQ(response.assigned_tuos(0), 1);
+    SyncTuo(0, 1, 3, 0, none, none, &response);
+    ASSERT_EQ(response.assigned_tuos_size(), 1);
+    EXPECT_EQ(response.assigned_tuos(0), 2);
+    EXPECT_EQ(done_, 4);
+}
+
+TEST_F(JobTrackerTest, FailedTuoGoesToOthers) {
+    const std::vector<int> none;
+    FinishMaps(0, 29);
+    TuoMergeResponse response;
+    SyncTuo(0, 1, 1, 0, none, none, &response);
+    ASSERT_EQ(response.assigned_tuos_size(), 1);
+    EXPECT_EQ(response.assigned_tuos(0), 0);
+    //a failure reported by an attempt not owning the tuo is ignored
+    SyncTuo(1, 1, 0, 0, none, std::vector<int>(1, 0), &response);
+    EXPECT_EQ(State(0), kTuoMerging);
+    SyncTuo(0, 1, 3, 0, none, std::vector<int>(1, 0), &response);
+    EXPECT_EQ(Tuos(response.assigned_tuos()), Tuos(1, 2));
+    EXPECT_EQ(State(0), kTuoPending);
+    SyncTuo(2, 1, 1, 0, none, none, &response);
+    ASSERT_EQ(response.assigned_tuos_size(), 1);
+    EXPECT_EQ(response.assigned_tuos(0), 0);
+    EXPECT_EQ(State(0), kTuoMerging);
+}
+
+TEST_F(JobTrackerTest, ReleaseTuosOfIdleOwner) {
+    const std::vector<int> none;
+    FinishMaps(0, 29);
+    TuoMergeResponse response;
+    SyncTuo(0, 1, 1, 0, none, none, &response);
+    ASSERT_EQ(response.assigned_tuos_size(), 1);
+    SyncTuo(1, 1, 2, 0, none, none, &response);
+    EXPECT_EQ(response.assigned_tuos_size(), 2);
+    //reduce 0 is still seen, its tuo stays with it
+    SyncTuo(2, 1, 1, 0, none, none, &response);
+    EXPECT_EQ(response.assigned_tuos_size(), 0);
+    Forget(0, 1);
+    SyncTuo(2, 1, 1, 0, none, none, &response);
+    ASSERT_EQ(response.assigned_tuos_size(), 1);
+    EXPECT_EQ(response.assigned_tuos(0), 0);
+    EXPECT_EQ(Owner(0), 2);
+}
+
+TEST_F(JobTrackerTest, ReadyTuosAfterReadyKnown) {
+    const std::vector<int> none;
+    FinishMaps(0, 29);
+    TuoMergeResponse response;
+    SyncTuo(0, 1, 3, 0, none, none, &response);
+    ASSERT_EQ(response.assigned_tuos_size(), 3);
+    SyncTuo(0, 1, 1, 0, std::vector<int>(1, 2), none, &response);
+    SyncTuo(0, 1, 1, 1, std::vector<int>(1, 0), none, &response);
+    EXPECT_EQ(response.ready_count(), 2);
+    //a tuo reported merged twice is counted once
+    SyncTuo(0, 1, 1, 2, std::vector<int>(1, 2), none, &response);
+    EXPECT_EQ(response.ready_count(), 2);
+    SyncTuo(1, 1, 0, 0, none, none, &response);
+    EXPECT_EQ(Tuos(response.ready_tuos()), Tuos(2, 0));
+    SyncTuo(1, 1, 0, 1, none, none, &response);
+    EXPECT_EQ(Tuos(response.ready_tuos()), std::vector<int>(1, 0));
+    SyncTuo(1, 1, 0, 2, none, none, &response);
+    EXPECT_EQ(response.ready_tuos_size(), 0);
+    //knowing more than the table, the caller is told all of them
+    SyncTuo(1, 1, 0, 3, none, none, &response);
+    EXPECT_EQ(Tuos(response.ready_tuos()), Tuos(2, 0));
+}
+
+TEST_F(JobTrackerTest, HeldCallGetsOwnTuoWhenMapsAreDone) {
+    TuoMergeRequest request;
+    request.set_jobid("job_tracker_test");
+    request.set_reduce_no(1);
+    request.set_attempt_id(1);
+    request.set_free_slots(1);
+    request.set_ready_known(0);
+    request.set_wait_time(10);
+    TuoMergeResponse response;
+    tracker_->SyncTuoMerge(&request, &response,
+                           google::protobuf::NewCallback(&CountDone, &done_));
+    EXPECT_EQ(done_, 0);
+    FinishMaps(0, 8);
+    FinishMaps(10, 19);
+    EXPECT_EQ(done_, 1);
+    ASSERT_EQ(response.assigned_tuos_size(), 1);
+    EXPECT_EQ(response.assigned_tuos(0), 1);
+}
+
+TEST_F(JobTrackerTest, AdjustLeaseLimitByReads) {
+    FinishMaps(0, 29);
+    MergeLeaseResponse response;
+    for (int no = 0; no < 4; ++no) {
+        AcquireLease(no, &response);
+        EXPECT_TRUE(response.granted());
+    }
+    AcquireLease(4, &response);
+    EXPECT_FALSE(response.granted());
+    EXPECT_EQ(response.lease_limit(), 4);
+    //32MB/s sets the peak rate
+    ReleaseLease(0, 32L << 20, 1000000, false, &response);
+    EXPECT_EQ(LeaseLimit(), 5);
+    //8MB/s is less than half the peak
+    ReleaseLease(1, 32L << 20, 4000000, false, &response);
+    EXPECT_EQ(LeaseLimit(), 3);
+    ReleaseLease(2, 0, 0, true, &response);
+    EXPECT_EQ(LeaseLimit(), 2);
+    //an attempt holding no lease does not move the limit
+    ReleaseLease(2, 0, 0, true, &response);
+    EXPECT_EQ(LeaseLimit(), 2);
+    for (int no = 10; no < 20; ++no) {
+        AcquireLease(no, &response);
+        ASSERT_TRUE(response.granted());
+        ReleaseLease(no, 1 << 20, 1000000, false, &response);
+    }
+    //never more leases than reducers
+    EXPECT_EQ(LeaseLimit(), 6);
+    EXPECT_EQ(response.lease_limit(), 6);
+}
+
+TEST_F(JobTrackerTest, HeldLeaseCallGetsReleasedLease) {
+    FLAGS_merge_lease_initial = 1;
+    Build(1);
+    MergeLeaseResponse response;
+    AcquireLease(0, &response);
+    EXPECT_TRUE(response.granted());
+    MergeLeaseRequest request;
+    request.set_jobid("job_tracker_test");
+    request.set_reduce_no(1);
+    request.set_attempt_id(1);
+    request.set_wait_time(10);
+    MergeLeaseResponse held;
+    tracker_->SyncMergeLease(&request, &held,
+                             google::protobuf::NewCallback(&CountDone, &done_));
+    EXPECT_EQ(done_, 1);
+    ReleaseLease(0, 0, 0, false, &response);
+    EXPECT_EQ(done_, 3);
+    EXPECT_TRUE(held.granted());
+}
+
+}
+}
+
+int main(int argc, char* argv[]) {
+    ::testing::InitGoogleTest(&argc, argv);
+    ::google::ParseCommandLineFlags(&argc, &argv, true);
+    return RUN_ALL_TESTS();
+}
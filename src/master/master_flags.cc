@@ -34,4 +34,7 @@ DEFINE_string(galaxy_token, "", "galaxy login token");
 DEFINE_string(galaxy_pool, "test", "galaxy pool");
 DEFINE_string(galaxy_am_path, "", "galaxy AppMaster path on nexus");
 DEFINE_int32(max_minions_per_host, 15, "max minions per one host");
+DEFINE_int32(tuo_owner_timeout, 120, "seconds without a call before the tuos of a reduce attempt go to others");
+DEFINE_int32(merge_lease_initial, 200, "reduce attempts of a job reading the tuos at the same time at first");
+DEFINE_int32(merge_lease_min, 20, "reduce attempts of a job always allowed to read the tuos at the same time");
 
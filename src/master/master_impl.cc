@@ -343,6 +343,71 @@ void MasterImpl::FinishTask(::google::protobuf::RpcController* /*controller*/,
     done->Run();
 }
 
+void MasterImpl::SyncTuoMerge(::google::protobuf::RpcController* /*controller*/,
+                              const ::baidu::shuttle::TuoMergeRequest* request,
+                              ::baidu::shuttle::TuoMergeResponse* response,
+                              ::google::protobuf::Closure* done) {
+    const std::string& job_id = request->jobid();
+    JobTracker* jobtracker = NULL;
+    {
+        MutexLock lock(&(tracker_mu_));
+        std::map<std::string, JobTracker*>::iterator it = job_trackers_.find(job_id);
+        if (it != job_trackers_.end()) {
+            jobtracker = it->second;
+        }
+    }
+    if (jobtracker == NULL) {
+        response->set_status(kNoSuchJob);
+        done->Run();
+        return;
+    }
+    //the tracker may hold the call until a tuo is assigned or ready
+    jobtracker->SyncTuoMerge(request, response, done);
+}
+
+void MasterImpl::LocateMapOutput(::google::protobuf::RpcController* /*controller*/,
+                                 const ::baidu::shuttle::LocateMapOutputRequest* request,
+                                 ::baidu::shuttle::LocateMapOutputResponse* response,
+                                 ::google::protobuf::Closure* done) {
+    const std::string& job_id = request->jobid();
+    JobTracker* jobtracker = NULL;
+    {
+        MutexLock lock(&(tracker_mu_));
+        std::map<std::string, JobTracker*>::iterator it = job_trackers_.find(job_id);
+        if (it != job_trackers_.end()) {
+            jobtracker = it->second;
+        }
+    }
+    if (jobtracker == NULL) {
+        response->set_status(kNoSuchJob);
+    } else {
+        response->set_status(jobtracker->LocateMapOutput(request, response));
+    }
+    done->Run();
+}
+
+void MasterImpl::SyncMergeLease(::google::protobuf::RpcController* /*controller*/,
+                                const ::baidu::shuttle::MergeLeaseRequest* request,
+                                ::baidu::shuttle::MergeLeaseResponse* response,
+                                ::google::protobuf::Closure* done) {
+    const std::string& job_id = request->jobid();
+    JobTracker* jobtracker = NULL;
+    {
+        MutexLock lock(&(tracker_mu_));
+        std::map<std::string, JobTracker*>::iterator it = job_trackers_.find(job_id);
+        if (it != job_trackers_.end()) {
+            jobtracker = it->second;
+        }
+    }
+    if (jobtracker == NULL) {
+        response->set_status(kNoSuchJob);
+        done->Run();
+        return;
+    }
+    //the tracker may hold the call until a lease is free
+    jobtracker->SyncMergeLease(request, response, done);
+}
+
 Status MasterImpl::RetractJob(const std::string& jobid, JobState end_state) {
     MutexLock lock(&(tracker_mu_));
     MutexLock lock2(&(dead_mu_));
@@ -50,6 +50,18 @@ public:
                     const ::baidu::shuttle::FinishTaskRequest* request,
                     ::baidu::shuttle::FinishTaskResponse* response,
                     ::google::protobuf::Closure* done);
+    void SyncTuoMerge(::google::protobuf::RpcController* controller,
+                      const ::baidu::shuttle::TuoMergeRequest* request,
+                      ::baidu::shuttle::TuoMergeResponse* response,
+                      ::google::protobuf::Closure* done);
+    void LocateMapOutput(::google::protobuf::RpcController* controller,
+                         const ::baidu::shuttle::LocateMapOutputRequest* request,
+                         ::baidu::shuttle::LocateMapOutputResponse* response,
+                         ::google::protobuf::Closure* done);
+    void SyncMergeLease(::google::protobuf::RpcController* controller,
+                        const ::baidu::shuttle::MergeLeaseRequest* request,
+                        ::baidu::shuttle::MergeLeaseResponse* response,
+                        ::google::protobuf::Closure* done);
 
     Status RetractJob(const std::string& jobid, JobState end_state);
 
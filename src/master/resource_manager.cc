@@ -148,6 +148,24 @@ bool IdManager::FinishItem(int no) {
     return false;
 }
 
+bool IdManager::RedoItem(int no) {
+    size_t n = static_cast<size_t>(no);
+    MutexLock lock(&mu_);
+    if (n >= resource_pool_.size()) {
+        LOG(WARNING, "this resource is not valid for redoing: %d", no);
+        return false;
+    }
+    IdItem* cur = resource_pool_[n];
+    if (cur->status == kResDone) {
+        cur->status = kResPending;
+        pending_res_.push_front(cur);
+        -- done_; ++ pending_;
+        return true;
+    }
+    LOG(WARNING, "resource is not done yet: %d", no);
+    return false;
+}
+
 bool IdManager::IsAllocated(int no) {
     size_t n = static_cast<size_t>(no);
     MutexLock lock(&mu_);
@@ -372,6 +390,20 @@ bool ResourceManager::FinishItem(int no) {
     return manager_->FinishItem(n);
 }
 
+bool ResourceManager::RedoItem(int no) {
+    size_t n = static_cast<size_t>(no);
+    MutexLock lock(&mu_);
+    if (n >= resource_pool_.size()) {
+        LOG(WARNING, "this resource is not valid for redoing: %d", no);
+        return false;
+    }
+    ResourceItem* resource = resource_pool_[n];
+    if (resource->status == kResDone) {
+        resource->status = kResPending;
+    }
+    return manager_->RedoItem(n);
+}
+
 bool ResourceManager::IsAllocated(int no) {
     size_t n = static_cast<size_t>(no);
     MutexLock lock(&mu_);
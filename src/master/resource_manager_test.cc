@@ -89,6 +89,24 @@ TEST(ResManTest, ReturnBackItemTest) {
     delete cur;
 }
 
+TEST(ResManTest, RedoItemTest) {
+    FileSystem::Param p;
+    ResourceManager resman(input_files, p, split_size);
+    ResourceItem* cur = resman.GetItem();
+    EXPECT_EQ(cur->no, 0);
+    delete cur;
+    EXPECT_FALSE(resman.RedoItem(0));
+    EXPECT_TRUE(resman.FinishItem(0));
+    int done = resman.Done();
+    EXPECT_TRUE(resman.RedoItem(0));
+    EXPECT_FALSE(resman.IsDone(0));
+    EXPECT_EQ(resman.Done(), done - 1);
+    cur = resman.GetItem();
+    EXPECT_EQ(cur->no, 0);
+    EXPECT_EQ(cur->attempt, 2);
+    delete cur;
+}
+
 int main(int argc, char** argv) {
     if (argc < 3) {
         printf("Usage: resman_test [hdfs work dir] [sum of items]\n");
@@ -113,10 +113,16 @@ then
 	if [ "${minion_pipe_style}" != "" ]; then
 		pipe_style="-pipe ${minion_pipe_style}"
 	fi
+	local_shuffle=""
+	if [ "${minion_local_shuffle}" == "true" ]; then
+		local_shuffle="-local_shuffle"
+	fi
 	shuffle_cmd="./shuffle_tool -total=${mapred_map_tasks} \
 	-work_dir=${minion_shuffle_work_dir} \
 	-reduce_no=${mapred_task_partition} \
-	-attempt_id=${mapred_attempt_id} $dfs_flags $pipe_style"
+	-attempt_id=${mapred_attempt_id} $dfs_flags $pipe_style \
+	-master=${minion_master_endpoint} -jobid=${mapred_job_id} \
+	${local_shuffle} ${minion_tuo_combiner_flags}"
 	(ShuffleRun $shuffle_cmd | JailRun) 2>./stderr
 	exit $?
 else
@@ -0,0 +1,651 @@
+#include "emitter.h"
+#include <algorithm>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/statvfs.h>
+#include <sys/wait.h>
+#include <logging.h>
+#include <gflags/gflags.h>
+#include <boost/bind.hpp>
+#include "executor.h"
+#include "partition.h"
+
+DECLARE_int32(sort_file_format);
+DECLARE_string(sort_file_codec);
+DECLARE_int32(sort_file_codec_level);
+DECLARE_int32(sort_file_compress_threads);
+DECLARE_int32(map_sort_threads);
+DECLARE_int32(map_spill_percent);
+DECLARE_int64(map_spill_reserve_mb);
+
+using baidu::common::WARNING;
+using baidu::common::INFO;
+
+namespace baidu {
+namespace shuttle {
+
+const static size_t sMaxInMemTable = 512 << 20;
+const static size_t sMaxRecordSize = 2 << 20;
+
+static SortFileWriter::Options GetSortFileOptions() {
+    SortFileWriter::Options options;
+    options.version = static_cast<SortFileVersion>(FLAGS_sort_file_format);
+    options.partitioned = true;
+    if (!SortFileWriter::ParseCodec(FLAGS_sort_file_codec, &options.codec)) {
+        LOG(WARNING, "unknown codec: %s, use snappy", FLAGS_sort_file_codec.c_str());
+    }
+    options.codec_level = FLAGS_sort_file_codec_level;
+    options.compress_threads = FLAGS_sort_file_compress_threads;
+    return options;
+}
+
+Emitter::Emitter(const std::string& work_dir, const std::string& hdfs_work_dir,
+                 const FileSystem::Param& param, const TaskInfo& task,
+                 const Partitioner* partitioner) :
+        spill_cond_(&spill_mu_), partitioner_(partitioner) {
+    work_dir_ = work_dir;
+    hdfs_work_dir_ = hdfs_work_dir;
+    hdfs_spilled_ = false;
+    param_ = param;
+    hdfs_param_ = param;
+    //the spills live no longer than the task, which is rerun if one is lost
+    hdfs_param_["replica"] = "1";
+    file_no_ = 0;
+    active_ = 0;
+    spilling_ = false;
+    spilling_usage_ = 0;
+    spill_status_ = kOk;
+    int spill_percent = FLAGS_map_spill_percent;
+    if (spill_percent < 1 || spill_percent > 100) {
+        LOG(WARNING, "map_spill_percent %d is not in [1, 100], use 50", spill_percent);
+        spill_percent = 50;
+    }
+    spill_threshold_ = sMaxInMemTable / 100 * spill_percent;
+    fill_limit_ = spill_threshold_;
+    sort_pool_ = NULL;
+    if (FLAGS_map_sort_threads > 1) {
+        sort_pool_ = new ThreadPool(FLAGS_map_sort_threads);
+    }
+    spill_pool_ = new ThreadPool(1);
+    combine_cmd_ = task.job().combine_command();
+    streaming_ = (task.job().pipe_style() == kStreaming);
+    char combine_dir[4096];
+    //the work dir of the mapper, made by app_wrapper.sh
+    snprintf(combine_dir, sizeof(combine_dir), "map_%d_%d",
+             task.task_id(), task.attempt_id());
+    combine_dir_ = combine_dir;
+    combiner_pid_ = 0;
+    combiner_in_ = -1;
+    combine_status_ = kOk;
+    combine_runs_ = 0;
+    combine_files_ = 0;
+    combine_records_in_ = 0;
+    combine_records_out_ = 0;
+}
+
+Emitter::~Emitter() {
+    WaitForSpill();
+    FinishCombiner();
+    Reset();
+    delete spill_pool_;
+    delete sort_pool_;
+    if (hdfs_spilled_) {
+        FileSystem* fs = FileSystem::CreateInfHdfs(hdfs_param_);
+        fs->Remove(hdfs_work_dir_);
+        delete fs;
+    }
+}
+
+void Emitter::Reset() {
+    mem_tables_[0].Reset();
+    mem_tables_[1].Reset();
+}
+
+Status Emitter::Emit(int reduce_no, const std::string& key, const std::string& record) {
+    if (key.size() + record.size() > sMaxRecordSize) {
+        LOG(WARNING, "ignore too large records");
+        return kOk;
+    }
+    MemTable& mem_table = mem_tables_[active_];
+    mem_table.Add(reduce_no, key, record);
+    size_t usage = mem_table.MemoryUsage();
+    if (usage < fill_limit_) {
+        return kOk; //memtable is not big enough
+    }
+    return StartSpill(usage);
+}
+
+Status Emitter::StartSpill(size_t usage) {
+    MutexLock lock(&spill_mu_);
+    if (spilling_ && usage + spilling_usage_ < sMaxInMemTable) {
+        //room left while the other memtable is spilling
+        fill_limit_ = sMaxInMemTable - spilling_usage_;
+        return kOk;
+    }
+    //both memtables are full, the mapper waits
+    while (spilling_) {
+        spill_cond_.Wait();
+    }
+    if (spill_status_ != kOk) {
+        return spill_status_;
+    }
+    if (usage < spill_threshold_) {
+        //the spill is done, the active memtable is not full yet
+        fill_limit_ = spill_threshold_;
+        return kOk;
+    }
+    std::string file_name;
+    FileType file_type = kLocalFile;
+    if (combine_cmd_.empty()) {
+        Status status = NextSpill(usage, &file_name, &file_type);
+        if (status != kOk) {
+            return status;
+        }
+    }
+    spilling_ = true;
+    spilling_usage_ = usage;
+    //the other memtable takes the rest of the budget
+    fill_limit_ = usage >= sMaxInMemTable ? 0 : sMaxInMemTable - usage;
+    if (fill_limit_ > spill_threshold_) {
+        fill_limit_ = spill_threshold_;
+    }
+    MemTable* full = &mem_tables_[active_];
+    active_ = 1 - active_;
+    spill_pool_->AddTask(boost::bind(&Emitter::BackgroundSpill, this,
+                                     full, file_name, file_type));
+    return kOk;
+}
+
+void Emitter::BackgroundSpill(MemTable* table, const std::string& file_name,
+                              FileType file_type) {
+    Status status = WriteSpill(table, file_name, file_type);
+    table->Reset();
+    MutexLock lock(&spill_mu_);
+    if (status != kOk) {
+        LOG(WARNING, "background spill fail, %s", Status_Name(status).c_str());
+        spill_status_ = status;
+    }
+    spilling_ = false;
+    spilling_usage_ = 0;
+    spill_cond_.Signal();
+}
+
+Status Emitter::WaitForSpill() {
+    MutexLock lock(&spill_mu_);
+    while (spilling_) {
+        spill_cond_.Wait();
+    }
+    return spill_status_;
+}
+
+Status Emitter::FlushMemTable() {
+    Status status = WaitForSpill();
+    if (status != kOk) {
+        return status;
+    }
+    MemTable* table = &mem_tables_[active_];
+    if (!combine_cmd_.empty()) {
+        //the combiner is only written to from the spill thread
+        {
+            MutexLock lock(&spill_mu_);
+            spilling_ = true;
+            spill_pool_->AddTask(boost::bind(&Emitter::BackgroundSpill, this,
+                                             table, std::string(), kLocalFile));
+        }
+        status = WaitForSpill();
+        if (status == kOk) {
+            status = FinishCombiner();
+        }
+        Reset();
+        return status;
+    }
+    std::string file_name;
+    FileType file_type;
+    {
+        MutexLock lock(&spill_mu_);
+        status = NextSpill(table->MemoryUsage(), &file_name, &file_type);
+    }
+    if (status == kOk) {
+        status = WriteSpill(table, file_name, file_type);
+    }
+    Reset();
+    return status;
+}
+
+// Called under spill_mu_
+Status Emitter::NextSpill(size_t usage, std::string* file_name, FileType* file_type) {
+    *file_type = kLocalFile;
+    int64_t need = usage + (FLAGS_map_spill_reserve_mb << 20);
+    struct statvfs vfs;
+    if (statvfs(work_dir_.c_str(), &vfs) != 0) {
+        LOG(WARNING, "fail to stat %s: %s", work_dir_.c_str(), strerror(errno));
+    } else {
+        int64_t avail = vfs.f_bavail * vfs.f_frsize;
+        if (avail < need) {
+            LOG(INFO, "local disk is low, %lld bytes left, spill to hdfs", avail);
+            *file_type = kHdfsFile;
+        }
+    }
+    if (*file_type == kHdfsFile && !hdfs_spilled_) {
+        FileSystem* fs = FileSystem::CreateInfHdfs(hdfs_param_);
+        bool ok = fs->Mkdirs(hdfs_work_dir_);
+        delete fs;
+        if (!ok) {
+            LOG(WARNING, "fail to make hdfs spill dir: %s", hdfs_work_dir_.c_str());
+            return kWriteFileFail;
+        }
+        hdfs_spilled_ = true;
+    }
+    char spill_name[4096];
+    snprintf(spill_name, sizeof(spill_name), "%s/%d.sort",
+             *file_type == kHdfsFile ? hdfs_work_dir_.c_str() : work_dir_.c_str(),
+             file_no_);
+    *file_name = spill_name;
+    spill_files_.push_back(*file_name);
+    spill_types_.push_back(*file_type);
+    file_no_++;
+    return kOk;
+}
+
+SortFileWriter* Emitter::OpenSpill(const std::string& file_name, FileType file_type,
+                                   Status* status) {
+    SortFileWriter* writer = SortFileWriter::Create(file_type, GetSortFileOptions(), status);
+    if (*status != kOk) {
+        delete writer;
+        return NULL;
+    }
+    *status = writer->Open(file_name, file_type == kHdfsFile ?
+                           hdfs_param_ : FileSystem::Param());
+    if (*status != kOk) {
+        LOG(WARNING, "fail to open spill: %s", file_name.c_str());
+        delete writer;
+        return NULL;
+    }
+    return writer;
+}
+
+Status Emitter::WriteSpill(MemTable* table, const std::string& file_name,
+                           FileType file_type) {
+    table->Sort(sort_pool_);
+    if (!combine_cmd_.empty()) {
+        return FeedCombiner(table);
+    }
+    return WriteSorted(table, file_name, file_type);
+}
+
+Status Emitter::WriteSorted(MemTable* table, const std::string& file_name,
+                            FileType file_type) {
+    Status status = kOk;
+    SortFileWriter* writer = OpenSpill(file_name, file_type, &status);
+    if (writer == NULL) {
+        return status;
+    }
+    char s_reduce_no[256];
+    std::string raw_key;
+    for (size_t i = 0; i < table->Count(); i++) {
+        const MemTable::Entry& entry = table->Get(i);
+        snprintf(s_reduce_no, sizeof(s_reduce_no), "%05d\t", entry.reduce_no);
+        raw_key.assign(s_reduce_no);
+        raw_key.append(entry.data, entry.key_len);
+        status = writer->Put(raw_key, entry.Record());
+        if (status != kOk) {
+            break;
+        }
+    }
+    if (status == kOk) {
+        status = writer->Close();
+    }
+    delete writer;
+    return status;
+}
+
+// Runs on the spill thread, which keeps SIGPIPE blocked: a combiner that
+// quits early fails the writes instead of killing the minion
+Status Emitter::StartCombiner() {
+    sigset_t sigpipe;
+    sigemptyset(&sigpipe);
+    sigaddset(&sigpipe, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &sigpipe, NULL);
+    //close-on-exec, or the mapper and other children hold these pipes open
+    int stdin_pipes[2];
+    int stdout_pipes[2];
+    if (pipe2(stdin_pipes, O_CLOEXEC) != 0) {
+        LOG(WARNING, "fail to create pipes for the combiner");
+        return kUnKnown;
+    }
+    if (pipe2(stdout_pipes, O_CLOEXEC) != 0) {
+        LOG(WARNING, "fail to create pipes for the combiner");
+        close(stdin_pipes[0]);
+        close(stdin_pipes[1]);
+        return kUnKnown;
+    }
+    LOG(INFO, "invoke combiner: %s in %s", combine_cmd_.c_str(), combine_dir_.c_str());
+    pid_t child_pid = fork();
+    if (child_pid == -1) {
+        LOG(WARNING, "failed to fork child process");
+        close(stdin_pipes[0]);
+        close(stdin_pipes[1]);
+        close(stdout_pipes[0]);
+        close(stdout_pipes[1]);
+        return kUnKnown;
+    } else if (child_pid == 0) { //child
+        sigprocmask(SIG_UNBLOCK, &sigpipe, NULL);
+        if (chdir(combine_dir_.c_str()) != 0) {
+            _exit(126);
+        }
+        dup2(stdin_pipes[0], 0);
+        dup2(stdout_pipes[1], 1);
+        char* cmd_argv[] = {(char*)"sh", (char*)"-c", (char*)combine_cmd_.c_str(), NULL};
+        char* env[] = {NULL};
+        ::execve("/bin/sh", cmd_argv, env);
+        _exit(127);
+    }
+    close(stdin_pipes[0]);
+    close(stdout_pipes[1]);
+    combiner_pid_ = child_pid;
+    combiner_in_ = stdin_pipes[1];
+    FILE* child_stdout = fdopen(stdout_pipes[0], "r");
+    combine_reader_.Start(boost::bind(&Emitter::ReadCombinerOutput, this, child_stdout));
+    return kOk;
+}
+
+static bool WriteAll(int fd, const std::string& data) {
+    size_t written = 0;
+    while (written < data.size()) {
+        ssize_t n = write(fd, data.data() + written, data.size() - written);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        written += n;
+    }
+    return true;
+}
+
+// One sorted run of records to the stdin of the combiner, runs on the
+// spill thread
+Status Emitter::FeedCombiner(MemTable* table) {
+    if (combiner_pid_ == 0) {
+        Status status = StartCombiner();
+        if (status != kOk) {
+            return status;
+        }
+    }
+    {
+        MutexLock lock(&spill_mu_);
+        combine_runs_++;
+    }
+    std::string buf;
+    for (size_t i = 0; i < table->Count(); i++) {
+        Slice record = table->Get(i).Record();
+        buf.append(record.data(), record.size());
+        if (streaming_) {
+            buf.push_back('\n');
+        }
+        if (buf.size() >= (64 << 10) || i + 1 == table->Count()) {
+            if (!WriteAll(combiner_in_, buf)) {
+                LOG(WARNING, "fail to write to the combiner: %s", strerror(errno));
+                return kWriteFileFail;
+            }
+            buf.clear();
+        }
+    }
+    combine_records_in_ += table->Count();
+    return kOk;
+}
+
+// One record of the combiner output: the line, or the key and the
+// length-prefixed record of bistreaming, key is what the partitioner reads
+static bool ReadCombined(FILE* out_file, bool streaming, char** line, size_t* capacity,
+                         std::string* key, std::string* record, bool* eof) {
+    *eof = false;
+    if (streaming) {
+        ssize_t n = getline(line, capacity, out_file);
+        if (n < 0) {
+            *eof = feof(out_file);
+            return *eof;
+        }
+        if (n > 0 && (*line)[n - 1] == '\n') {
+            n--;
+        }
+        record->assign(*line, n);
+        *key = *record;
+        return true;
+    }
+    int32_t key_len = 0;
+    int32_t value_len = 0;
+    if (fread(&key_len, sizeof(key_len), 1, out_file) != 1) {
+        *eof = feof(out_file);
+        return *eof;
+    }
+    if (key_len < 0 || key_len > sKeyLimit) {
+        LOG(WARNING, "invalid key len: %d", key_len);
+        return false;
+    }
+    key->resize(key_len);
+    if (key_len > 0 && (int32_t)fread(&(*key)[0], 1, key_len, out_file) != key_len) {
+        LOG(WARNING, "read key fail");
+        return false;
+    }
+    if (fread(&value_len, sizeof(value_len), 1, out_file) != 1 || value_len < 0) {
+        LOG(WARNING, "read value_len fail");
+        return false;
+    }
+    record->clear();
+    record->append((const char*)&key_len, sizeof(key_len));
+    record->append(*key);
+    record->append((const char*)&value_len, sizeof(value_len));
+    record->resize(record->size() + value_len);
+    if (value_len > 0 && (int32_t)fread(&(*record)[record->size() - value_len], 1,
+                                        value_len, out_file) != value_len) {
+        LOG(WARNING, "read value fail");
+        return false;
+    }
+    return true;
+}
+
+// Close the current spill of the combiner output and open the next one
+Status Emitter::RollCombined(SortFileWriter** writer) {
+    Status status = kOk;
+    if (*writer != NULL) {
+        status = (*writer)->Close();
+        delete *writer;
+        *writer = NULL;
+        if (status != kOk) {
+            return status;
+        }
+    }
+    std::string file_name;
+    FileType file_type;
+    {
+        MutexLock lock(&spill_mu_);
+        combine_files_++;
+        status = NextSpill(spill_threshold_,
+                           &file_name, &file_type);
+    }
+    if (status != kOk) {
+        return status;
+    }
+    *writer = OpenSpill(file_name, file_type, &status);
+    return status;
+}
+
+// The combiner output out of order so far, sorted into one more spill
+Status Emitter::SpillCombined() {
+    if (combined_table_.Count() == 0) {
+        return kOk;
+    }
+    std::string file_name;
+    FileType file_type;
+    Status status = kOk;
+    {
+        MutexLock lock(&spill_mu_);
+        combine_files_++;
+        status = NextSpill(combined_table_.MemoryUsage(), &file_name, &file_type);
+    }
+    if (status == kOk) {
+        //the sort pool is kept busy by the spill thread
+        combined_table_.Sort();
+        status = WriteSorted(&combined_table_, file_name, file_type);
+    }
+    combined_table_.Reset();
+    return status;
+}
+
+// Runs on a thread of its own: the combiner output is partitioned again
+// and written as spills, a new spill is started where the keys go back.
+// Every run fed starts over from the smallest keys, so more spills than
+// runs means the combiner does not keep the order (awk arrays, hashes),
+// the rest of its output is sorted in a memtable then
+void Emitter::ReadCombinerOutput(FILE* child_stdout) {
+    SortFileWriter* writer = NULL;
+    Status status = kOk;
+    char* line = NULL;
+    size_t capacity = 0;
+    std::string key;
+    std::string sort_key;
+    std::string record;
+    std::string raw_key;
+    std::string last_key;
+    char s_reduce_no[256];
+    int64_t records = 0;
+    bool unordered = false;
+    while (true) {
+        bool eof = false;
+        if (!ReadCombined(child_stdout, streaming_, &line, &capacity,
+                          &key, &record, &eof)) {
+            LOG(WARNING, "fail to read the output of the combiner");
+            status = kReadFileFail;
+            break;
+        }
+        if (eof) {
+            break;
+        }
+        if (streaming_ && record.empty()) {
+            continue;
+        }
+        int reduce_no = partitioner_->Calc(key, &sort_key);
+        snprintf(s_reduce_no, sizeof(s_reduce_no), "%05d\t", reduce_no);
+        raw_key = s_reduce_no;
+        raw_key += sort_key;
+        if (!unordered && writer != NULL && raw_key < last_key) {
+            MutexLock lock(&spill_mu_);
+            unordered = combine_files_ >= combine_runs_;
+        }
+        if (unordered && writer != NULL) {
+            LOG(WARNING, "the combiner does not keep the order of the keys, "
+                "sort the rest of its output");
+            status = writer->Close();
+            delete writer;
+            writer = NULL;
+            if (status != kOk) {
+                break;
+            }
+        }
+        if (unordered) {
+            if (!combined_table_.Add(reduce_no, sort_key, record)) {
+                LOG(WARNING, "ignore too large records");
+                continue;
+            }
+            records++;
+            //a quarter of a memtable, on top of the two the map fills
+            if (combined_table_.MemoryUsage() >= spill_threshold_ / 4) {
+                status = SpillCombined();
+                if (status != kOk) {
+                    break;
+                }
+            }
+            continue;
+        }
+        if (writer == NULL || raw_key < last_key) {
+            status = RollCombined(&writer);
+            if (status != kOk) {
+                break;
+            }
+        }
+        status = writer->Put(raw_key, record);
+        if (status != kOk) {
+            break;
+        }
+        last_key.swap(raw_key);
+        records++;
+    }
+    if (status == kOk && unordered) {
+        status = SpillCombined();
+    }
+    combined_table_.Reset();
+    if (status == kOk && writer == NULL && !unordered) {
+        //the map still has an output, an empty one
+        status = RollCombined(&writer);
+    }
+    if (writer != NULL) {
+        if (status == kOk) {
+            status = writer->Close();
+        }
+        delete writer;
+    }
+    free(line);
+    //a combiner still writing gets a broken pipe
+    fclose(child_stdout);
+    MutexLock lock(&spill_mu_);
+    combine_status_ = status;
+    combine_records_out_ = records;
+}
+
+Status Emitter::FinishCombiner() {
+    if (combiner_pid_ == 0) {
+        return kOk;
+    }
+    close(combiner_in_);
+    combine_reader_.Join();
+    int exit_status = 0;
+    waitpid(combiner_pid_, &exit_status, 0);
+    combiner_pid_ = 0;
+    MutexLock lock(&spill_mu_);
+    LOG(INFO, "combiner exit with status: %d, records: %lld -> %lld, %d runs -> %d spills",
+        exit_status, combine_records_in_, combine_records_out_,
+        combine_runs_, combine_files_);
+    if (combine_status_ == kOk && exit_status != 0) {
+        combine_status_ = kUnKnown;
+    }
+    return combine_status_;
+}
+
+Status Emitter::MergeSpills(const std::string& output, FileType file_type) {
+    if (file_type == kLocalFile && spill_files_.size() == 1
+            && spill_types_[0] == kLocalFile) {
+        //nothing to merge, the only spill is the output
+        FileSystem* fs = FileSystem::CreateLocalFs();
+        bool ok = fs->Rename(spill_files_[0], output);
+        delete fs;
+        return ok ? kOk : kWriteFileFail;
+    }
+    MergeFileReader reader;
+    Status status = reader.Open(spill_files_, hdfs_param_, spill_types_);
+    if (status != kOk) {
+        LOG(WARNING, "fail to open spill: %s", reader.GetErrorFile().c_str());
+        return status;
+    }
+    FileSystem::Param param = param_;
+    param["replica"] = "3";
+    int64_t records = 0;
+    status = reader.MergeTo(output, param, file_type, GetSortFileOptions(), &records);
+    if (status != kOk) {
+        LOG(WARNING, "fail to merge spills into %s: %s",
+            output.c_str(), reader.GetErrorFile().c_str());
+    } else {
+        LOG(INFO, "merge %d spills into %s, %lld records",
+            file_no_, output.c_str(), records);
+    }
+    reader.Close();
+    return status;
+}
+
+}
+}
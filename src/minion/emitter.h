@@ -0,0 +1,98 @@
+#ifndef _BAIDU_SHUTTLE_MINION_EMITTER_H_
+#define _BAIDU_SHUTTLE_MINION_EMITTER_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <string>
+#include <vector>
+#include "common/filesystem.h"
+#include "proto/shuttle.pb.h"
+#include "sort/sort_file.h"
+#include "mem_table.h"
+#include "mutex.h"
+#include "thread.h"
+#include "thread_pool.h"
+
+namespace baidu {
+namespace shuttle {
+
+class Partitioner;
+
+// Spills the sorted memtable to the local work_dir, or to hdfs_work_dir
+// when the local disk runs low, the spills are merged into the single
+// output of the map at last. There are two memtables: a full one is sorted
+// and written in the background while the records go on into the other one.
+// With a combiner, the sorted memtables are fed to one combiner process
+// that lives as long as the task, and its output is partitioned again
+// and written as the spills
+class Emitter {
+public:
+    // param reaches the dfs of the job, for the hdfs spills and the output
+    Emitter(const std::string& work_dir, const std::string& hdfs_work_dir,
+            const FileSystem::Param& param, const TaskInfo& task,
+            const Partitioner* partitioner);
+    ~Emitter();
+    Status Emit(int reduce_no, const std::string& key, const std::string& record) ;
+    void Reset();
+    Status FlushMemTable();
+    Status MergeSpills(const std::string& output, FileType file_type);
+private:
+    Status NextSpill(size_t usage, std::string* file_name, FileType* file_type);
+    Status StartSpill(size_t usage);
+    void BackgroundSpill(MemTable* table, const std::string& file_name, FileType file_type);
+    Status WriteSpill(MemTable* table, const std::string& file_name, FileType file_type);
+    Status WriteSorted(MemTable* table, const std::string& file_name, FileType file_type);
+    Status WaitForSpill();
+    SortFileWriter* OpenSpill(const std::string& file_name, FileType file_type,
+                              Status* status);
+    Status StartCombiner();
+    Status FeedCombiner(MemTable* table);
+    void ReadCombinerOutput(FILE* child_stdout);
+    Status RollCombined(SortFileWriter** writer);
+    Status SpillCombined();
+    Status FinishCombiner();
+    std::string work_dir_;
+    std::string hdfs_work_dir_;
+    FileSystem::Param param_;
+    FileSystem::Param hdfs_param_;
+    bool hdfs_spilled_;
+    std::vector<std::string> spill_files_;
+    std::vector<FileType> spill_types_;
+    MemTable mem_tables_[2];
+    int active_;
+    ThreadPool* sort_pool_;
+    ThreadPool* spill_pool_;
+    Mutex spill_mu_;
+    CondVar spill_cond_;
+    bool spilling_;
+    size_t spilling_usage_;
+    //a memtable is handed to the spill thread at spill_threshold_, the
+    //active one may grow to fill_limit_ before Emit looks again
+    size_t spill_threshold_;
+    size_t fill_limit_;
+    Status spill_status_;
+    int file_no_;
+    const Partitioner* partitioner_;
+    std::string combine_cmd_;
+    std::string combine_dir_;
+    bool streaming_;
+    pid_t combiner_pid_;
+    int combiner_in_;
+    common::Thread combine_reader_;
+    Status combine_status_;
+    //sorted runs fed to the combiner and spills of its output so far,
+    //under spill_mu_
+    int combine_runs_;
+    int combine_files_;
+    int64_t combine_records_in_;
+    int64_t combine_records_out_;
+    //the rest of the combiner output once it breaks the order of the keys,
+    //only touched by the thread reading the combiner
+    MemTable combined_table_;
+};
+
+}
+}
+
+#endif
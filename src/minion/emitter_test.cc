@@ -0,0 +1,121 @@
+#include <gtest/gtest.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <map>
+#include <string>
+#include <boost/scoped_ptr.hpp>
+#include <gflags/gflags.h>
+#include "emitter.h"
+#include "partition.h"
+#include "sort/sort_file.h"
+#include "common/filesystem.h"
+
+DECLARE_int32(map_spill_percent);
+
+using namespace baidu::shuttle;
+
+static const std::string sSpillDir = "./emitter_test_spill";
+//where the combiner runs, the work dir of map 0 attempt 0
+static const std::string sCombineDir = "./map_0_0";
+
+class EmitterTest : public testing::Test {
+protected:
+    virtual void SetUp() {
+        fs_.reset(FileSystem::CreateLocalFs());
+        fs_->Remove(sSpillDir);
+        fs_->Remove(sCombineDir);
+        ASSERT_TRUE(fs_->Mkdirs(sSpillDir));
+        ASSERT_TRUE(fs_->Mkdirs(sCombineDir));
+        task_.set_task_id(0);
+        task_.set_attempt_id(0);
+        task_.mutable_job()->set_pipe_style(kStreaming);
+        task_.mutable_job()->set_reduce_total(10);
+        task_.mutable_job()->set_key_separator("\t");
+    }
+    virtual void TearDown() {
+        fs_->Remove(sSpillDir);
+        fs_->Remove(sCombineDir);
+    }
+    // Emit "w<i % distinct>\t1" lines and merge the spills into the output
+    void EmitWords(int count, int distinct, const std::string& output) {
+        KeyFieldBasedPartitioner partitioner(task_);
+        Emitter emitter(sSpillDir, sSpillDir + "_hdfs", FileSystem::Param(),
+                        task_, &partitioner);
+        std::string key;
+        char line[64];
+        for (int i = 0; i < count; i++) {
+            snprintf(line, sizeof(line), "w%d\t1", i % distinct);
+            int reduce_no = partitioner.Calc(line, &key);
+            ASSERT_EQ(emitter.Emit(reduce_no, key, line), kOk);
+        }
+        ASSERT_EQ(emitter.FlushMemTable(), kOk);
+        ASSERT_EQ(emitter.MergeSpills(output, kLocalFile), kOk);
+    }
+    // The records of output in order, counted by their line
+    void ReadOutput(const std::string& output, std::map<std::string, int>* lines) {
+        Status status;
+        boost::scoped_ptr<SortFileReader> reader(SortFileReader::Create(kLocalFile, &status));
+        ASSERT_EQ(reader->Open(output, FileSystem::Param()), kOk);
+        boost::scoped_ptr<SortFileReader::Iterator> it(reader->Scan("", ""));
+        std::string last_key;
+        while (!it->Done()) {
+            std::string key = it->Key();
+            ASSERT_LE(last_key, key);
+            (*lines)[it->Value()]++;
+            last_key = key;
+            it->Next();
+        }
+        EXPECT_EQ(it->Error(), kNoMore);
+        it.reset();
+        EXPECT_EQ(reader->Close(), kOk);
+    }
+    boost::scoped_ptr<FileSystem> fs_;
+    TaskInfo task_;
+};
+
+TEST_F(EmitterTest, OrderedCombiner) {
+    task_.mutable_job()->set_combine_command("cat");
+    const std::string output = sSpillDir + "/out.sort";
+    EmitWords(300000, 5000, output);
+    std::map<std::string, int> lines;
+    ReadOutput(output, &lines);
+    ASSERT_EQ(lines.size(), 5000U);
+    EXPECT_EQ(lines["w0\t1"], 60);
+    EXPECT_EQ(lines["w4999\t1"], 60);
+}
+
+TEST_F(EmitterTest, ReorderingCombiner) {
+    //every run comes back in reverse, then a sum over an awk array
+    const char* combiners[] = {
+        "sort -r",
+        "awk -F'\\t' '{a[$1]+=$2} END {for (k in a) print k\"\\t\"a[k]}'"
+    };
+    for (size_t i = 0; i < sizeof(combiners) / sizeof(combiners[0]); i++) {
+        task_.mutable_job()->set_combine_command(combiners[i]);
+        fs_->Remove(sSpillDir);
+        ASSERT_TRUE(fs_->Mkdirs(sSpillDir));
+        const std::string output = sSpillDir + "/out.sort";
+        EmitWords(300000, 5000, output);
+        std::map<std::string, int> lines;
+        ReadOutput(output, &lines);
+        int64_t total = 0;
+        std::map<std::string, int64_t> sums;
+        std::map<std::string, int>::iterator it;
+        for (it = lines.begin(); it != lines.end(); it++) {
+            size_t tab = it->first.find('\t');
+            ASSERT_NE(tab, std::string::npos);
+            int64_t value = atoll(it->first.c_str() + tab + 1) * it->second;
+            sums[it->first.substr(0, tab)] += value;
+            total += value;
+        }
+        EXPECT_EQ(sums.size(), 5000U) << combiners[i];
+        EXPECT_EQ(total, 300000) << combiners[i];
+    }
+}
+
+int main(int argc, char* argv[]) {
+    testing::InitGoogleTest(&argc, argv);
+    //a spill every hundred thousand records or so, the combiner gets a few runs
+    FLAGS_map_spill_percent = 1;
+    return RUN_ALL_TESTS();
+}
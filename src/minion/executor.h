@@ -49,6 +49,9 @@ protected:
     bool MoveTempToShuffle(const TaskInfo& task);
     bool MoveByPassData(const TaskInfo& task, FileSystem* fs, bool is_map);
     const std::string GetShuffleWorkDir(const TaskInfo& task);
+    const std::string GetLocalShuffleDir(const TaskInfo& task);
+    const std::string GetMapSpillDir(const TaskInfo& task);
+    const std::string GetMapHdfsSpillDir(const TaskInfo& task);
 
     bool ReadLine(FILE* user_app, std::string* line);
     bool ReadRecord(FILE* user_app, std::string* key, std::string* value);
@@ -80,6 +83,8 @@ public:
                               const Partitioner* partitioner, Emitter* emitter);
     TaskState BiStreamingShuffle(FILE* user_app, const TaskInfo& task,
                                 const Partitioner* partitioner, Emitter* emitter);
+private:
+    TaskState RunMapper(const TaskInfo& task);
 };
 
 class ReduceExecutor : public Executor {
@@ -3,6 +3,11 @@
 #include <boost/algorithm/string/predicate.hpp>
 #include <boost/lexical_cast.hpp>
 #include <boost/scoped_ptr.hpp>
+#include <gflags/gflags.h>
+#include "shuffle_service.h"
+
+DECLARE_string(local_shuffle_dir);
+DECLARE_string(map_spill_dir);
 
 namespace baidu {
 namespace shuttle {
@@ -98,6 +103,7 @@ void Executor::SetEnv(const std::string& jobid, const TaskInfo& task,
              boost::lexical_cast<std::string>(task.attempt_id()).c_str(),
              1);
     ::setenv("minion_shuffle_work_dir", GetShuffleWorkDir(task).c_str(), 1);
+    ::setenv("minion_local_shuffle", task.job().local_shuffle() ? "true" : "false", 1);
     ::setenv("minion_input_dfs_host", task.job().input_dfs().host().c_str(), 1);
     ::setenv("minion_input_dfs_port", task.job().input_dfs().port().c_str(), 1);
     ::setenv("minion_input_dfs_user", task.job().input_dfs().user().c_str(), 1);
@@ -115,7 +121,9 @@ void Executor::SetEnv(const std::string& jobid, const TaskInfo& task,
             is_map = true;
         }
     }
-    if (!task.job().combine_command().empty() && is_map) {
+    //the map emitter runs the combiner on its sorted spills itself,
+    //combine_tool is only left in the pipe of map-only tasks
+    if (!task.job().combine_command().empty() && is_map && mode == kMapOnly) {
         std::string combiner_cmd = "./combine_tool -cmd '" 
                                    + task.job().combine_command() + "' ";
         if (task.job().partition() == kIntHashPartitioner) {
@@ -134,6 +142,34 @@ void Executor::SetEnv(const std::string& jobid, const TaskInfo& task,
         }
         ::setenv("minion_combiner_cmd", combiner_cmd.c_str(), 1);
         LOG(INFO, "combiner_cmd: %s", combiner_cmd.c_str());
+    } else {
+        ::unsetenv("minion_combiner_cmd");
+    }
+    if (!task.job().combine_command().empty() && mode == kReduce) {
+        //shuffle_tool combines the merged output of the maps of a tuo once more
+        std::string tuo_flags = "-combine_cmd='" + task.job().combine_command() + "' ";
+        tuo_flags += ("-reduce_total=" + boost::lexical_cast<std::string>(task.job().reduce_total()) + " ");
+        if (task.job().partition() == kIntHashPartitioner) {
+            tuo_flags += "-is_inthash=true ";
+        }
+        if (task.job().key_fields_num() > 1) {
+            tuo_flags += ("-num_key_fields=" + boost::lexical_cast<std::string>(task.job().key_fields_num()) + " ");
+        }
+        if (task.job().partition_fields_num() > 1) {
+            tuo_flags += ("-num_partition_fields=" + boost::lexical_cast<std::string>(task.job().partition_fields_num()) + " ");
+        }
+        if (task.job().pipe_style() == kStreaming) {
+            tuo_flags += "-pipe=streaming ";
+        } else if (task.job().pipe_style() == kBiStreaming) {
+            tuo_flags += "-pipe=bistreaming ";
+        }
+        if (!task.job().key_separator().empty()) {
+            tuo_flags += "-separator='" + task.job().key_separator() +"' ";
+        }
+        ::setenv("minion_tuo_combiner_flags", tuo_flags.c_str(), 1);
+        LOG(INFO, "tuo combiner flags: %s", tuo_flags.c_str());
+    } else {
+        ::unsetenv("minion_tuo_combiner_flags");
     }
     if (task.job().input_format() == kTextInput) {
         ::setenv("minion_input_format", "text", 1);
@@ -169,6 +205,11 @@ const std::string Executor::GetShuffleWorkDir(const TaskInfo& task) {
     return shuffle_work_dir;
 }
 
+const std::string Executor::GetLocalShuffleDir(const TaskInfo& task) {
+    return ShuffleService::GetOutputDir(FLAGS_local_shuffle_dir,
+                                        task.task_id(), task.attempt_id());
+}
+
 const std::string Executor::GetMapWorkFilename(const TaskInfo& task) {
     char output_file_name[4096];
     snprintf(output_file_name, sizeof(output_file_name), 
@@ -181,6 +222,28 @@ const std::string Executor::GetMapWorkFilename(const TaskInfo& task) {
     return output_file_name;
 }
 
+const std::string Executor::GetMapSpillDir(const TaskInfo& task) {
+    char spill_dir[4096];
+    snprintf(spill_dir, sizeof(spill_dir),
+            "%s/map_%d/attempt_%d",
+            FLAGS_map_spill_dir.c_str(),
+            task.task_id(),
+            task.attempt_id()
+            );
+    return spill_dir;
+}
+
+const std::string Executor::GetMapHdfsSpillDir(const TaskInfo& task) {
+    char spill_dir[4096];
+    snprintf(spill_dir, sizeof(spill_dir),
+            "%s/_temporary/map_spill/map_%d/attempt_%d",
+            task.job().output().c_str(),
+            task.task_id(),
+            task.attempt_id()
+            );
+    return spill_dir;
+}
+
 const std::string Executor::GetMapWorkDir(const TaskInfo& task) {
     char output_file_name[4096];
     snprintf(output_file_name, sizeof(output_file_name), 
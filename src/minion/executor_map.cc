@@ -9,6 +9,7 @@
 #include <logging.h>
 #include "sort/sort_file.h"
 #include "partition.h"
+#include "emitter.h"
 
 using baidu::common::WARNING;
 using baidu::common::INFO;
@@ -16,54 +17,6 @@ using baidu::common::INFO;
 namespace baidu {
 namespace shuttle {
 
-const static size_t sMaxInMemTable = 512 << 20;
-const static size_t sMaxRecordSize = 2 << 20;
-
-struct EmitItem {
-    int reduce_no;
-    std::string key;
-    std::string record;
-    EmitItem(int l_reduce_no, const std::string& l_key, const std::string& l_record) {
-        reduce_no = l_reduce_no;
-        key = l_key;
-        record = l_record;
-    }
-    inline size_t Size() {
-        return sizeof(int) + key.capacity() + record.capacity() + sizeof(EmitItem*);
-    }
-};
-
-struct EmitItemLess {
-    bool operator()(EmitItem* const& a , EmitItem* const& b) {
-        if (a->reduce_no < b->reduce_no) {
-            return true;
-        } else if (a->reduce_no == b->reduce_no) {
-            return a->key < b->key;
-        } else {
-            return false;
-        }
-    }
-};
-
-class Emitter {
-public:
-    Emitter(const std::string& work_dir, const TaskInfo& task) : task_(task) {
-        work_dir_ = work_dir;
-        cur_byte_size_ = 0;
-        file_no_ = 0;
-    }
-    ~Emitter();
-    Status Emit(int reduce_no, const std::string& key, const std::string& record) ;
-    void Reset();
-    Status FlushMemTable();
-private:
-    std::string work_dir_;
-    size_t cur_byte_size_;
-    std::vector<EmitItem*> mem_table_;
-    int file_no_;
-    const TaskInfo& task_;
-};
-
 MapExecutor::MapExecutor() {
     ::setenv("mapred_task_is_map", "true", 1);
 }
@@ -73,6 +26,17 @@ MapExecutor::~MapExecutor() {
 }
 
 TaskState MapExecutor::Exec(const TaskInfo& task) {
+    TaskState state = RunMapper(task);
+    FileSystem* local_fs = FileSystem::CreateLocalFs();
+    local_fs->Remove(GetMapSpillDir(task));
+    if (state != kTaskCompleted && task.job().local_shuffle()) {
+        local_fs->Remove(GetLocalShuffleDir(task));
+    }
+    delete local_fs;
+    return state;
+}
+
+TaskState MapExecutor::RunMapper(const TaskInfo& task) {
     LOG(INFO, "exec map task");
     ::setenv("mapred_work_output_dir", GetMapWorkDir(task).c_str(), 1);
     std::string cmd = "sh ./app_wrapper.sh \"" + task.job().map_command() + "\"";
@@ -93,11 +57,32 @@ TaskState MapExecutor::Exec(const TaskInfo& task) {
 
     FileSystem::Param param;
     FillParam(param, task);
-    FileSystem* fs = FileSystem::CreateInfHdfs(param);
-    fs->Mkdirs(GetShuffleWorkDir(task));
+    FileSystem* fs = FileSystem::CreateLocalFs();
+    const std::string spill_dir = GetMapSpillDir(task);
+    fs->Remove(spill_dir);
+    if (!fs->Mkdirs(spill_dir)) {
+        LOG(WARNING, "fail to make spill dir: %s", spill_dir.c_str());
+        delete fs;
+        pclose(user_app);
+        return kTaskFailed;
+    }
+    //the output of a local shuffle job stays here for the reducers to fetch
+    std::string output_dir;
+    FileType output_type = kHdfsFile;
+    if (task.job().local_shuffle()) {
+        output_dir = GetLocalShuffleDir(task);
+        fs->Remove(output_dir);
+        fs->Mkdirs(output_dir);
+        output_type = kLocalFile;
+    } else {
+        delete fs;
+        fs = FileSystem::CreateInfHdfs(param);
+        fs->Mkdirs(GetShuffleWorkDir(task));
+        output_dir = GetMapWorkDir(task);
+    }
     delete fs;
 
-    Emitter emitter(GetMapWorkDir(task), task);
+    Emitter emitter(spill_dir, GetMapHdfsSpillDir(task), param, task, partitioner);
     if (task.job().pipe_style() == kStreaming) {
         TaskState state = StreamingShuffle(user_app, task, partitioner, &emitter);
         if (state != kTaskCompleted) {
@@ -122,91 +107,22 @@ TaskState MapExecutor::Exec(const TaskInfo& task) {
         LOG(WARNING, "user app fail, cmd is %s, ret: %d", cmd.c_str(), ret);
         return kTaskFailed;
     }
-    if (!MoveTempToShuffle(task)) {
+    status = emitter.MergeSpills(output_dir + "/0.sort", output_type);
+    if (status != kOk) {
+        LOG(WARNING, "merge spills fail, %s", Status_Name(status).c_str());
+        return kTaskFailed;
+    }
+    if (task.job().local_shuffle()) {
+        fs = FileSystem::CreateInfHdfs(param);
+        MoveByPassData(task, fs, true);
+        delete fs;
+    } else if (!MoveTempToShuffle(task)) {
         LOG(WARNING, "move map result to shuffle dir fail");
         return kTaskFailed;
     }
     return kTaskCompleted;
 }
 
-Emitter::~Emitter() {
-    Reset();
-}
-
-void Emitter::Reset() {
-    cur_byte_size_ = 0;
-    std::vector<EmitItem*>::iterator it;
-    for (it = mem_table_.begin(); it != mem_table_.end(); it++) {
-        delete (*it);
-    }
-    std::vector<EmitItem*>().swap(mem_table_);
-}
-
-Status Emitter::Emit(int reduce_no, const std::string& key, const std::string& record) {
-    EmitItem* item = new EmitItem(reduce_no, key, record);
-    if (item->Size() > sMaxRecordSize) {
-        LOG(WARNING, "ignore too large records");
-        delete item;
-        return kOk;
-    }
-    mem_table_.push_back(item);
-    cur_byte_size_ += item->Size();
-    
-    if (cur_byte_size_ < sMaxInMemTable) {
-        return kOk; //memtable is not big enough
-    }
-
-    return FlushMemTable();
-}
-
-Status Emitter::FlushMemTable() {
-    SortFileWriter* writer = NULL;
-    Status status = kOk;
-    char file_name[4096];
-    char s_reduce_no[256];
-    do {
-        std::sort(mem_table_.begin(), mem_table_.end(), EmitItemLess());
-        writer = SortFileWriter::Create(kHdfsFile, &status);
-        if (status != kOk) {
-            break;
-        }
-        FileSystem::Param param;
-        Executor::FillParam(param, task_);
-        param["replica"] = "3";
-        snprintf(file_name, sizeof(file_name), "%s/%d.sort",
-                 work_dir_.c_str(), file_no_);
-        status = writer->Open(file_name, param);
-        if (status != kOk) {
-            break;
-        }
-        if (mem_table_.empty()) {
-            break;
-        }
-
-        std::vector<EmitItem*>::iterator it;
-        for (it = mem_table_.begin(); it != mem_table_.end(); it++) {
-            EmitItem* item = *it;
-            snprintf(s_reduce_no, sizeof(s_reduce_no), "%05d", item->reduce_no);
-            std::string raw_key = s_reduce_no;
-            raw_key += "\t";
-            raw_key += item->key;
-            status = writer->Put(raw_key, item->record);
-            if (status != kOk) {
-                break;
-            }
-        }
-    } while(0);
-    
-    if (status == kOk) {
-        status = writer->Close();
-        file_no_ ++;
-    }
-    delete writer;
-    Reset();
-    return status;
-}
-
-
 TaskState MapExecutor::StreamingShuffle(FILE* user_app, const TaskInfo& task,
                                         const Partitioner* partitioner, Emitter* emitter) {
     while (!feof(user_app)) {
@@ -0,0 +1,173 @@
+#include "mem_table.h"
+#include <string.h>
+#include <algorithm>
+#include <boost/bind.hpp>
+#include <boost/function.hpp>
+#include "mutex.h"
+
+namespace baidu {
+namespace shuttle {
+
+static uint64_t KeyPrefix(const Slice& key) {
+    uint64_t prefix = 0;
+    size_t n = std::min(key.size(), sizeof(prefix));
+    for (size_t i = 0; i < n; i++) {
+        prefix |= static_cast<uint64_t>(static_cast<unsigned char>(key[i])) << (56 - 8 * i);
+    }
+    return prefix;
+}
+
+// Entries of the same bucket share the reduce_no
+struct EntryKeyLess {
+    bool operator()(const MemTable::Entry& a, const MemTable::Entry& b) const {
+        if (a.prefix != b.prefix) {
+            return a.prefix < b.prefix;
+        }
+        return a.Key().compare(b.Key()) < 0;
+    }
+};
+
+// Buckets handed to the pool in one task are about this many entries
+const static size_t sMinEntriesPerTask = 64 << 10;
+
+struct SortLatch {
+    Mutex mu;
+    CondVar cond;
+    int pending;
+    SortLatch() : cond(&mu), pending(0) { }
+};
+
+static void RunSortTask(boost::function<void ()> task, SortLatch* latch) {
+    task();
+    MutexLock lock(&latch->mu);
+    if (--latch->pending == 0) {
+        latch->cond.Signal();
+    }
+}
+
+MemTable::MemTable() : cur_chunk_(0), chunk_used_(0), max_reduce_no_(-1) {
+
+}
+
+MemTable::~MemTable() {
+    std::vector<char*>::iterator it;
+    for (it = chunks_.begin(); it != chunks_.end(); it++) {
+        delete[] (*it);
+    }
+}
+
+char* MemTable::Allocate(size_t size) {
+    if (chunks_.empty()) {
+        chunks_.push_back(new char[kChunkSize]);
+    }
+    if (chunk_used_ + size > kChunkSize) {
+        cur_chunk_++;
+        chunk_used_ = 0;
+        if (cur_chunk_ == chunks_.size()) {
+            chunks_.push_back(new char[kChunkSize]);
+        }
+    }
+    char* buf = chunks_[cur_chunk_] + chunk_used_;
+    chunk_used_ += size;
+    return buf;
+}
+
+bool MemTable::Add(int reduce_no, const Slice& key, const Slice& record) {
+    size_t size = key.size() + record.size();
+    if (size > kChunkSize || reduce_no < 0) {
+        return false;
+    }
+    char* buf = Allocate(size);
+    memcpy(buf, key.data(), key.size());
+    memcpy(buf + key.size(), record.data(), record.size());
+    Entry entry;
+    entry.prefix = KeyPrefix(key);
+    entry.data = buf;
+    entry.reduce_no = reduce_no;
+    entry.key_len = key.size();
+    entry.record_len = record.size();
+    entries_.push_back(entry);
+    if (reduce_no > max_reduce_no_) {
+        max_reduce_no_ = reduce_no;
+    }
+    return true;
+}
+
+void MemTable::BucketByReduce(std::vector<size_t>* bucket_begin) {
+    size_t buckets = max_reduce_no_ + 1;
+    bucket_begin->assign(buckets + 1, 0);
+    for (size_t i = 0; i < entries_.size(); i++) {
+        (*bucket_begin)[entries_[i].reduce_no + 1]++;
+    }
+    for (size_t b = 0; b < buckets; b++) {
+        (*bucket_begin)[b + 1] += (*bucket_begin)[b];
+    }
+    //one sequential pass copying into the buckets, much kinder to the cache
+    //than swapping the entries into place
+    std::vector<size_t> next(bucket_begin->begin(), bucket_begin->end() - 1);
+    scratch_.resize(entries_.size());
+    for (size_t i = 0; i < entries_.size(); i++) {
+        scratch_[next[entries_[i].reduce_no]++] = entries_[i];
+    }
+    entries_.swap(scratch_);
+}
+
+void MemTable::SortBuckets(const std::vector<size_t>* bucket_begin,
+                           size_t from, size_t to) {
+    for (size_t b = from; b < to; b++) {
+        std::sort(entries_.begin() + (*bucket_begin)[b],
+                  entries_.begin() + (*bucket_begin)[b + 1], EntryKeyLess());
+    }
+}
+
+void MemTable::Sort(ThreadPool* pool) {
+    if (entries_.empty()) {
+        return;
+    }
+    std::vector<size_t> bucket_begin;
+    BucketByReduce(&bucket_begin);
+    size_t buckets = bucket_begin.size() - 1;
+    if (pool == NULL || entries_.size() < 2 * sMinEntriesPerTask) {
+        SortBuckets(&bucket_begin, 0, buckets);
+        return;
+    }
+    //neighbouring buckets are grouped so that thousands of small buckets
+    //do not end up as thousands of tasks
+    SortLatch latch;
+    std::vector<boost::function<void ()> > tasks;
+    size_t from = 0;
+    for (size_t b = 0; b < buckets; b++) {
+        if (bucket_begin[b + 1] - bucket_begin[from] >= sMinEntriesPerTask
+                || b + 1 == buckets) {
+            tasks.push_back(boost::bind(&MemTable::SortBuckets, this,
+                                        &bucket_begin, from, b + 1));
+            from = b + 1;
+        }
+    }
+    latch.pending = tasks.size();
+    for (size_t i = 0; i < tasks.size(); i++) {
+        pool->AddTask(boost::bind(&RunSortTask, tasks[i], &latch));
+    }
+    MutexLock lock(&latch.mu);
+    while (latch.pending > 0) {
+        latch.cond.Wait();
+    }
+}
+
+size_t MemTable::MemoryUsage() const {
+    return cur_chunk_ * kChunkSize + chunk_used_
+        + entries_.size() * sizeof(Entry);
+}
+
+void MemTable::Reset() {
+    cur_chunk_ = 0;
+    chunk_used_ = 0;
+    entries_.clear();
+    //only needed while sorting, not kept to weigh on the next records
+    std::vector<Entry>().swap(scratch_);
+    max_reduce_no_ = -1;
+}
+
+}
+}
+
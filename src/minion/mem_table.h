@@ -0,0 +1,75 @@
+#ifndef _BAIDU_SHUTTLE_MINION_MEM_TABLE_H_
+#define _BAIDU_SHUTTLE_MINION_MEM_TABLE_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+#include "common/slice.h"
+#include "thread_pool.h"
+
+namespace baidu {
+namespace shuttle {
+
+// The records emitted by a mapper before they are spilled. Keys and records
+// are copied one after another into large arena chunks, and only a small
+// entry of every record is sorted, no object or string per record
+class MemTable {
+public:
+    struct Entry {
+        // the first 8 bytes of the key, big endian and zero padded,
+        // most keys are told apart by it without touching the arena
+        uint64_t prefix;
+        // the key, followed by the record
+        const char* data;
+        int32_t reduce_no;
+        uint32_t key_len;
+        uint32_t record_len;
+        Slice Key() const {
+            return Slice(data, key_len);
+        }
+        Slice Record() const {
+            return Slice(data + key_len, record_len);
+        }
+    };
+    // A key and record larger than this are not taken
+    static const size_t kChunkSize = 4 << 20;
+
+    MemTable();
+    ~MemTable();
+    bool Add(int reduce_no, const Slice& key, const Slice& record);
+    // Order the entries by reduce_no and key. The entries are first counted
+    // into buckets by reduce_no, then the buckets are sorted by key, on the
+    // pool if there is one
+    void Sort(ThreadPool* pool = NULL);
+    size_t Count() const {
+        return entries_.size();
+    }
+    const Entry& Get(size_t n) const {
+        return entries_[n];
+    }
+    // Bytes taken by the records and the entries added since the last
+    // Reset, the capacity kept for the next records is not counted
+    size_t MemoryUsage() const;
+    // Drop all the records, the chunks are kept for the next ones
+    void Reset();
+private:
+    char* Allocate(size_t size);
+    // Move every entry into the bucket of its reduce_no, bucket_begin gets
+    // where every bucket starts, plus the end of the last one
+    void BucketByReduce(std::vector<size_t>* bucket_begin);
+    void SortBuckets(const std::vector<size_t>* bucket_begin,
+                     size_t from, size_t to);
+    std::vector<char*> chunks_;
+    size_t cur_chunk_;
+    size_t chunk_used_;
+    std::vector<Entry> entries_;
+    // where the entries are bucketed into, released by Reset
+    std::vector<Entry> scratch_;
+    int max_reduce_no_;
+};
+
+}
+}
+
+#endif
+
@@ -0,0 +1,101 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <sys/time.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <gflags/gflags.h>
+#include <boost/algorithm/string.hpp>
+#include "mem_table.h"
+
+DEFINE_int32(records, 4000000, "records in the memtable");
+DEFINE_int32(key_size, 16, "bytes of every key");
+DEFINE_int32(value_size, 64, "bytes of every value");
+DEFINE_string(reducers, "1000,10000", "numbers of reducers to try");
+DEFINE_int32(threads, 4, "threads of the bucketed sort");
+DEFINE_int32(rounds, 3, "sorts of every kind");
+
+using namespace baidu::shuttle;
+
+static double NowSeconds() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+// What the spill did before the buckets: one sort over the whole memtable
+struct EntryLess {
+    bool operator()(const MemTable::Entry& a, const MemTable::Entry& b) const {
+        if (a.reduce_no != b.reduce_no) {
+            return a.reduce_no < b.reduce_no;
+        }
+        if (a.prefix != b.prefix) {
+            return a.prefix < b.prefix;
+        }
+        return a.Key().compare(b.Key()) < 0;
+    }
+};
+
+void Fill(int reducers, MemTable* table) {
+    table->Reset();
+    unsigned int seed = 2016;
+    std::string key(FLAGS_key_size, 'k');
+    std::string value(FLAGS_value_size, 'v');
+    for (int i = 0; i < FLAGS_records; i++) {
+        for (size_t j = 0; j < key.size(); j++) {
+            key[j] = 'a' + rand_r(&seed) % 26;
+        }
+        table->Add(rand_r(&seed) % reducers, key, value);
+    }
+}
+
+double OneSort(MemTable* table) {
+    std::vector<MemTable::Entry> entries;
+    entries.reserve(table->Count());
+    for (size_t i = 0; i < table->Count(); i++) {
+        entries.push_back(table->Get(i));
+    }
+    double start = NowSeconds();
+    std::sort(entries.begin(), entries.end(), EntryLess());
+    return NowSeconds() - start;
+}
+
+double BucketSort(MemTable* table, ThreadPool* pool) {
+    double start = NowSeconds();
+    table->Sort(pool);
+    double cost = NowSeconds() - start;
+    for (size_t i = 1; i < table->Count(); i++) {
+        if (EntryLess()(table->Get(i), table->Get(i - 1))) {
+            fprintf(stderr, "out of order at %ld\n", i);
+            exit(-1);
+        }
+    }
+    return cost;
+}
+
+void DoSort(int reducers) {
+    MemTable table;
+    ThreadPool pool(FLAGS_threads);
+    for (int round = 0; round < FLAGS_rounds; round++) {
+        Fill(reducers, &table);
+        double one_cost = OneSort(&table);
+        double inline_cost = BucketSort(&table, NULL);
+        Fill(reducers, &table);
+        double pool_cost = BucketSort(&table, &pool);
+        printf("reducers: %d, records: %d, one sort: %.3fs, "
+               "buckets: %.3fs (%.2fx), buckets on %d threads: %.3fs (%.2fx)\n",
+               reducers, FLAGS_records, one_cost,
+               inline_cost, one_cost / inline_cost,
+               FLAGS_threads, pool_cost, one_cost / pool_cost);
+    }
+}
+
+int main(int argc, char* argv[]) {
+    google::ParseCommandLineFlags(&argc, &argv, true);
+    std::vector<std::string> reducers;
+    boost::split(reducers, FLAGS_reducers, boost::is_any_of(","));
+    for (size_t i = 0; i < reducers.size(); i++) {
+        DoSort(atoi(reducers[i].c_str()));
+    }
+    return 0;
+}
@@ -0,0 +1,121 @@
+#include <gtest/gtest.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <string>
+#include <utility>
+#include <vector>
+#include "mem_table.h"
+
+using namespace baidu::shuttle;
+
+TEST(MemTable, SortOrder) {
+    //keys sharing the prefix, shorter keys and zero bytes
+    std::vector<std::pair<int, std::string> > keys;
+    keys.push_back(std::make_pair(1, std::string("abcdefghij")));
+    keys.push_back(std::make_pair(1, std::string("abcdefgh")));
+    keys.push_back(std::make_pair(1, std::string("abcdefghia")));
+    keys.push_back(std::make_pair(0, std::string("zzz")));
+    keys.push_back(std::make_pair(1, std::string("a")));
+    keys.push_back(std::make_pair(1, std::string("a\0", 2)));
+    keys.push_back(std::make_pair(1, std::string("")));
+    keys.push_back(std::make_pair(2, std::string("\xff\xfe")));
+    keys.push_back(std::make_pair(2, std::string("\x01")));
+    MemTable table;
+    for (size_t i = 0; i < keys.size(); i++) {
+        EXPECT_TRUE(table.Add(keys[i].first, keys[i].second, "record_" + keys[i].second));
+    }
+    table.Sort();
+    std::sort(keys.begin(), keys.end());
+    ASSERT_EQ(table.Count(), keys.size());
+    for (size_t i = 0; i < keys.size(); i++) {
+        const MemTable::Entry& entry = table.Get(i);
+        EXPECT_EQ(entry.reduce_no, keys[i].first);
+        EXPECT_EQ(entry.Key().ToString(), keys[i].second);
+        EXPECT_EQ(entry.Record().ToString(), "record_" + keys[i].second);
+    }
+}
+
+TEST(MemTable, ManyChunks) {
+    MemTable table;
+    std::vector<std::string> keys;
+    unsigned int seed = 1234;
+    std::string record(1000, 'r');
+    for (int i = 0; i < 20000; i++) {
+        char key[64];
+        snprintf(key, sizeof(key), "key_%d", rand_r(&seed) % 100000);
+        keys.push_back(key);
+        EXPECT_TRUE(table.Add(0, key, record));
+    }
+    EXPECT_GT(table.MemoryUsage(), 20000U * 1000);
+    table.Sort();
+    std::sort(keys.begin(), keys.end());
+    for (size_t i = 0; i < keys.size(); i++) {
+        EXPECT_EQ(table.Get(i).Key().ToString(), keys[i]);
+        EXPECT_EQ(table.Get(i).Record().size(), record.size());
+    }
+    table.Reset();
+    EXPECT_EQ(table.Count(), 0U);
+    EXPECT_TRUE(table.Add(3, "again", "value"));
+    EXPECT_EQ(table.Get(0).Key().ToString(), "again");
+    EXPECT_EQ(table.Get(0).Record().ToString(), "value");
+}
+
+TEST(MemTable, ParallelSort) {
+    MemTable table;
+    std::vector<std::pair<int, std::string> > keys;
+    unsigned int seed = 4321;
+    for (int i = 0; i < 300000; i++) {
+        //a few big buckets and many small ones
+        int reduce_no = (i % 3 == 0) ? rand_r(&seed) % 4 : rand_r(&seed) % 1000;
+        char key[64];
+        snprintf(key, sizeof(key), "%x", rand_r(&seed));
+        keys.push_back(std::make_pair(reduce_no, std::string(key)));
+        EXPECT_TRUE(table.Add(reduce_no, key, "v"));
+    }
+    ThreadPool pool(4);
+    table.Sort(&pool);
+    std::sort(keys.begin(), keys.end());
+    ASSERT_EQ(table.Count(), keys.size());
+    for (size_t i = 0; i < keys.size(); i++) {
+        ASSERT_EQ(table.Get(i).reduce_no, keys[i].first);
+        ASSERT_EQ(table.Get(i).Key().ToString(), keys[i].second);
+    }
+}
+
+static size_t FillUntil(MemTable* table, size_t limit) {
+    size_t count = 0;
+    char key[64];
+    while (table->MemoryUsage() < limit) {
+        snprintf(key, sizeof(key), "w%d", (int)(count % 5000));
+        EXPECT_TRUE(table->Add(count % 7, key, "1"));
+        count++;
+    }
+    return count;
+}
+
+TEST(MemTable, UsageAfterReset) {
+    //small records like word count, the entries outweigh the arena
+    MemTable table;
+    const size_t limit = 16 << 20;
+    size_t first = FillUntil(&table, limit);
+    table.Sort();
+    table.Reset();
+    EXPECT_EQ(table.MemoryUsage(), 0U);
+    size_t second = FillUntil(&table, limit);
+    EXPECT_EQ(first, second);
+}
+
+TEST(MemTable, TooLarge) {
+    MemTable table;
+    std::string record(MemTable::kChunkSize, 'r');
+    EXPECT_FALSE(table.Add(0, "key", record));
+    EXPECT_EQ(table.Count(), 0U);
+    record.resize(MemTable::kChunkSize - 3);
+    EXPECT_TRUE(table.Add(0, "key", record));
+}
+
+int main(int argc, char* argv[]) {
+    testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
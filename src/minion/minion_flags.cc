@@ -10,3 +10,12 @@ DEFINE_int32(suspend_time, 60, "suspend time in seconds when receive suspend op"
 DEFINE_int32(max_minions, 25, "max number of minions at one machine");
 DEFINE_int64(flow_limit_10gb, 800L * 1024 * 1024, "the limit of network traffic for 10gb machine, default is 384M");
 DEFINE_int64(flow_limit_1gb, 84L * 1024 * 1024, "the limit of network traffic for 1gb machine, default is 64M");
+DEFINE_int32(sort_file_format, 2, "format of map output: 2, or 3 with per-block codecs and crc32c, which every reducer of the job must read");
+DEFINE_string(sort_file_codec, "snappy", "codec of map output blocks in format 3: none/snappy/lz4/zstd");
+DEFINE_int32(sort_file_codec_level, 1, "compression level of map output, zstd only");
+DEFINE_int32(sort_file_compress_threads, 2, "threads compressing map output blocks, 0 compresses inline");
+DEFINE_string(local_shuffle_dir, "./local_shuffle", "where the map outputs of local shuffle jobs are kept and served");
+DEFINE_int32(map_sort_threads, 4, "threads sorting the buckets of a map spill, 1 sorts inline");
+DEFINE_int32(map_spill_percent, 50, "a map memtable is spilled in the background at this percent of the memory budget, the other one takes the rest, 1 to 100");
+DEFINE_int64(map_spill_reserve_mb, 512, "a map spills to hdfs when the local disk would have less than this left after the spill");
+DEFINE_string(map_spill_dir, "./map_spill", "where the spills of a map are kept until merged into its output");
@@ -18,6 +18,7 @@ DECLARE_bool(kill_task);
 DECLARE_int32(suspend_time);
 DECLARE_int64(flow_limit_10gb);
 DECLARE_int64(flow_limit_1gb);
+DECLARE_string(local_shuffle_dir);
 
 using baidu::common::Log;
 using baidu::common::FATAL;
@@ -33,7 +34,9 @@ MinionImpl::MinionImpl() : ins_(FLAGS_nexus_addr),
                            stop_(false),
                            task_frozen_(false),
                            over_loaded_(false),
-                           frozen_time_(0) {
+                           frozen_time_(0),
+                           shuffle_service_(FLAGS_local_shuffle_dir),
+                           serving_output_(false) {
     if (FLAGS_work_mode == "map") {
         executor_ = Executor::GetExecutor(kMap);
         work_mode_ =  kMap;
@@ -165,6 +168,18 @@ void MinionImpl::CancelTask(::google::protobuf::RpcController*,
     done->Run();
 }
 
+void MinionImpl::FetchMapOutput(::google::protobuf::RpcController*,
+                                const ::baidu::shuttle::FetchMapOutputRequest* request,
+                                ::baidu::shuttle::FetchMapOutputResponse* response,
+                                ::google::protobuf::Closure* done) {
+    if (request->job_id() != jobid_) {
+        response->set_status(kNoSuchJob);
+    } else {
+        shuffle_service_.Fetch(request, response);
+    }
+    done->Run();
+}
+
 void MinionImpl::SetEndpoint(const std::string& endpoint) {
     LOG(INFO, "minon bind endpoint on : %s", endpoint.c_str());
     endpoint_ = endpoint;
@@ -211,7 +226,12 @@ void MinionImpl::Loop() {
                 break;
             }
         }
-        if (response.status() == kNoMore) {
+        if (response.status() == kNoMore && serving_output_) {
+            //the reducers fetch from here, and a lost output is run again here
+            LOG(INFO, "no more task, keep serving the map output");
+            SleepRandomTime();
+            continue;
+        } else if (response.status() == kNoMore) {
             LOG(INFO, "master has no more task for minion, so exit.");
             break;
         } else if (response.status() == kNoSuchJob) {
@@ -228,6 +248,8 @@ void MinionImpl::Loop() {
         const TaskInfo& task = response.task();
         SaveBreakpoint(task);
         executor_->SetEnv(jobid_, task, work_mode_);
+        //shuffle_tool asks the master for the tuos to merge
+        ::setenv("minion_master_endpoint", master_endpoint_.c_str(), 1);
         {
             MutexLock locker(&mu_);
             cur_task_id_ = task.task_id();
@@ -241,6 +263,10 @@ void MinionImpl::Loop() {
             cur_task_state_ = task_state;
         }
         LOG(INFO, "exec done, task state: %s", TaskState_Name(task_state).c_str());
+        if (task_state == kTaskCompleted && work_mode_ == kMap
+            && task.job().local_shuffle()) {
+            serving_output_ = true;
+        }
         std::string error_msg;
         if (task_state == kTaskFailed) {
             error_msg = executor_->GetErrorMsg(task, (work_mode_ != kReduce));
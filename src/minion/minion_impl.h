@@ -7,6 +7,7 @@
 #include "proto/minion.pb.h"
 #include "ins_sdk.h"
 #include "executor.h"
+#include "shuffle_service.h"
 #include "common/net_statistics.h"
 
 namespace baidu {
@@ -26,6 +27,10 @@ public:
                     const ::baidu::shuttle::CancelTaskRequest* request,
                     ::baidu::shuttle::CancelTaskResponse* response,
                     ::google::protobuf::Closure* done);
+    void FetchMapOutput(::google::protobuf::RpcController* controller,
+                        const ::baidu::shuttle::FetchMapOutputRequest* request,
+                        ::baidu::shuttle::FetchMapOutputResponse* response,
+                        ::google::protobuf::Closure* done);
     void SetEndpoint(const std::string& endpoint);
     void SetJobId(const std::string& jobid);
     bool Run();
@@ -55,6 +60,9 @@ private:
     bool task_frozen_;
     bool over_loaded_;
     time_t frozen_time_;
+    ShuffleService shuffle_service_;
+    // some map output of a local shuffle job is served from here
+    bool serving_output_;
 };
 
 }
@@ -0,0 +1,208 @@
+#include "shuffle_service.h"
+#include <stdio.h>
+#include <algorithm>
+#include <boost/algorithm/string/predicate.hpp>
+#include <boost/scoped_ptr.hpp>
+#include "logging.h"
+#include "sort/sort_file.h"
+#include "common/filesystem.h"
+
+using baidu::common::Log;
+using baidu::common::INFO;
+using baidu::common::WARNING;
+
+namespace baidu {
+namespace shuttle {
+
+const static int32_t sDefaultFetchSize = 4 << 20;
+const static int32_t sMaxFetchSize = 32 << 20;
+//scans kept open between the pages of a fetch, and how long one lasts unused
+const static int sMaxSessions = 256;
+const static time_t sSessionIdle = 120;
+
+ShuffleService::~ShuffleService() {
+    std::map<std::string, Session*>::iterator it;
+    for (it = sessions_.begin(); it != sessions_.end(); it++) {
+        CloseSession(it->second);
+    }
+}
+
+std::string ShuffleService::GetOutputDir(const std::string& root,
+                                         int map_no, int attempt_id) {
+    char dir[4096];
+    snprintf(dir, sizeof(dir), "%s/map_%d/attempt_%d",
+             root.c_str(), map_no, attempt_id);
+    return dir;
+}
+
+bool ShuffleService::ListSortFiles(const std::string& dir,
+                                   std::vector<std::string>* files) {
+    boost::scoped_ptr<FileSystem> fs(FileSystem::CreateLocalFs());
+    std::vector<FileInfo> children;
+    if (!fs->List(dir, &children)) {
+        return false;
+    }
+    for (size_t i = 0; i < children.size(); i++) {
+        if (children[i].kind == 'F' &&
+            boost::ends_with(children[i].name, ".sort")) {
+            files->push_back(children[i].name);
+        }
+    }
+    std::sort(files->begin(), files->end());
+    return true;
+}
+
+ShuffleService::Session* ShuffleService::OpenSession(const FetchMapOutputRequest* request,
+                                                     Status* status) {
+    const std::string dir = GetOutputDir(root_, request->map_no(),
+                                         request->attempt_id());
+    std::vector<std::string> files;
+    if (!ListSortFiles(dir, &files)) {
+        LOG(WARNING, "no output of map %d, attempt %d here",
+            request->map_no(), request->attempt_id());
+        *status = kNoSuchTask;
+        return NULL;
+    }
+    char start_key[32];
+    char end_key[32];
+    snprintf(start_key, sizeof(start_key), "%05d\t", request->reduce_from());
+    snprintf(end_key, sizeof(end_key), "%05d\t", request->reduce_to() + 1);
+    Session* session = new Session();
+    *status = session->reader.Open(files, FileSystem::Param(), kLocalFile);
+    if (*status != kOk) {
+        LOG(WARNING, "fail to open: %s", session->reader.GetErrorFile().c_str());
+        delete session;
+        return NULL;
+    }
+    const std::string& from = request->has_start_key() ?
+                              request->start_key() : std::string(start_key);
+    session->it = session->reader.Scan(from, end_key);
+    int64_t skip = request->skip();
+    while (skip > 0 && !session->it->Done() && session->it->Key() == from) {
+        session->it->Next();
+        skip--;
+    }
+    session->offset = request->offset();
+    return session;
+}
+
+ShuffleService::Session* ShuffleService::TakeSession(const std::string& key, int64_t offset) {
+    Session* session = NULL;
+    Session* stale = NULL;
+    {
+        MutexLock lock(&mu_);
+        std::map<std::string, Session*>::iterator it = sessions_.find(key);
+        if (it == sessions_.end()) {
+            return NULL;
+        }
+        //a retry of a page whose response was lost starts over
+        if (it->second->offset == offset) {
+            session = it->second;
+        } else {
+            stale = it->second;
+        }
+        sessions_.erase(it);
+    }
+    if (stale != NULL) {
+        CloseSession(stale);
+    }
+    return session;
+}
+
+void ShuffleService::PutSession(const std::string& key, Session* session) {
+    std::vector<Session*> expired;
+    {
+        MutexLock lock(&mu_);
+        time_t now = ::time(NULL);
+        session->last_used = now;
+        //the reducers that went away leave their sessions behind
+        std::map<std::string, Session*>::iterator it = sessions_.begin();
+        std::map<std::string, Session*>::iterator oldest = sessions_.end();
+        while (it != sessions_.end()) {
+            if (now - it->second->last_used > sSessionIdle) {
+                expired.push_back(it->second);
+                sessions_.erase(it++);
+                continue;
+            }
+            if (oldest == sessions_.end() ||
+                it->second->last_used < oldest->second->last_used) {
+                oldest = it;
+            }
+            ++it;
+        }
+        if ((int)sessions_.size() >= sMaxSessions && oldest != sessions_.end()) {
+            expired.push_back(oldest->second);
+            sessions_.erase(oldest);
+        }
+        it = sessions_.find(key);
+        if (it != sessions_.end()) {
+            expired.push_back(it->second);
+            it->second = session;
+        } else {
+            sessions_[key] = session;
+        }
+    }
+    for (size_t i = 0; i < expired.size(); i++) {
+        CloseSession(expired[i]);
+    }
+}
+
+void ShuffleService::CloseSession(Session* session) {
+    delete session->it;
+    session->reader.Close();
+    delete session;
+}
+
+void ShuffleService::Fetch(const FetchMapOutputRequest* request,
+                           FetchMapOutputResponse* response) {
+    char session_key[128];
+    snprintf(session_key, sizeof(session_key), "%d/%d/%d-%d",
+             request->map_no(), request->attempt_id(),
+             request->reduce_from(), request->reduce_to());
+    int64_t max_size = request->max_size() > 0 ? request->max_size() : sDefaultFetchSize;
+    max_size = std::min(max_size, (int64_t)sMaxFetchSize);
+
+    //only a fetch telling its offset is able to go on with a kept scan
+    Session* session = NULL;
+    if (request->has_offset()) {
+        session = TakeSession(session_key, request->offset());
+    }
+    if (session == NULL) {
+        Status status = kOk;
+        session = OpenSession(request, &status);
+        if (session == NULL) {
+            response->set_status(status);
+            return;
+        }
+    }
+    SortFileReader::Iterator* scan_it = session->it;
+    int64_t size = 0;
+    while (!scan_it->Done() && size < max_size) {
+        Slice key = scan_it->KeySlice();
+        Slice value = scan_it->ValueSlice();
+        KeyValue* record = response->add_records();
+        record->set_key(key.data(), key.size());
+        record->set_value(value.data(), value.size());
+        size += key.size() + value.size();
+        session->offset++;
+        scan_it->Next();
+    }
+    Status status = scan_it->Error();
+    if (status != kOk && status != kNoMore) {
+        LOG(WARNING, "fail to scan: %s", session->reader.GetErrorFile().c_str());
+        response->clear_records();
+        response->set_status(status);
+        CloseSession(session);
+        return;
+    }
+    response->set_eof(scan_it->Done());
+    response->set_status(kOk);
+    if (scan_it->Done() || !request->has_offset()) {
+        CloseSession(session);
+    } else {
+        PutSession(session_key, session);
+    }
+}
+}
+}
+
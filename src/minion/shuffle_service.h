@@ -0,0 +1,50 @@
+#ifndef _BAIDU_SHUTTLE_SHUFFLE_SERVICE_H_
+#define _BAIDU_SHUTTLE_SHUFFLE_SERVICE_H_
+#include <time.h>
+#include <map>
+#include <string>
+#include <vector>
+#include "proto/minion.pb.h"
+#include "sort/sort_file.h"
+#include "mutex.h"
+
+namespace baidu {
+namespace shuttle {
+
+// Serves the map outputs kept on the local disk of this host to the
+// reducers, one partition range of one map attempt per call
+class ShuffleService {
+public:
+    explicit ShuffleService(const std::string& root) : root_(root) { }
+    ~ShuffleService();
+    // Where the sort files of a map attempt are kept under root
+    static std::string GetOutputDir(const std::string& root, int map_no, int attempt_id);
+    // Fill response with the records after the cursor of request, up to
+    // about max_size bytes but at least one record
+    void Fetch(const FetchMapOutputRequest* request, FetchMapOutputResponse* response);
+private:
+    // The open scan of a partition range of a map attempt, and the records
+    // of it served so far
+    struct Session {
+        MergeFileReader reader;
+        SortFileReader::Iterator* it;
+        int64_t offset;
+        time_t last_used;
+        Session() : it(NULL), offset(0), last_used(0) { }
+    };
+    bool ListSortFiles(const std::string& dir, std::vector<std::string>* files);
+    Session* OpenSession(const FetchMapOutputRequest* request, Status* status);
+    // Take the session of key out, NULL if there is none at offset
+    Session* TakeSession(const std::string& key, int64_t offset);
+    void PutSession(const std::string& key, Session* session);
+    static void CloseSession(Session* session);
+    const std::string root_;
+    Mutex mu_;
+    // sessions not in use by a fetch, by map, attempt and partition range
+    std::map<std::string, Session*> sessions_;
+};
+
+}
+}
+
+#endif
@@ -0,0 +1,311 @@
+#include <gtest/gtest.h>
+#include <stdio.h>
+#include <map>
+#include <string>
+#include <vector>
+#include <boost/lexical_cast.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <gflags/gflags.h>
+#include <sofa/pbrpc/pbrpc.h>
+#include "shuffle_service.h"
+#include "minion_impl.h"
+#include "sort/map_fetch.h"
+#include "sort/sort_file.h"
+#include "common/filesystem.h"
+#include "proto/app_master.pb.h"
+#include "mutex.h"
+
+DECLARE_string(local_shuffle_dir);
+
+using namespace baidu::shuttle;
+
+static const std::string sRoot = "./shuffle_service_test_dir";
+static const std::string sJobId = "job_shuffle_service_test";
+
+static void WriteSortFile(const std::string& file_name, int reduce_total, int dup) {
+    Status status;
+    SortFileWriter::Options options;
+    boost::scoped_ptr<SortFileWriter> writer(
+        SortFileWriter::Create(kLocalFile, options, &status));
+    ASSERT_EQ(writer->Open(file_name, FileSystem::Param()), kOk);
+    for (int reduce_no = 0; reduce_no < reduce_total; reduce_no++) {
+        char key[32];
+        snprintf(key, sizeof(key), "%05d\tkey", reduce_no);
+        for (int i = 0; i < dup; i++) {
+            ASSERT_EQ(writer->Put(key, "value"), kOk);
+        }
+    }
+    ASSERT_EQ(writer->Close(), kOk);
+}
+
+class ShuffleServiceTest : public testing::Test {
+protected:
+    virtual void SetUp() {
+        fs_.reset(FileSystem::CreateLocalFs());
+        fs_->Remove(sRoot);
+        std::string dir = ShuffleService::GetOutputDir(sRoot, 3, 1);
+        ASSERT_TRUE(fs_->Mkdirs(dir));
+        WriteSortFile(dir + "/0.sort", 4, 5);
+        WriteSortFile(dir + "/1.sort", 4, 5);
+    }
+    virtual void TearDown() {
+        fs_->Remove(sRoot);
+    }
+    boost::scoped_ptr<FileSystem> fs_;
+};
+
+TEST_F(ShuffleServiceTest, FetchPartitionRange) {
+    ShuffleService service(sRoot);
+    FetchMapOutputRequest request;
+    FetchMapOutputResponse response;
+    request.set_map_no(3);
+    request.set_attempt_id(1);
+    request.set_reduce_from(1);
+    request.set_reduce_to(2);
+    service.Fetch(&request, &response);
+    EXPECT_EQ(response.status(), kOk);
+    EXPECT_TRUE(response.eof());
+    ASSERT_EQ(response.records_size(), 20);
+    EXPECT_EQ(response.records(0).key(), "00001\tkey");
+    EXPECT_EQ(response.records(19).key(), "00002\tkey");
+}
+
+TEST_F(ShuffleServiceTest, FetchByPages) {
+    ShuffleService service(sRoot);
+    FetchMapOutputRequest request;
+    request.set_map_no(3);
+    request.set_attempt_id(1);
+    request.set_reduce_from(0);
+    request.set_reduce_to(3);
+    request.set_max_size(1);
+    int total = 0;
+    bool eof = false;
+    while (!eof) {
+        FetchMapOutputResponse response;
+        service.Fetch(&request, &response);
+        ASSERT_EQ(response.status(), kOk);
+        ASSERT_EQ(response.records_size(), 1);
+        const std::string& key = response.records(0).key();
+        // Resume after the records already taken under the same key
+        if (request.has_start_key() && request.start_key() == key) {
+            request.set_skip(request.skip() + 1);
+        } else {
+            request.set_start_key(key);
+            request.set_skip(1);
+        }
+        eof = response.eof();
+        total++;
+    }
+    EXPECT_EQ(total, 40);
+}
+
+TEST_F(ShuffleServiceTest, FetchBySession) {
+    ShuffleService service(sRoot);
+    FetchMapOutputRequest request;
+    request.set_map_no(3);
+    request.set_attempt_id(1);
+    request.set_reduce_from(0);
+    request.set_reduce_to(3);
+    request.set_max_size(1);
+    request.set_offset(0);
+    std::map<std::string, int> counts;
+    int pages = 0;
+    bool eof = false;
+    while (!eof) {
+        FetchMapOutputResponse response;
+        service.Fetch(&request, &response);
+        ASSERT_EQ(response.status(), kOk);
+        ASSERT_EQ(response.records_size(), 1);
+        if (++pages % 3 == 0) {
+            // The response is lost, the same page is fetched again
+            response.Clear();
+            service.Fetch(&request, &response);
+            ASSERT_EQ(response.status(), kOk);
+            ASSERT_EQ(response.records_size(), 1);
+        }
+        const std::string& key = response.records(0).key();
+        if (request.has_start_key() && request.start_key() == key) {
+            request.set_skip(request.skip() + 1);
+        } else {
+            request.set_start_key(key);
+            request.set_skip(1);
+        }
+        request.set_offset(request.offset() + 1);
+        counts[key]++;
+        eof = response.eof();
+    }
+    EXPECT_EQ(request.offset(), 40);
+    ASSERT_EQ(counts.size(), 4U);
+    EXPECT_EQ(counts["00000\tkey"], 10);
+    EXPECT_EQ(counts["00003\tkey"], 10);
+}
+
+TEST_F(ShuffleServiceTest, FetchMissingAttempt) {
+    ShuffleService service(sRoot);
+    FetchMapOutputRequest request;
+    FetchMapOutputResponse response;
+    request.set_map_no(3);
+    request.set_attempt_id(2);
+    request.set_reduce_from(0);
+    request.set_reduce_to(0);
+    service.Fetch(&request, &response);
+    EXPECT_EQ(response.status(), kNoSuchTask);
+}
+
+// Locates the map outputs like the master of a local shuffle job, a lost
+// output is located at the attempt its map runs again with
+class FakeMaster : public Master {
+public:
+    FakeMaster() : version_(1) { }
+    void SetOutput(int map_no, int attempt_id, const std::string& endpoint) {
+        MutexLock lock(&mu_);
+        SetLocation(&outputs_[map_no], map_no, attempt_id, endpoint);
+        ++version_;
+    }
+    void SetRerun(int map_no, int attempt_id, const std::string& endpoint) {
+        MutexLock lock(&mu_);
+        SetLocation(&reruns_[map_no], map_no, attempt_id, endpoint);
+    }
+    std::vector<MapOutputLocation> GetLost() {
+        MutexLock lock(&mu_);
+        return lost_;
+    }
+    void LocateMapOutput(::google::protobuf::RpcController*,
+                         const LocateMapOutputRequest* request,
+                         LocateMapOutputResponse* response,
+                         ::google::protobuf::Closure* done) {
+        {
+            MutexLock lock(&mu_);
+            for (int i = 0; i < request->lost_outputs_size(); i++) {
+                const MapOutputLocation& lost = request->lost_outputs(i);
+                lost_.push_back(lost);
+                if (reruns_.count(lost.map_no())) {
+                    outputs_[lost.map_no()] = reruns_[lost.map_no()];
+                    reruns_.erase(lost.map_no());
+                    ++version_;
+                }
+            }
+            response->set_status(kOk);
+            response->set_map_total(outputs_.size());
+            response->set_version(version_);
+            std::map<int, MapOutputLocation>::iterator it;
+            for (it = outputs_.begin(); it != outputs_.end(); ++it) {
+                response->add_outputs()->CopyFrom(it->second);
+            }
+        }
+        done->Run();
+    }
+private:
+    static void SetLocation(MapOutputLocation* location, int map_no,
+                            int attempt_id, const std::string& endpoint) {
+        location->set_map_no(map_no);
+        location->set_attempt_id(attempt_id);
+        location->set_endpoint(endpoint);
+    }
+    Mutex mu_;
+    int64_t version_;
+    std::map<int, MapOutputLocation> outputs_;
+    std::map<int, MapOutputLocation> reruns_;
+    std::vector<MapOutputLocation> lost_;
+};
+
+// A minion and a master on the loopback, the reducer fetches over rpc
+class LoopbackTest : public ShuffleServiceTest {
+protected:
+    virtual void SetUp() {
+        ShuffleServiceTest::SetUp();
+        FLAGS_local_shuffle_dir = sRoot;
+        minion_ = new MinionImpl();
+        minion_->SetJobId(sJobId);
+        master_ = new FakeMaster();
+        sofa::pbrpc::RpcServerOptions options;
+        server_.reset(new sofa::pbrpc::RpcServer(options));
+        ASSERT_TRUE(server_->RegisterService(static_cast<Minion*>(minion_)));
+        ASSERT_TRUE(server_->RegisterService(static_cast<Master*>(master_)));
+        int port = 0;
+        for (port = 28900; port < 29000; port++) {
+            if (server_->Start("127.0.0.1:" + boost::lexical_cast<std::string>(port))) {
+                break;
+            }
+        }
+        ASSERT_LT(port, 29000);
+        endpoint_ = "127.0.0.1:" + boost::lexical_cast<std::string>(port);
+        options_.master = endpoint_;
+        options_.job_id = sJobId;
+        options_.reduce_no = 1;
+        options_.fetch_dir = sRoot + "/fetch";
+        options_.fetch_retry = 2;
+        options_.retry_interval = 0;
+        options_.poll_interval = 1;
+    }
+    virtual void TearDown() {
+        //the server owns the services
+        server_->Stop();
+        server_.reset();
+        ShuffleServiceTest::TearDown();
+    }
+    static int64_t CountRecords(const std::vector<std::string>& file_names) {
+        int64_t records = 0;
+        for (size_t i = 0; i < file_names.size(); i++) {
+            Status status;
+            boost::scoped_ptr<SortFileReader> reader(
+                SortFileReader::Create(kLocalFile, &status));
+            EXPECT_EQ(reader->Open(file_names[i], FileSystem::Param()), kOk);
+            boost::scoped_ptr<SortFileReader::Iterator> it(reader->Scan("", ""));
+            while (!it->Done()) {
+                EXPECT_EQ(it->Key(), "00001\tkey");
+                records++;
+                it->Next();
+            }
+            EXPECT_EQ(it->Error(), kNoMore);
+        }
+        return records;
+    }
+    MinionImpl* minion_;
+    FakeMaster* master_;
+    boost::scoped_ptr<sofa::pbrpc::RpcServer> server_;
+    std::string endpoint_;
+    MapFetcher::Options options_;
+};
+
+TEST_F(LoopbackTest, FetchOverRpc) {
+    master_->SetOutput(3, 1, endpoint_);
+    MapFetcher fetcher(options_);
+    std::vector<std::string> file_names;
+    ASSERT_EQ(fetcher.FetchAll(&file_names), kOk);
+    ASSERT_EQ(file_names.size(), 1U);
+    EXPECT_EQ(CountRecords(file_names), 10);
+    EXPECT_TRUE(master_->GetLost().empty());
+}
+
+TEST_F(LoopbackTest, ReportMissingOutputLost) {
+    //the minion has no output of attempt 2, the map runs again as attempt 1
+    master_->SetOutput(3, 2, endpoint_);
+    master_->SetRerun(3, 1, endpoint_);
+    MapFetcher fetcher(options_);
+    std::vector<std::string> file_names;
+    ASSERT_EQ(fetcher.FetchAll(&file_names), kOk);
+    EXPECT_EQ(CountRecords(file_names), 10);
+    std::vector<MapOutputLocation> lost = master_->GetLost();
+    ASSERT_EQ(lost.size(), 1U);
+    EXPECT_EQ(lost[0].map_no(), 3);
+    EXPECT_EQ(lost[0].attempt_id(), 2);
+}
+
+TEST_F(LoopbackTest, ReportUnreachableOutputLost) {
+    //nothing listens on port 1, the output is lost after fetch_retry tries
+    master_->SetOutput(3, 1, "127.0.0.1:1");
+    master_->SetRerun(3, 1, endpoint_);
+    MapFetcher fetcher(options_);
+    std::vector<std::string> file_names;
+    ASSERT_EQ(fetcher.FetchAll(&file_names), kOk);
+    EXPECT_EQ(CountRecords(file_names), 10);
+    std::vector<MapOutputLocation> lost = master_->GetLost();
+    ASSERT_EQ(lost.size(), 1U);
+    EXPECT_EQ(lost[0].endpoint(), "127.0.0.1:1");
+}
+
+int main(int argc, char* argv[]) {
+    testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
@@ -117,6 +117,7 @@ bool ShuttleImpl::SubmitJob(const sdk::JobDescription& job_desc, std::string& jo
     for (size_t i = 0; i < job_desc.cmdenvs.size(); i++) {
         job->add_cmdenvs(job_desc.cmdenvs[i]);   
     }
+    job->set_local_shuffle(job_desc.local_shuffle);
     bool ok = rpc_client_.SendRequest(master_stub_, &Master_Stub::SubmitJob,
                                       &request, &response, rpc_timeout_, 1);
     if (!ok) {
@@ -121,6 +121,7 @@ struct JobDescription {
     std::string combine_command;
     bool compress_output;
     std::vector<std::string> cmdenvs;
+    bool local_shuffle;
 };
 
 struct TaskInstance {
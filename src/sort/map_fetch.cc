@@ -0,0 +1,254 @@
+#include "map_fetch.h"
+
+#include <unistd.h>
+#include <map>
+#include <set>
+#include <sstream>
+#include <boost/bind.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <timer.h>
+#include "common/filesystem.h"
+#include "logging.h"
+#include "thread_pool.h"
+
+namespace baidu {
+namespace shuttle {
+
+using baidu::common::Log;
+using baidu::common::INFO;
+using baidu::common::WARNING;
+
+MapFetcher::MapFetcher(const Options& options) : options_(options), cond_(&mu_) {
+
+}
+
+std::string MapFetcher::GetFetchFile(int map_no) {
+    std::stringstream ss;
+    ss << options_.fetch_dir << "/map_" << map_no << ".sort";
+    return ss.str();
+}
+
+// Page through the partition of this reducer in a map output and keep
+// it in a local sort file, the records come in order. A failed call is
+// not retried here, the caller counts it toward fetch_retry
+bool MapFetcher::FetchOne(Result* result) {
+    const MapOutputLocation& location = result->location;
+    Status status;
+    SortFileWriter::Options options;
+    options.version = static_cast<SortFileVersion>(options_.format);
+    options.partitioned = true;
+    SortFileWriter::ParseCodec(options_.codec, &options.codec);
+    options.codec_level = options_.codec_level;
+    boost::scoped_ptr<SortFileWriter> writer(
+            SortFileWriter::Create(kLocalFile, options, &status));
+    const std::string file_name = GetFetchFile(location.map_no());
+    if (status != kOk || writer->Open(file_name, FileSystem::Param()) != kOk) {
+        LOG(WARNING, "fail to open %s", file_name.c_str());
+        result->write_failed = true;
+        return false;
+    }
+    Minion_Stub* stub = NULL;
+    rpc_client_.GetStub(location.endpoint(), &stub);
+    boost::scoped_ptr<Minion_Stub> stub_guard(stub);
+    FetchMapOutputRequest request;
+    request.set_job_id(options_.job_id);
+    request.set_map_no(location.map_no());
+    request.set_attempt_id(location.attempt_id());
+    request.set_reduce_from(options_.reduce_no);
+    request.set_reduce_to(options_.reduce_no);
+    request.set_max_size(options_.fetch_size);
+    request.set_offset(0);
+    std::string last_key;
+    int64_t same_keys = 0;
+    while (true) {
+        FetchMapOutputResponse response;
+        bool ok = rpc_client_.SendRequest(stub, &Minion_Stub::FetchMapOutput,
+                                          &request, &response, 60, 1);
+        if (!ok || response.status() != kOk) {
+            LOG(WARNING, "fail to fetch map %d from %s: %s", location.map_no(),
+                location.endpoint().c_str(),
+                ok ? Status_Name(response.status()).c_str() : "rpc fail");
+            //a host serving another job has none of the outputs of this one
+            result->lost = ok && (response.status() == kNoSuchTask
+                                  || response.status() == kNoSuchJob);
+            result->unreachable = !ok;
+            writer->Close();
+            return false;
+        }
+        for (int i = 0; i < response.records_size(); i++) {
+            const KeyValue& record = response.records(i);
+            if (writer->Put(record.key(), record.value()) != kOk) {
+                LOG(WARNING, "fail to write %s", file_name.c_str());
+                result->write_failed = true;
+                writer->Close();
+                return false;
+            }
+            if (record.key() == last_key) {
+                same_keys++;
+            } else {
+                last_key = record.key();
+                same_keys = 1;
+            }
+            result->records++;
+        }
+        if (response.eof()) {
+            break;
+        }
+        if (response.records_size() == 0) {
+            LOG(WARNING, "map %d gives no records before its end", location.map_no());
+            writer->Close();
+            return false;
+        }
+        //the minion goes on from the scan it keeps at this offset, or from
+        //the key when that is gone
+        request.set_offset(request.offset() + response.records_size());
+        request.set_start_key(last_key);
+        request.set_skip(same_keys);
+    }
+    if (writer->Close() != kOk) {
+        LOG(WARNING, "fail to close %s", file_name.c_str());
+        result->write_failed = true;
+        return false;
+    }
+    return true;
+}
+
+void MapFetcher::FetchTask(const MapOutputLocation& location) {
+    Result result;
+    result.location = location;
+    result.ok = FetchOne(&result);
+    MutexLock lock(&mu_);
+    results_.push_back(result);
+    cond_.Signal();
+}
+
+Status MapFetcher::FetchAll(std::vector<std::string>* file_names) {
+    Master_Stub* stub = NULL;
+    rpc_client_.GetStub(options_.master, &stub);
+    boost::scoped_ptr<Master_Stub> stub_guard(stub);
+    boost::scoped_ptr<FileSystem> local_fs(FileSystem::CreateLocalFs());
+    if (!local_fs->Mkdirs(options_.fetch_dir)) {
+        LOG(WARNING, "fail to make %s", options_.fetch_dir.c_str());
+        return kWriteFileFail;
+    }
+    //the fetches going on are waited for when this returns
+    ThreadPool pool(options_.fetch_threads);
+    // map -> where the master last saw its output
+    std::map<int, MapOutputLocation> locations;
+    std::set<int> fetched_maps;
+    std::set<int> fetching_maps;
+    std::vector<MapOutputLocation> lost_outputs;
+    // map -> failed fetches so far, and when to try it again
+    std::map<int, int> failures;
+    std::map<int, int64_t> retry_time;
+    int64_t version = -1;
+    int map_total = -1;
+    int64_t fetched_records = 0;
+    int64_t start = common::timer::get_micros();
+    while (true) {
+        std::vector<Result> results;
+        {
+            MutexLock lock(&mu_);
+            results.swap(results_);
+        }
+        std::vector<Result>::iterator jt;
+        for (jt = results.begin(); jt != results.end(); jt++) {
+            int map_no = jt->location.map_no();
+            fetching_maps.erase(map_no);
+            if (jt->ok) {
+                fetched_maps.insert(map_no);
+                file_names->push_back(GetFetchFile(map_no));
+                fetched_records += jt->records;
+                failures.erase(map_no);
+                continue;
+            }
+            int failed = ++failures[map_no];
+            if (!jt->lost && failed < options_.fetch_retry) {
+                retry_time[map_no] = common::timer::get_micros()
+                                     + options_.retry_interval * 1000000L;
+                continue;
+            }
+            if (!jt->lost && jt->write_failed) {
+                LOG(WARNING, "fail to keep map %d in %s for %d times",
+                    map_no, options_.fetch_dir.c_str(), failed);
+                return kWriteFileFail;
+            }
+            //the host answers but fails to serve the output, this attempt
+            //gives up and the reduce runs again
+            if (!jt->lost && !jt->unreachable) {
+                LOG(WARNING, "fail to fetch map %d from %s for %d times",
+                    map_no, jt->location.endpoint().c_str(), failed);
+                return kReadFileFail;
+            }
+            if (!jt->lost) {
+                LOG(WARNING, "%s is unreachable for %d times, report map %d lost",
+                    jt->location.endpoint().c_str(), failed, map_no);
+            }
+            lost_outputs.push_back(jt->location);
+            locations.erase(map_no);
+            failures.erase(map_no);
+            retry_time.erase(map_no);
+        }
+        LocateMapOutputRequest request;
+        LocateMapOutputResponse response;
+        request.set_jobid(options_.job_id);
+        request.set_reduce_no(options_.reduce_no);
+        request.set_attempt_id(options_.attempt_id);
+        for (size_t i = 0; i < lost_outputs.size(); i++) {
+            request.add_lost_outputs()->CopyFrom(lost_outputs[i]);
+        }
+        request.set_version(version);
+        bool ok = rpc_client_.SendRequest(stub, &Master_Stub::LocateMapOutput,
+                                          &request, &response, 15, 1);
+        if (!ok) {
+            LOG(WARNING, "fail to locate map outputs on master[%s]", options_.master.c_str());
+            sleep(options_.retry_interval);
+            continue;
+        }
+        lost_outputs.clear();
+        if (response.status() != kOk) {
+            LOG(WARNING, "master can not locate map outputs: %s",
+                Status_Name(response.status()).c_str());
+            return response.status();
+        }
+        map_total = response.map_total();
+        if (response.version() != version) {
+            version = response.version();
+            locations.clear();
+            for (int i = 0; i < response.outputs_size(); i++) {
+                locations[response.outputs(i).map_no()] = response.outputs(i);
+            }
+        }
+        std::map<int, MapOutputLocation>::iterator it;
+        for (it = locations.begin(); it != locations.end(); it++) {
+            int map_no = it->first;
+            if (fetched_maps.count(map_no) || fetching_maps.count(map_no)) {
+                continue;
+            }
+            if (retry_time.count(map_no)
+                    && retry_time[map_no] > common::timer::get_micros()) {
+                continue;
+            }
+            if (it->second.endpoint().empty()) {
+                fetched_maps.insert(map_no);
+                continue;
+            }
+            fetching_maps.insert(map_no);
+            pool.AddTask(boost::bind(&MapFetcher::FetchTask, this, it->second));
+        }
+        LOG(INFO, "fetch progress: #%d/%d fetched, %d fetching, %lld records in %.1fs",
+            (int)fetched_maps.size(), map_total, (int)fetching_maps.size(),
+            fetched_records, (common::timer::get_micros() - start) / 1000000.0);
+        if ((int)fetched_maps.size() >= map_total && fetching_maps.empty()) {
+            break;
+        }
+        MutexLock lock(&mu_);
+        if (results_.empty()) {
+            cond_.TimeWait(options_.poll_interval * 1000);
+        }
+    }
+    return kOk;
+}
+
+}
+}
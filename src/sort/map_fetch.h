@@ -0,0 +1,74 @@
+#ifndef _BAIDU_SHUTTLE_SORT_MAP_FETCH_
+#define _BAIDU_SHUTTLE_SORT_MAP_FETCH_
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "sort_file.h"
+#include "common/rpc_client.h"
+#include "proto/app_master.pb.h"
+#include "proto/minion.pb.h"
+#include "mutex.h"
+
+namespace baidu {
+namespace shuttle {
+
+// Fetches the partition of one reducer from the map outputs kept on the
+// map hosts of a local shuffle job, the master tells where they are
+class MapFetcher {
+public:
+    struct Options {
+        std::string master;
+        std::string job_id;
+        int32_t reduce_no;
+        int32_t attempt_id;
+        std::string fetch_dir;
+        int32_t fetch_threads;
+        int32_t fetch_size;
+        int32_t fetch_retry;
+        int32_t retry_interval;
+        int32_t poll_interval;
+        int32_t format;
+        std::string codec;
+        int32_t codec_level;
+        Options() : reduce_no(0), attempt_id(0), fetch_dir("./map_output"),
+                    fetch_threads(5), fetch_size(4 << 20), fetch_retry(3),
+                    retry_interval(3), poll_interval(5), format(kSortFileV2),
+                    codec("snappy"), codec_level(1) { }
+    };
+    explicit MapFetcher(const Options& options);
+    // Fetch every map output into a local sort file of fetch_dir. An output
+    // is reported lost and its map runs again when its host does not have
+    // it, or is still unreachable after fetch_retry failed fetches.
+    // Returns kWriteFileFail if the outputs can not be kept, kReadFileFail
+    // if one can not be fetched, or what the master says when it refuses
+    Status FetchAll(std::vector<std::string>* file_names);
+private:
+    struct Result {
+        MapOutputLocation location;
+        bool ok;
+        // the map host has no output of the attempt any more
+        bool lost;
+        // the map host did not answer
+        bool unreachable;
+        // the output can not be kept in the fetch dir
+        bool write_failed;
+        int64_t records;
+        Result() : ok(false), lost(false), unreachable(false),
+                   write_failed(false), records(0) { }
+    };
+    std::string GetFetchFile(int map_no);
+    bool FetchOne(Result* result);
+    void FetchTask(const MapOutputLocation& location);
+private:
+    const Options options_;
+    RpcClient rpc_client_;
+    Mutex mu_;
+    CondVar cond_;
+    // outputs fetched by the threads, guarded by mu_
+    std::vector<Result> results_;
+};
+
+}
+}
+
+#endif
@@ -1,6 +1,8 @@
 #include "sort_file.h"
 #include <boost/bind.hpp>
+#include <boost/scoped_ptr.hpp>
 #include <logging.h>
+#include <timer.h>
 
 using baidu::common::Log;
 using baidu::common::FATAL;
@@ -11,6 +13,8 @@ namespace baidu {
 namespace shuttle {
 
 const static int sParallelLevel = 3;
+// opening is mostly waiting for the round trips of the file system
+const static int sOpenParallelLevel = 16;
 
 MergeFileReader::~MergeFileReader() {
     std::vector<SortFileReader*>::iterator it;
@@ -19,48 +23,83 @@ MergeFileReader::~MergeFileReader() {
     }
 }
 
+// Runs on the open pool: open one input and load its index, the reader
+// lands in its own slot so that the inputs keep their order
 void MergeFileReader::AddReader(const std::string& file_name, FileSystem::Param param, 
-                                FileType file_type, Status* status) {
+                                FileType file_type, SortFileReader** slot,
+                                OpenTimes* times, Status* status) {
+    {
+        MutexLock lock(&mu_);
+        if (*status != kOk) {
+            return; //another file failed, give up the rest
+        }
+    }
+    int64_t start = common::timer::get_micros();
     Status st;
     SortFileReader* reader = SortFileReader::Create(file_type, &st);
     if (st == kOk) {
         st = reader->Open(file_name, param);
     }
+    int64_t opened = common::timer::get_micros();
+    if (st == kOk) {
+        st = reader->LoadIndex();
+    }
+    int64_t loaded = common::timer::get_micros();
+    MutexLock lock(&mu_);
+    times->open_micros += opened - start;
+    times->index_micros += loaded - opened;
+    if (loaded - start > times->slowest_micros) {
+        times->slowest_micros = loaded - start;
+        times->slowest_file = file_name;
+    }
     if (st != kOk) {
-        {
-            MutexLock lock(&mu_);
+        if (*status == kOk) {
             *status = st;
             err_file_ = file_name;
         }
         LOG(WARNING, "failed to open %s, status: %s", 
             file_name.c_str(), Status_Name(st).c_str());
+        delete reader;
         return;
-    } else {
-        MutexLock lock(&mu_);
-        readers_.push_back(reader);
     }
+    *slot = reader;
 }
 
 Status MergeFileReader::Open(const std::vector<std::string>& files, 
                              FileSystem::Param param,
                              FileType file_type) {
-    if (files.size() == 0) {
+    return Open(files, param, std::vector<FileType>(files.size(), file_type));
+}
+
+Status MergeFileReader::Open(const std::vector<std::string>& files,
+                             FileSystem::Param param,
+                             const std::vector<FileType>& file_types) {
+    if (files.size() == 0 || file_types.size() != files.size()) {
         return kInvalidArg;
     }
+    int64_t start = common::timer::get_micros();
     Status status = kOk;
-    Status* st = new Status();
-    std::vector<std::string>::const_iterator it;
+    OpenTimes times;
+    std::vector<SortFileReader*> readers(files.size(), NULL);
     LOG(INFO, "wait for #%d readers open", files.size());
-    for (it = files.begin(); it != files.end(); it++) {
-        const std::string& file_name = *it;
-        AddReader(file_name, param, file_type, st);
-        if (*st != kOk) {
-            break;
+    {
+        ThreadPool pool(std::min((int)files.size(), sOpenParallelLevel));
+        for (size_t i = 0; i < files.size(); i++) {
+            pool.AddTask(boost::bind(&MergeFileReader::AddReader, this, files[i],
+                                     param, file_types[i], &readers[i], &times, &status));
         }
+        pool.Stop(true);
     }
-    LOG(INFO, "wait file open done");
-    status = *st; 
-    delete st;
+    for (size_t i = 0; i < readers.size(); i++) {
+        if (readers[i] != NULL) {
+            readers_.push_back(readers[i]);
+        }
+    }
+    LOG(INFO, "wait file open done, #%d files in %.3fs, open: %.3fs, load index: %.3fs, "
+        "slowest: %s %.3fs", readers_.size(),
+        (common::timer::get_micros() - start) / 1000000.0,
+        times.open_micros / 1000000.0, times.index_micros / 1000000.0,
+        times.slowest_file.c_str(), times.slowest_micros / 1000000.0);
     return status;
 }
 
@@ -78,13 +117,15 @@ Status MergeFileReader::Close() {
     Status status = kOk;
     Status* st = new Status();
     ThreadPool pool(sParallelLevel);
+    int64_t start = common::timer::get_micros();
     LOG(INFO, "wait #%d readers close", readers_.size());
     for (it = readers_.begin(); it != readers_.end(); it++) {
         SortFileReader* reader = *it;
         pool.AddTask(boost::bind(&MergeFileReader::CloseReader, this, reader, st));
     }
     pool.Stop(true);
-    LOG(INFO, "wait readers close done");
+    LOG(INFO, "wait readers close done in %.3fs",
+        (common::timer::get_micros() - start) / 1000000.0);
     status = *st;
     delete st;
     return status;
@@ -94,6 +135,7 @@ void MergeFileReader::AddIter(std::vector<SortFileReader::Iterator*>* iters,
                               SortFileReader* reader,
                               const std::string& start_key,
                               const std::string& end_key,
+                              int partition,
                               bool* has_error) {
     {
         MutexLock lock(&mu_);
@@ -102,7 +144,12 @@ void MergeFileReader::AddIter(std::vector<SortFileReader::Iterator*>* iters,
             return;
         }
     }
-    SortFileReader::Iterator* it = reader->Scan(start_key, end_key);
+    SortFileReader::Iterator* it = NULL;
+    if (partition < 0) {
+        it = reader->Scan(start_key, end_key);
+    } else {
+        it = reader->ScanPartition(partition);
+    }
     {
         MutexLock lock(&mu_);
         iters->push_back(it);
@@ -114,39 +161,95 @@ void MergeFileReader::AddIter(std::vector<SortFileReader::Iterator*>* iters,
 }
 
 SortFileReader::Iterator* MergeFileReader::Scan(const std::string& start_key, const std::string& end_key) {
+    return DoScan(start_key, end_key, -1);
+}
+
+SortFileReader::Iterator* MergeFileReader::ScanPartition(int partition) {
+    return DoScan("", "", partition);
+}
+
+SortFileReader::Iterator* MergeFileReader::DoScan(const std::string& start_key,
+                                                  const std::string& end_key,
+                                                  int partition) {
     std::vector<SortFileReader::Iterator*>* iters = new std::vector<SortFileReader::Iterator*>();
     std::vector<SortFileReader*>::iterator it;
     ThreadPool pool(sParallelLevel);
     bool* has_error   = new bool(false);
+    int64_t start = common::timer::get_micros();
     LOG(INFO, "wait for iterators init...");
     for (it = readers_.begin(); it != readers_.end(); it++) {
         SortFileReader * const& reader = *it;
         pool.AddTask(boost::bind(
                     &MergeFileReader::AddIter, this, iters, reader, 
-                    start_key, end_key, has_error
+                    start_key, end_key, partition, has_error
         ));
     }
     pool.Stop(true);
-    LOG(INFO, "all iterators done. #%d", iters->size());
+    LOG(INFO, "all iterators done. #%d in %.3fs", iters->size(),
+        (common::timer::get_micros() - start) / 1000000.0);
     delete has_error;
     MergeIterator* merge_it = new MergeIterator(*iters, this);
     delete iters;
     return merge_it;
 }
 
+Status MergeFileReader::MergeTo(const std::string& output,
+                                FileSystem::Param param,
+                                FileType file_type,
+                                const SortFileWriter::Options& options,
+                                int64_t* records) {
+    Status status = kOk;
+    boost::scoped_ptr<SortFileWriter> writer(SortFileWriter::Create(file_type, options, &status));
+    if (status != kOk) {
+        LOG(WARNING, "fail to create writer");
+        return status;
+    }
+    status = writer->Open(output, param);
+    if (status != kOk) {
+        LOG(WARNING, "fail to open %s for write", output.c_str());
+        err_file_ = output;
+        return status;
+    }
+    int64_t count = 0;
+    SortFileReader::Iterator* it = Scan("", "");
+    boost::scoped_ptr<SortFileReader::Iterator> it_guard(it);
+    while (!it->Done()) {
+        status = writer->Put(it->KeySlice(), it->ValueSlice());
+        if (status != kOk) {
+            LOG(WARNING, "fail to put merged record, %s", Status_Name(status).c_str());
+            err_file_ = output;
+            break;
+        }
+        count++;
+        it->Next();
+    }
+    if (status == kOk && it->Error() != kOk && it->Error() != kNoMore) {
+        LOG(WARNING, "fail to merge: %s", err_file_.c_str());
+        status = it->Error();
+    }
+    if (status == kOk) {
+        status = writer->Close();
+        if (status != kOk) {
+            LOG(WARNING, "fail to close writer: %s", output.c_str());
+            err_file_ = output;
+        }
+    }
+    if (records != NULL) {
+        *records = count;
+    }
+    return status;
+}
+
 MergeFileReader::MergeIterator::MergeIterator(const std::vector<SortFileReader::Iterator*>& iters,
                                               MergeFileReader* reader) {
     merge_reader_ = reader;
     std::vector<SortFileReader::Iterator*>::const_iterator it;
     status_ = kOk;
-    int offset = 0;
     for (it = iters.begin(); it != iters.end(); it++) {
         SortFileReader::Iterator * const& reader_it = *it;
         bool drained = false;
         if (!reader_it->Done()) {
-            queue_.push(MergeItem(reader_it->Key(), reader_it->Value(), offset));
             iters_.push_back(reader_it);
-            offset++;
         } else {
             drained = true;
         }
@@ -158,9 +261,21 @@ MergeFileReader::MergeIterator::MergeIterator(const std::vector<SortFileReader::
             delete reader_it;
         }
     }
-    if (status_ == kOk && !queue_.empty()) {
-        key_ = queue_.top().key_;
-        value_ = queue_.top().value_;
+    int k = iters_.size();
+    keys_.resize(k);
+    prefixes_.resize(k);
+    drained_.resize(k, false);
+    if (k > 0) {
+        common_ = iters_[0]->KeySlice().ToString();
+    }
+    for (int i = 0; i < k; i++) {
+        LoadKey(i);
+    }
+    //-1 beats everyone, so every input replayed from the bottom
+    //leaves the real loser at each node
+    tree_.assign(k, -1);
+    for (int i = k - 1; i >= 0; i--) {
+        Replay(i);
     }
 }
 
@@ -172,32 +287,123 @@ MergeFileReader::MergeIterator::~MergeIterator() {
     }
 }
 
+void MergeFileReader::MergeIterator::LoadKey(int input) {
+    SortFileReader::Iterator* reader_it = iters_[input];
+    if (reader_it->Done()) {
+        drained_[input] = true;
+        keys_[input].clear();
+        return;
+    }
+    keys_[input] = reader_it->KeySlice();
+    const Slice& key = keys_[input];
+    if (!key.starts_with(common_)) {
+        //a shorter common part, the prefixes of the others move as well
+        size_t n = 0;
+        while (n < common_.size() && n < key.size() && common_[n] == key[n]) {
+            n++;
+        }
+        common_.resize(n);
+        for (size_t i = 0; i < keys_.size(); i++) {
+            if (!drained_[i] && (int)i != input) {
+                SetPrefix(i);
+            }
+        }
+    }
+    SetPrefix(input);
+}
+
+void MergeFileReader::MergeIterator::SetPrefix(int input) {
+    const Slice& key = keys_[input];
+    uint64_t prefix = 0;
+    for (size_t i = common_.size(); i < common_.size() + sizeof(uint64_t); i++) {
+        prefix <<= 8;
+        if (i < key.size()) {
+            prefix |= (unsigned char)key[i];
+        }
+    }
+    prefixes_[input] = prefix;
+}
+
+// Whether input a goes out before input b, ties go to the lower input
+bool MergeFileReader::MergeIterator::Beats(int a, int b) {
+    if (a < 0) {
+        return true;
+    }
+    if (b < 0) {
+        return false;
+    }
+    if (drained_[a] || drained_[b]) {
+        return drained_[b] && (!drained_[a] || a < b);
+    }
+    if (prefixes_[a] != prefixes_[b]) {
+        return prefixes_[a] < prefixes_[b];
+    }
+    int r = keys_[a].compare(keys_[b]);
+    if (r != 0) {
+        return r < 0;
+    }
+    return a < b;
+}
+
+// Play the matches of an input up to the root after its key changed
+void MergeFileReader::MergeIterator::Replay(int input) {
+    int k = tree_.size();
+    int winner = input;
+    for (int node = (input + k) / 2; node > 0; node /= 2) {
+        if (Beats(tree_[node], winner)) {
+            std::swap(tree_[node], winner);
+        }
+    }
+    tree_[0] = winner;
+}
+
 bool MergeFileReader::MergeIterator::Done() {
-    return queue_.empty();
+    return tree_.empty() || drained_[tree_[0]];
 }
 
 void MergeFileReader::MergeIterator::Next() {
-    if (queue_.empty()) {
+    if (Done()) {
         return;
     }
-    const MergeItem& top = queue_.top();
-    int offset = top.it_offset_;
-    SortFileReader::Iterator* reader_it = iters_[offset];
+    int winner = tree_[0];
+    SortFileReader::Iterator* reader_it = iters_[winner];
     reader_it->Next();
-    queue_.pop();
-    if (!reader_it->Done()) {
-        queue_.push(MergeItem(reader_it->Key(), reader_it->Value(), offset));
-    }
     if (reader_it->Error() != kOk && reader_it->Error() != kNoMore) {
         status_ = reader_it->Error();
         merge_reader_->err_file_ = reader_it->GetFileName();
         LOG(WARNING, "failed to call next of %s, %s", 
             merge_reader_->err_file_.c_str(), Status_Name(status_).c_str());
     }
-    if (!queue_.empty()) {
-        key_ = queue_.top().key_;
-        value_ = queue_.top().value_;
+    LoadKey(winner);
+    Replay(winner);
+}
+
+const std::string& MergeFileReader::MergeIterator::Key() {
+    if (Done()) {
+        return empty_;
+    }
+    return iters_[tree_[0]]->Key();
+}
+
+const std::string& MergeFileReader::MergeIterator::Value() {
+    if (Done()) {
+        return empty_;
+    }
+    return iters_[tree_[0]]->Value();
+}
+
+Slice MergeFileReader::MergeIterator::KeySlice() {
+    if (Done()) {
+        return Slice();
+    }
+    return keys_[tree_[0]];
+}
+
+Slice MergeFileReader::MergeIterator::ValueSlice() {
+    if (Done()) {
+        return Slice();
     }
+    return iters_[tree_[0]]->ValueSlice();
 }
 
 }
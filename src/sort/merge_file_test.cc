@@ -1,4 +1,6 @@
 #include <gtest/gtest.h>
+#include <stdlib.h>
+#include <algorithm>
 #include <string>
 #include "sort_file.h"
 
@@ -177,6 +179,199 @@ TEST(Merge, Read2) {
     delete reader;    
 }
 
+// Write 37 sorted inputs named prefix_<i>.data in the work dir: empty
+// ones, equal keys and keys of more than one partition
+static void WriteMergeInputs(const std::string& prefix,
+                             std::vector<std::string>* file_names,
+                             std::vector<std::string>* all_keys) {
+    const int inputs = 37;
+    unsigned int seed = 1234;
+    FileSystem::Param param;
+    Status status;
+    for (int i = 0; i < inputs; i++) {
+        char file_name[256];
+        snprintf(file_name, sizeof(file_name), "/%s_%d.data", prefix.c_str(), i);
+        file_names->push_back(g_work_dir + file_name);
+        std::vector<std::string> keys;
+        int n = (i % 5 == 0) ? 0 : rand_r(&seed) % 3000;
+        for (int j = 0; j < n; j++) {
+            char key[256];
+            snprintf(key, sizeof(key), "%05d\tkey_%d", rand_r(&seed) % 3,
+                     rand_r(&seed) % 5000);
+            keys.push_back(key);
+        }
+        std::sort(keys.begin(), keys.end());
+        SortFileWriter* writer = SortFileWriter::Create(g_file_type, &status);
+        EXPECT_EQ(status, kOk);
+        status = writer->Open(file_names->back(), param);
+        EXPECT_EQ(status, kOk);
+        for (size_t j = 0; j < keys.size(); j++) {
+            status = writer->Put(keys[j], "v");
+            EXPECT_EQ(status, kOk);
+        }
+        status = writer->Close();
+        EXPECT_EQ(status, kOk);
+        delete writer;
+        all_keys->insert(all_keys->end(), keys.begin(), keys.end());
+    }
+    std::sort(all_keys->begin(), all_keys->end());
+}
+
+TEST(Merge, Order) {
+    std::vector<std::string> file_names;
+    std::vector<std::string> all_keys;
+    WriteMergeInputs("merge_order", &file_names, &all_keys);
+    FileSystem::Param param;
+    MergeFileReader* reader = new MergeFileReader();
+    Status status = reader->Open(file_names, param, g_file_type);
+    EXPECT_EQ(status, kOk);
+    SortFileReader::Iterator* it = reader->Scan("", "");
+    size_t n = 0;
+    while (!it->Done()) {
+        ASSERT_LT(n, all_keys.size());
+        EXPECT_EQ(it->KeySlice(), Slice(all_keys[n]));
+        EXPECT_EQ(it->Key(), all_keys[n]);
+        it->Next();
+        EXPECT_EQ(it->Error(), kOk);
+        n++;
+    }
+    EXPECT_EQ(n, all_keys.size());
+    delete it;
+    status = reader->Close();
+    EXPECT_EQ(status, kOk);
+    delete reader;
+}
+
+TEST(Merge, MergeTo) {
+    //merged into one partitioned file
+    std::vector<std::string> file_names;
+    std::vector<std::string> all_keys;
+    WriteMergeInputs("merge_to_input", &file_names, &all_keys);
+    FileSystem::Param param;
+    MergeFileReader* reader = new MergeFileReader();
+    Status status = reader->Open(file_names, param, g_file_type);
+    EXPECT_EQ(status, kOk);
+    SortFileWriter::Options options;
+    options.partitioned = true;
+    options.compress_threads = 2;
+    std::string output = g_work_dir + "/merge_to.data";
+    int64_t records = 0;
+    status = reader->MergeTo(output, param, g_file_type, options, &records);
+    EXPECT_EQ(status, kOk);
+
+    SortFileReader* merged = SortFileReader::Create(g_file_type, &status);
+    EXPECT_EQ(status, kOk);
+    status = merged->Open(output, param);
+    EXPECT_EQ(status, kOk);
+    SortFileReader::Iterator* expect_it = reader->Scan("", "");
+    SortFileReader::Iterator* it = merged->Scan("", "");
+    int64_t n = 0;
+    while (!expect_it->Done()) {
+        ASSERT_FALSE(it->Done());
+        EXPECT_EQ(it->Key(), expect_it->Key());
+        EXPECT_EQ(it->Value(), expect_it->Value());
+        it->Next();
+        expect_it->Next();
+        n++;
+    }
+    EXPECT_TRUE(it->Done());
+    EXPECT_EQ(it->Error(), kNoMore);
+    EXPECT_EQ(n, records);
+    EXPECT_EQ(records, (int64_t)all_keys.size());
+    delete it;
+    delete expect_it;
+
+    PartitionIndex partitions;
+    status = merged->ReadPartitionIndex(&partitions);
+    EXPECT_EQ(status, kOk);
+    EXPECT_EQ(partitions.items_size(), 3);
+    int64_t partition_records = 0;
+    for (int i = 0; i < partitions.items_size(); i++) {
+        it = merged->ScanPartition(partitions.items(i).partition());
+        int64_t ct = 0;
+        while (!it->Done()) {
+            ct++;
+            it->Next();
+        }
+        EXPECT_EQ(ct, partitions.items(i).records());
+        partition_records += ct;
+        delete it;
+    }
+    EXPECT_EQ(partition_records, records);
+    status = merged->Close();
+    EXPECT_EQ(status, kOk);
+    delete merged;
+    status = reader->Close();
+    EXPECT_EQ(status, kOk);
+    delete reader;
+}
+
+TEST(Merge, OpenFail) {
+    //the inputs are opened concurrently, the missing one is reported
+    std::vector<std::string> file_names;
+    std::vector<std::string> all_keys;
+    WriteMergeInputs("merge_open_fail", &file_names, &all_keys);
+    std::string missing = g_work_dir + "/merge_missing.data";
+    file_names.insert(file_names.begin() + 20, missing);
+    FileSystem::Param param;
+    MergeFileReader* reader = new MergeFileReader();
+    Status status = reader->Open(file_names, param, g_file_type);
+    EXPECT_NE(status, kOk);
+    EXPECT_EQ(reader->GetErrorFile(), missing);
+    delete reader;
+}
+
+TEST(Merge, MixedTypes) {
+    //a local run merged with a file of the work dir
+    Status status;
+    FileSystem::Param param;
+    std::string local_file = "./merge_local.data";
+    std::string work_file = g_work_dir + "/merge_mixed.data";
+    SortFileWriter* local_writer = SortFileWriter::Create(kLocalFile, &status);
+    EXPECT_EQ(status, kOk);
+    SortFileWriter* work_writer = SortFileWriter::Create(g_file_type, &status);
+    EXPECT_EQ(status, kOk);
+    EXPECT_EQ(local_writer->Open(local_file, param), kOk);
+    EXPECT_EQ(work_writer->Open(work_file, param), kOk);
+    char key[256];
+    for (int i = 1; i <= 100; i++) {
+        snprintf(key, sizeof(key), "key_%09d", i);
+        SortFileWriter* writer = i % 3 == 0 ? local_writer : work_writer;
+        EXPECT_EQ(writer->Put(key, "value"), kOk);
+    }
+    EXPECT_EQ(local_writer->Close(), kOk);
+    EXPECT_EQ(work_writer->Close(), kOk);
+    delete local_writer;
+    delete work_writer;
+
+    std::vector<std::string> file_names;
+    std::vector<FileType> file_types;
+    file_names.push_back(work_file);
+    file_types.push_back(g_file_type);
+    file_names.push_back(local_file);
+    file_types.push_back(kLocalFile);
+    MergeFileReader* reader = new MergeFileReader();
+    status = reader->Open(file_names, param, file_types);
+    EXPECT_EQ(status, kOk);
+    SortFileReader::Iterator* it = reader->Scan("", "");
+    int count = 0;
+    while (!it->Done() && count < 100) {
+        snprintf(key, sizeof(key), "key_%09d", ++count);
+        EXPECT_EQ(it->Key(), key);
+        it->Next();
+    }
+    EXPECT_TRUE(it->Done());
+    EXPECT_EQ(count, 100);
+    delete it;
+    status = reader->Close();
+    EXPECT_EQ(status, kOk);
+    delete reader;
+    file_types.pop_back();
+    MergeFileReader mismatched;
+    EXPECT_EQ(mismatched.Open(file_names, param, file_types), kInvalidArg);
+    remove(local_file.c_str());
+}
+
 int main(int argc, char* argv[]) {
     if (argc < 2) {
         printf("./merge_test [hdfs work dir] [filetype](optional) \n");
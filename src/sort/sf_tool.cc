@@ -14,6 +14,9 @@ DEFINE_string(start, "", "start key, in 'read' mode");
 DEFINE_string(end, "", "end key, in 'read' mode");
 DEFINE_string(fs, "hdfs", "filesytem: 'hdfs' or 'local' ");
 DEFINE_string(replica, "3", "the replication number on dfs");
+DEFINE_int32(format, 2, "sort file format version to write: 1/2/3, in 'write' mode");
+DEFINE_string(codec, "snappy", "block codec of format 3: none/snappy/lz4/zstd, in 'write' mode");
+DEFINE_int32(codec_level, 1, "compression level of the codec, zstd only");
 
 using baidu::common::Log;
 using baidu::common::FATAL;
@@ -92,7 +95,14 @@ void DoWrite() {
         exit(-1);
     }
     Status status;
-    SortFileWriter * writer = SortFileWriter::Create(g_file_type, &status);
+    SortFileWriter::Options options;
+    options.version = static_cast<SortFileVersion>(FLAGS_format);
+    if (!SortFileWriter::ParseCodec(FLAGS_codec, &options.codec)) {
+        std::cerr << "unknown codec: " << FLAGS_codec << std::endl;
+        exit(-1);
+    }
+    options.codec_level = FLAGS_codec_level;
+    SortFileWriter * writer = SortFileWriter::Create(g_file_type, options, &status);
     if (status != kOk) {
         std::cerr << "fail to create writer" << std::endl;
         exit(-1);
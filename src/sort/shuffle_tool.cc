@@ -12,14 +12,28 @@
 #include <boost/algorithm/string.hpp>
 #include <boost/bind.hpp>
 #include <boost/scoped_ptr.hpp>
+#include <signal.h>
+#include <timer.h>
 #include "sort_file.h"
+#include "tuo_merge.h"
+#include "map_fetch.h"
 #include "logging.h"
 #include "common/filesystem.h"
 #include "common/tools_util.h"
+#include "common/rpc_client.h"
+#include "proto/app_master.pb.h"
+#include "proto/minion.pb.h"
 #include "thread_pool.h"
 #include "mutex.h"
 
 DEFINE_int32(total, 0, "total numbers of map tasks");
+DEFINE_string(master, "", "master endpoint assigning the tuos, empty to lock them on the dfs");
+DEFINE_string(jobid, "", "the job of this reduce task");
+DEFINE_int32(wait_time, 10, "seconds the master may hold a call when nothing is new");
+DEFINE_int32(master_retry, 3, "failed calls before giving up the master for the lock files, "
+             "before any call succeeds");
+DEFINE_int32(master_lost_retry, 20, "failed calls in a row to a master that has answered "
+             "before the tuo merge of this reducer fails");
 DEFINE_int32(reduce_no, 0, "the reduce number of this reduce task");
 DEFINE_string(work_dir, "/tmp", "the shuffle work dir");
 DEFINE_int32(attempt_id, 0, "the attempt_id of this reduce task");
@@ -29,7 +43,33 @@ DEFINE_string(dfs_user, "", "user name of dfs master");
 DEFINE_string(dfs_password, "", "password of dfs master");
 DEFINE_string(pipe, "streaming", "pipe style: streaming/bistreaming");
 DEFINE_int32(tuo_size, 0, "one tuo contains how many maps'output");
-DEFINE_int32(slow_start_no, 200, "if redcue_no greater than this, sleep a random time");
+DEFINE_int32(slow_start_no, 200, "without a merge lease of the master, sleep a random time "
+             "if reduce_no greater than this");
+DEFINE_int32(read_ahead_threads, 8, "threads reading sort file blocks ahead, 0 to disable");
+DEFINE_int32(merge_threads, 3, "tuos merged at the same time by this reducer");
+DEFINE_int32(poll_interval, 5, "seconds between looking for the tuos merged by others");
+DEFINE_int32(retry_interval, 3, "seconds before merging a failed tuo again");
+DEFINE_int32(format, 2, "sort file format of the tuos and local runs: 2, or 3 with per-block codecs and crc32c");
+DEFINE_string(codec, "snappy", "codec of tuo blocks in format 3: none/snappy/lz4/zstd");
+DEFINE_int32(codec_level, 1, "compression level of tuo blocks, zstd only");
+DEFINE_int32(compress_threads, 2, "threads compressing the blocks of one tuo, 0 compresses inline");
+DEFINE_string(combine_cmd, "", "user combiner run over the merged records, empty for none");
+DEFINE_bool(is_inthash, false, "use IntHasPartitioner or not");
+DEFINE_int32(num_key_fields, 1, "number of key fileds");
+DEFINE_int32(num_partition_fields, 1, "number of partition fileds");
+DEFINE_int32(reduce_total, 1, "total numbers of reduce tasks");
+DEFINE_string(separator, "\t", "sperator used to split line in to fileds");
+DEFINE_int32(premerge_batch, 10, "ready tuos merged into a local run at a time before "
+             "all of them are ready, 0 to disable");
+DEFINE_string(premerge_dir, "./premerge", "local dir of the runs merged before all tuos are ready");
+DEFINE_int32(premerge_max_runs, 8, "the local runs are merged into one when there are this many");
+DEFINE_int32(premerge_disk_mb, 10240, "no more pre-merge once the local runs take this much disk");
+DEFINE_bool(local_shuffle, false, "fetch the map outputs from the map hosts instead of the tuos");
+DEFINE_string(fetch_dir, "./map_output", "local dir of the fetched map outputs");
+DEFINE_int32(fetch_threads, 5, "map outputs fetched at the same time");
+DEFINE_int32(fetch_size, 4 << 20, "bytes of records fetched by one call");
+DEFINE_int32(fetch_retry, 3, "failed fetches of a map output before giving up, the output "
+             "is reported lost if its host is still unreachable then");
 
 using baidu::common::Log;
 using baidu::common::FATAL;
@@ -56,98 +96,417 @@ void FillParam(FileSystem::Param& param) {
     }
 }
 
-void MergeAndPrint(const std::vector<std::string>& file_names) {
+// Bytes given to the reducer and the time spent reading them, the time
+// writing them out to the reducer is not counted
+struct ReadStats {
+    int64_t bytes;
+    int64_t micros;
+    ReadStats() : bytes(0), micros(0) { }
+};
+
+// Returns the exit code of this tool, 0 if all the records are printed
+int MergeAndPrint(const std::vector<std::string>& file_names,
+                  const std::vector<FileType>& file_types, ReadStats* stats) {
     MergeFileReader reader;
     FileSystem::Param param;
     FillParam(param);
-    Status status = reader.Open(file_names, param, kHdfsFile);
+    int64_t read_start = common::timer::get_micros();
+    Status status = reader.Open(file_names, param, file_types);
     if (status != kOk) {
         LOG(WARNING, "fail to open: %s", reader.GetErrorFile().c_str());
-        _exit(1);
+        return 1;
     }
-    char s_reduce_no[256];
-    snprintf(s_reduce_no, sizeof(s_reduce_no), "%05d", FLAGS_reduce_no);
-    std::string s_reduce_key(s_reduce_no);
-    SortFileReader::Iterator* scan_it = reader.Scan(s_reduce_key,
-                                                    s_reduce_key + "\xff");
+    SortFileReader::Iterator* scan_it = reader.ScanPartition(FLAGS_reduce_no);
     if (scan_it->Error() != kOk && scan_it->Error() != kNoMore) {
         LOG(WARNING, "fail to scan: %s", reader.GetErrorFile().c_str());
-        _exit(2);
+        return 2;
     }
+    stats->micros += common::timer::get_micros() - read_start;
     while (!scan_it->Done()) {
+        Slice value = scan_it->ValueSlice();
         if (FLAGS_pipe == "streaming") {
-            const std::string& line = scan_it->Value();
-            if (!line.empty()) {
-                std::cout << line << std::endl;
+            if (!value.empty()) {
+                std::cout.write(value.data(), value.size()) << std::endl;
             }
         } else {
-            std::cout << scan_it->Value();
+            std::cout.write(value.data(), value.size());
         }
+        stats->bytes += value.size();
+        read_start = common::timer::get_micros();
         scan_it->Next();
+        stats->micros += common::timer::get_micros() - read_start;
     }
     if (scan_it->Error() != kOk && scan_it->Error() != kNoMore) {
         LOG(WARNING, "fail to scan: %s", reader.GetErrorFile().c_str());
-        _exit(3);
+        return 3;
     }
     reader.Close();
     delete scan_it;
+    return 0;
+}
+
+// Tuos merged by the threads of this reducer, guarded by g_merge_mu
+struct MergeResult {
+    int tuo_no;
+    bool ok;
+    TuoMerger::Stats stats;
+};
+Mutex g_merge_mu;
+CondVar g_merge_cond(&g_merge_mu);
+std::vector<MergeResult> g_merge_results;
+
+void MergeOneTuo(TuoMerger* merger, int map_from, int map_to, int tuo_now) {
+    MergeResult result;
+    result.tuo_no = tuo_now;
+    result.ok = merger->MergeOneTuo(map_from, map_to, tuo_now, &result.stats);
+    MutexLock lock(&g_merge_mu);
+    g_merge_results.push_back(result);
+    g_merge_cond.Signal();
+}
+
+std::string GetTuoFile(int tuo_no) {
+    std::stringstream ss;
+    ss << FLAGS_work_dir << "/" << tuo_no << ".tuo";
+    return ss.str();
+}
+
+bool AcquireMergeLease();
+void ReleaseMergeLease(const ReadStats& stats, bool failed);
+
+// Merges the partition of this reducer in the tuos ready so far into
+// local runs in the background, so that the final merge only reads a
+// few runs and the tuos that got ready last. A run takes at most
+// premerge_batch tuos, plus all the runs once there are too many.
+// Every run reads the dfs under a merge lease of its own
+class PreMerger {
+public:
+    PreMerger();
+    ~PreMerger();
+    void AddReady(int tuo_no);
+    // Wait for the run being merged, the inputs of the final merge are
+    // the runs and the tuos in none of them
+    void Finish(int n_tuo, std::vector<std::string>* files, std::vector<FileType>* types);
+private:
+    void Schedule();
+    void MergeRun(const std::vector<int>& tuos, const std::vector<std::string>& runs,
+                  const std::string& output);
+    Status WriteRun(const std::vector<std::string>& files, const std::vector<FileType>& types,
+                    const std::string& output, int64_t* records, ReadStats* stats);
+    Mutex mu_;
+    CondVar cond_;
+    ThreadPool pool_;
+    boost::scoped_ptr<FileSystem> local_fs_;
+    // tuos told ready, and the ones of them in no run yet
+    std::set<int> ready_;
+    std::vector<int> pending_;
+    std::set<int> in_runs_;
+    // run -> its size on the disk
+    std::map<std::string, int64_t> runs_;
+    int64_t run_bytes_;
+    int run_no_;
+    bool merging_;
+    bool stopped_;
+};
+
+PreMerger::PreMerger() : cond_(&mu_), pool_(1), local_fs_(FileSystem::CreateLocalFs()),
+                         run_bytes_(0), run_no_(0), merging_(false), stopped_(false) {
+    if (FLAGS_premerge_batch <= 0) {
+        stopped_ = true;
+        return;
+    }
+    local_fs_->Remove(FLAGS_premerge_dir);
+    if (!local_fs_->Mkdirs(FLAGS_premerge_dir)) {
+        LOG(WARNING, "fail to make %s, no pre-merge", FLAGS_premerge_dir.c_str());
+        stopped_ = true;
+    }
+}
+
+PreMerger::~PreMerger() {
+    pool_.Stop(true);
+    if (FLAGS_premerge_batch > 0) {
+        local_fs_->Remove(FLAGS_premerge_dir);
+    }
+}
+
+void PreMerger::AddReady(int tuo_no) {
+    MutexLock lock(&mu_);
+    if (!ready_.insert(tuo_no).second) {
+        return;
+    }
+    pending_.push_back(tuo_no);
+    Schedule();
+}
+
+// Caller holds mu_
+void PreMerger::Schedule() {
+    if (merging_ || stopped_ || (int)pending_.size() < FLAGS_premerge_batch) {
+        return;
+    }
+    std::vector<int> tuos(pending_.begin(), pending_.begin() + FLAGS_premerge_batch);
+    pending_.erase(pending_.begin(), pending_.begin() + FLAGS_premerge_batch);
+    std::vector<std::string> runs;
+    if ((int)runs_.size() >= FLAGS_premerge_max_runs) {
+        std::map<std::string, int64_t>::iterator it;
+        for (it = runs_.begin(); it != runs_.end(); it++) {
+            runs.push_back(it->first);
+        }
+    }
+    std::stringstream ss;
+    ss << FLAGS_premerge_dir << "/run_" << run_no_++ << ".sort";
+    merging_ = true;
+    pool_.AddTask(boost::bind(&PreMerger::MergeRun, this, tuos, runs, ss.str()));
+}
+
+Status PreMerger::WriteRun(const std::vector<std::string>& files,
+                           const std::vector<FileType>& types,
+                           const std::string& output, int64_t* records,
+                           ReadStats* stats) {
+    MergeFileReader reader;
+    FileSystem::Param param;
+    FillParam(param);
+    int64_t read_start = common::timer::get_micros();
+    Status status = reader.Open(files, param, types);
+    if (status != kOk) {
+        LOG(WARNING, "fail to open: %s", reader.GetErrorFile().c_str());
+        return status;
+    }
+    SortFileWriter::Options options;
+    options.version = static_cast<SortFileVersion>(FLAGS_format);
+    options.partitioned = true;
+    SortFileWriter::ParseCodec(FLAGS_codec, &options.codec);
+    options.codec_level = FLAGS_codec_level;
+    boost::scoped_ptr<SortFileWriter> writer(
+            SortFileWriter::Create(kLocalFile, options, &status));
+    if (status == kOk) {
+        status = writer->Open(output, FileSystem::Param());
+    }
+    if (status != kOk) {
+        LOG(WARNING, "fail to open %s for write", output.c_str());
+        reader.Close();
+        return status;
+    }
+    boost::scoped_ptr<SortFileReader::Iterator> scan_it(reader.ScanPartition(FLAGS_reduce_no));
+    while (!scan_it->Done() && status == kOk) {
+        status = writer->Put(scan_it->KeySlice(), scan_it->ValueSlice());
+        stats->bytes += scan_it->KeySlice().size() + scan_it->ValueSlice().size();
+        (*records)++;
+        scan_it->Next();
+    }
+    //the local writes are counted too, the run is bound by the reads
+    stats->micros += common::timer::get_micros() - read_start;
+    if (status == kOk && scan_it->Error() != kOk && scan_it->Error() != kNoMore) {
+        LOG(WARNING, "fail to scan: %s", reader.GetErrorFile().c_str());
+        status = scan_it->Error();
+    }
+    scan_it.reset();
+    Status close_status = writer->Close();
+    if (status == kOk) {
+        status = close_status;
+    }
+    reader.Close();
+    return status;
+}
+
+void PreMerger::MergeRun(const std::vector<int>& tuos, const std::vector<std::string>& runs,
+                         const std::string& output) {
+    std::vector<std::string> files;
+    std::vector<FileType> types;
+    for (size_t i = 0; i < tuos.size(); i++) {
+        files.push_back(GetTuoFile(tuos[i]));
+        types.push_back(kHdfsFile);
+    }
+    for (size_t i = 0; i < runs.size(); i++) {
+        files.push_back(runs[i]);
+        types.push_back(kLocalFile);
+    }
+    //the dfs serves the pre-merge runs under the same admission as the
+    //final merges
+    bool leased = false;
+    if (!FLAGS_master.empty()) {
+        leased = AcquireMergeLease();
+    }
+    int64_t start = common::timer::get_micros();
+    int64_t records = 0;
+    ReadStats stats;
+    Status status = WriteRun(files, types, output, &records, &stats);
+    if (leased) {
+        ReleaseMergeLease(stats, status != kOk);
+    }
+    FileInfo info;
+    if (status == kOk && !local_fs_->Stat(output, &info)) {
+        status = kReadFileFail;
+    }
+    MutexLock lock(&mu_);
+    merging_ = false;
+    if (status != kOk) {
+        //the final merge reads them from where they are
+        LOG(WARNING, "fail to pre-merge %d tuos and %d runs, no more pre-merge: %s",
+            (int)tuos.size(), (int)runs.size(), Status_Name(status).c_str());
+        local_fs_->Remove(output);
+        pending_.insert(pending_.end(), tuos.begin(), tuos.end());
+        stopped_ = true;
+        cond_.Signal();
+        return;
+    }
+    for (size_t i = 0; i < runs.size(); i++) {
+        run_bytes_ -= runs_[runs[i]];
+        runs_.erase(runs[i]);
+        local_fs_->Remove(runs[i]);
+    }
+    runs_[output] = info.size;
+    run_bytes_ += info.size;
+    in_runs_.insert(tuos.begin(), tuos.end());
+    LOG(INFO, "pre-merge %d tuos and %d runs into %s, %lld records in %.1fs, "
+        "#%d tuos in %d runs of %lldMB", (int)tuos.size(), (int)runs.size(),
+        output.c_str(), records, (common::timer::get_micros() - start) / 1000000.0,
+        (int)in_runs_.size(), (int)runs_.size(), run_bytes_ >> 20);
+    if (run_bytes_ > ((int64_t)FLAGS_premerge_disk_mb << 20)) {
+        LOG(WARNING, "local runs take %lldMB, no more pre-merge", run_bytes_ >> 20);
+        stopped_ = true;
+    }
+    Schedule();
+    cond_.Signal();
+}
+
+void PreMerger::Finish(int n_tuo, std::vector<std::string>* files,
+                       std::vector<FileType>* types) {
+    MutexLock lock(&mu_);
+    stopped_ = true;
+    while (merging_) {
+        cond_.Wait();
+    }
+    std::map<std::string, int64_t>::iterator it;
+    for (it = runs_.begin(); it != runs_.end(); it++) {
+        files->push_back(it->first);
+        types->push_back(kLocalFile);
+    }
+    for (int i = 0; i < n_tuo; i++) {
+        if (in_runs_.find(i) == in_runs_.end()) {
+            files->push_back(GetTuoFile(i));
+            types->push_back(kHdfsFile);
+        }
+    }
+    LOG(INFO, "final merge of %d runs and %d tuos", (int)runs_.size(),
+        n_tuo - (int)in_runs_.size());
+}
+
+TuoMerger::Options GetMergeOptions() {
+    TuoMerger::Options options;
+    FillParam(options.param);
+    options.reduce_no = FLAGS_reduce_no;
+    options.attempt_id = FLAGS_attempt_id;
+    options.work_dir = FLAGS_work_dir;
+    options.format = FLAGS_format;
+    options.codec = FLAGS_codec;
+    options.codec_level = FLAGS_codec_level;
+    options.compress_threads = FLAGS_compress_threads;
+    options.combine_cmd = FLAGS_combine_cmd;
+    options.pipe = FLAGS_pipe;
+    options.is_inthash = FLAGS_is_inthash;
+    options.num_key_fields = FLAGS_num_key_fields;
+    options.num_partition_fields = FLAGS_num_partition_fields;
+    options.reduce_total = FLAGS_reduce_total;
+    options.separator = FLAGS_separator;
+    return options;
+}
+
+std::string GetLockDir(int tuo_now) {
+    std::stringstream ss_lock;
+    ss_lock << FLAGS_work_dir << "/tuo_lock_" << tuo_now << "/";
+    return ss_lock.str();
+}
+
+std::string GetLockFlag(int tuo_now) {
+    std::stringstream my_lock_flag;
+    my_lock_flag << GetLockDir(tuo_now) << FLAGS_reduce_no;
+    return my_lock_flag.str();
+}
+
+// Whether this reducer should help on a tuo of another reducer,
+// the lock dir of the tuo holds a flag of every reducer merging it
+bool TryLockTuo(int tuo_now, int n_tuo) {
+    if (FLAGS_reduce_no > n_tuo * 2) {
+        return false;
+    }
+    const std::string lock_dir = GetLockDir(tuo_now);
+    const std::string my_lock_flag = GetLockFlag(tuo_now);
+    std::vector<baidu::shuttle::FileInfo> lockers;
+    g_fs->List(lock_dir, &lockers);
+    if (lockers.size() > 2 && !g_fs->Exist(my_lock_flag)) {
+        LOG(WARNING, "two many workers on this tuo!: %d", tuo_now);
+        double rn = rand() / (RAND_MAX+0.0);
+        if (rn < 0.99) {
+            return false;
+        }
+    }
+    if (!g_fs->Exist(my_lock_flag) &&
+        g_fs->Exist(FLAGS_work_dir)) {
+        g_fs->Open(my_lock_flag, kWriteFile);
+        g_fs->Close(); //create my lock
+    }
+    return true;
 }
 
-bool MergeOneTuo(int map_from, int map_to, int tuo_now) {
-    std::stringstream cmd_ss;
-    cmd_ss << "./tuo_merger --reduce_no=" << FLAGS_reduce_no 
-           << " --work_dir=" << FLAGS_work_dir
-           << " --attempt_id=" << FLAGS_attempt_id
-           << " --dfs_host=" << FLAGS_dfs_host
-           << " --dfs_port=" << FLAGS_dfs_port
-           << " --dfs_user=" << FLAGS_dfs_user
-           << " --dfs_password=" << FLAGS_dfs_password
-           << " --from_no=" << map_from
-           << " --to_no=" << map_to
-           << " --tuo_no=" << tuo_now;
-    FILE* tuo_merger = popen(cmd_ss.str().c_str(), "r");
-    int exit_code = pclose(tuo_merger);
-    return exit_code == 0;
-}
-
-int MergeTuo() {
+int MergeTuo(PreMerger* pre_merger) {
     srand(time(0));
     int n_tuo = (int)ceil((float)FLAGS_total / FLAGS_tuo_size) ;
-    LOG(INFO, "will merge %d tuo", n_tuo);
+    LOG(INFO, "will merge %d tuo, %d at a time", n_tuo, FLAGS_merge_threads);
     std::vector<int> tuo_list;
     for (int i = 0; i < n_tuo; i++) {
         tuo_list.push_back(i);
     }
     std::random_shuffle(tuo_list.begin(), tuo_list.end());
-    std::set<int> ready_tuo_set;
     if (FLAGS_reduce_no < n_tuo) {
-        while (ready_tuo_set.empty()) { //at first, merge tuo belongs to me!
-            int tuo_now = FLAGS_reduce_no;
-            std::stringstream ss;
-            ss << FLAGS_work_dir << "/" << tuo_now << ".tuo";
-            const std::string& tuo_file_name = ss.str();
-            if (g_fs->Exist(tuo_file_name)) {
-                ready_tuo_set.insert(tuo_now);
-                LOG(INFO, "lucky, my tuo ready, total #%d/%d tuo ready",
-                    ready_tuo_set.size(), n_tuo);
-                continue;
-            }
-            int map_from = tuo_now * FLAGS_tuo_size;
-            int map_to = std::min( (tuo_now + 1) * FLAGS_tuo_size - 1, FLAGS_total - 1);
-            LOG(INFO, "merge tuo from %d to %d", map_from, map_to);
-            if (MergeOneTuo(map_from, map_to, tuo_now)) {
-                ready_tuo_set.insert(tuo_now);
-                LOG(INFO, "my tuo done. total #%d/%d tuo ready", ready_tuo_set.size(), n_tuo);
-            }
-            sleep(5);
-        }
+        //at first, merge tuo belongs to me!
+        tuo_list.erase(std::find(tuo_list.begin(), tuo_list.end(), FLAGS_reduce_no));
+        tuo_list.insert(tuo_list.begin(), FLAGS_reduce_no);
     }
-
+    TuoMerger merger(GetMergeOptions());
+    ThreadPool pool(FLAGS_merge_threads);
+    std::set<int> ready_tuo_set;
+    std::set<int> merging_tuo_set;
+    //a failed tuo is tried again after a while, tuo -> micros
+    std::map<int, int64_t> retry_time;
+    int64_t merged_records = 0;
+    int64_t start = common::timer::get_micros();
     while (ready_tuo_set.size() < (size_t)n_tuo) {
+        std::vector<MergeResult> results;
+        {
+            MutexLock lock(&g_merge_mu);
+            results.swap(g_merge_results);
+        }
+        std::vector<MergeResult>::iterator jt;
+        for (jt = results.begin(); jt != results.end(); jt++) {
+            merging_tuo_set.erase(jt->tuo_no);
+            if (jt->ok) {
+                ready_tuo_set.insert(jt->tuo_no);
+                pre_merger->AddReady(jt->tuo_no);
+                merged_records += jt->stats.records;
+                LOG(INFO, "tuo %d merged, %d sort files, %lld records%s in %.1fs, "
+                    "total #%d/%d tuo ready",
+                    jt->tuo_no, jt->stats.inputs, jt->stats.records,
+                    jt->stats.combined ? " combined" : "",
+                    jt->stats.micros / 1000000.0, ready_tuo_set.size(), n_tuo);
+                g_fs->Remove(GetLockDir(jt->tuo_no));
+            } else {
+                LOG(WARNING, "fail to merge tuo %d, will retry", jt->tuo_no);
+                retry_time[jt->tuo_no] = common::timer::get_micros()
+                                         + FLAGS_retry_interval * 1000000L;
+                g_fs->Remove(GetLockFlag(jt->tuo_no));
+            }
+        }
+        int64_t now = common::timer::get_micros();
         std::vector<int>::iterator it;
         for (it = tuo_list.begin(); it != tuo_list.end(); it++) {
+            if ((int)merging_tuo_set.size() >= FLAGS_merge_threads) {
+                break;
+            }
             int tuo_now = *it;
-            if (ready_tuo_set.find(tuo_now) != ready_tuo_set.end()) {
+            if (ready_tuo_set.find(tuo_now) != ready_tuo_set.end()
+                || merging_tuo_set.find(tuo_now) != merging_tuo_set.end()) {
+                continue;
+            }
+            if (retry_time.find(tuo_now) != retry_time.end() && now < retry_time[tuo_now]) {
                 continue;
             }
             std::stringstream ss;
@@ -155,58 +514,279 @@ int MergeTuo() {
             const std::string& tuo_file_name = ss.str();
             if (g_fs->Exist(tuo_file_name)) {
                 ready_tuo_set.insert(tuo_now);
-                LOG(INFO, "lucky, total #%d/%d tuo ready", ready_tuo_set.size(), n_tuo);
+                pre_merger->AddReady(tuo_now);
+                LOG(INFO, "lucky, tuo %d ready, total #%d/%d tuo ready",
+                    tuo_now, ready_tuo_set.size(), n_tuo);
                 continue;
             }
-            if (FLAGS_reduce_no > n_tuo * 2) {
+            if (tuo_now != FLAGS_reduce_no && !TryLockTuo(tuo_now, n_tuo)) {
                 continue;
             }
-            std::stringstream ss_lock;
-            std::stringstream my_lock_flag;
-            ss_lock << FLAGS_work_dir << "/tuo_lock_" << tuo_now << "/";
-            std::vector<baidu::shuttle::FileInfo> lockers;
-            g_fs->List(ss_lock.str(), &lockers);
-            my_lock_flag << ss_lock.str() << FLAGS_reduce_no;
-            if (lockers.size() > 2 && !g_fs->Exist(my_lock_flag.str())) {
-                LOG(WARNING, "two many workers on this tuo!: %d", tuo_now);
-                double rn = rand() / (RAND_MAX+0.0);
-                if (rn < 0.99) {
-                    sleep(1);
-                    continue;
-                }
+            int map_from = tuo_now * FLAGS_tuo_size;
+            int map_to = std::min( (tuo_now + 1) * FLAGS_tuo_size - 1, FLAGS_total - 1);
+            LOG(INFO, "merge tuo %d from %d to %d", tuo_now, map_from, map_to);
+            merging_tuo_set.insert(tuo_now);
+            pool.AddTask(boost::bind(&MergeOneTuo, &merger, map_from, map_to, tuo_now));
+        }
+        if (ready_tuo_set.size() >= (size_t)n_tuo) {
+            break;
+        }
+        //wake up as soon as a merge of this reducer is done, or look
+        //for the tuos of the others again after a while
+        MutexLock lock(&g_merge_mu);
+        if (g_merge_results.empty()) {
+            g_merge_cond.TimeWait(FLAGS_poll_interval * 1000);
+        }
+        if (g_merge_results.empty()) {
+            LOG(INFO, "tuo progress: #%d/%d ready, %d merging here, %lld records "
+                "merged here in %.1fs", ready_tuo_set.size(), n_tuo,
+                merging_tuo_set.size(), merged_records,
+                (common::timer::get_micros() - start) / 1000000.0);
+        }
+    }// end of while
+    return n_tuo;
+}
+
+// The master assigns every tuo to one reducer and tells when all are
+// ready, no lock files or listing on the dfs. Returns -1 if the master
+// does not keep a tuo table, the lock files are used then. Returns -2 if
+// the master stops the merge or is lost after it has assigned tuos, the
+// other reducers still go by the master so the lock files are no way out
+int MergeTuoWithMaster(PreMerger* pre_merger) {
+    RpcClient rpc_client;
+    Master_Stub* stub = NULL;
+    rpc_client.GetStub(FLAGS_master, &stub);
+    boost::scoped_ptr<Master_Stub> stub_guard(stub);
+    TuoMerger merger(GetMergeOptions());
+    ThreadPool pool(FLAGS_merge_threads);
+    int merging = 0;
+    int n_tuo = -1;
+    int ready_count = 0;
+    int failed_calls = 0;
+    bool synced = false;
+    std::vector<int> merged_tuos;
+    std::vector<int> failed_tuos;
+    int64_t merged_records = 0;
+    int64_t start = common::timer::get_micros();
+    while (true) {
+        std::vector<MergeResult> results;
+        {
+            MutexLock lock(&g_merge_mu);
+            results.swap(g_merge_results);
+        }
+        std::vector<MergeResult>::iterator jt;
+        for (jt = results.begin(); jt != results.end(); jt++) {
+            merging--;
+            if (jt->ok) {
+                merged_tuos.push_back(jt->tuo_no);
+                pre_merger->AddReady(jt->tuo_no);
+                merged_records += jt->stats.records;
+                LOG(INFO, "tuo %d merged, %d sort files, %lld records%s in %.1fs",
+                    jt->tuo_no, jt->stats.inputs, jt->stats.records,
+                    jt->stats.combined ? " combined" : "",
+                    jt->stats.micros / 1000000.0);
+            } else {
+                LOG(WARNING, "fail to merge tuo %d, give it back", jt->tuo_no);
+                failed_tuos.push_back(jt->tuo_no);
+            }
+        }
+        TuoMergeRequest request;
+        TuoMergeResponse response;
+        request.set_jobid(FLAGS_jobid);
+        request.set_reduce_no(FLAGS_reduce_no);
+        request.set_attempt_id(FLAGS_attempt_id);
+        for (size_t i = 0; i < merged_tuos.size(); i++) {
+            request.add_merged_tuos(merged_tuos[i]);
+        }
+        for (size_t i = 0; i < failed_tuos.size(); i++) {
+            request.add_failed_tuos(failed_tuos[i]);
+        }
+        request.set_free_slots(FLAGS_merge_threads - merging);
+        request.set_ready_known(ready_count);
+        //merges of this reducer are reported as soon as they are done
+        request.set_wait_time(merging > 0 ? 0 : FLAGS_wait_time);
+        bool ok = rpc_client.SendRequest(stub, &Master_Stub::SyncTuoMerge,
+                                         &request, &response, FLAGS_wait_time + 5, 1);
+        if (!ok) {
+            LOG(WARNING, "fail to sync tuo merge with master[%s]", FLAGS_master.c_str());
+            failed_calls++;
+            if (!synced && failed_calls >= FLAGS_master_retry) {
+                return -1;
+            }
+            if (synced && failed_calls >= FLAGS_master_lost_retry) {
+                LOG(WARNING, "master[%s] is lost for %d calls, give up the tuo merge",
+                    FLAGS_master.c_str(), failed_calls);
+                //the merges going on finish their tuos, the queued ones are dropped
+                pool.Stop(false);
+                return -2;
             }
-            if (!g_fs->Exist(my_lock_flag.str()) &&
-                g_fs->Exist(FLAGS_work_dir)) {
-                g_fs->Open(my_lock_flag.str(), kWriteFile);
-                g_fs->Close(); //create my lock
+            sleep(FLAGS_retry_interval);
+            continue;
+        }
+        synced = true;
+        failed_calls = 0;
+        merged_tuos.clear();
+        failed_tuos.clear();
+        if (response.status() == kNoMore) {
+            LOG(WARNING, "master keeps no tuo table for %s", FLAGS_jobid.c_str());
+            return -1;
+        } else if (response.status() != kOk) {
+            LOG(WARNING, "master stops the tuo merge: %s",
+                Status_Name(response.status()).c_str());
+            pool.Stop(false);
+            return -2;
+        }
+        n_tuo = response.tuo_total();
+        FLAGS_tuo_size = response.tuo_size();
+        ready_count = response.ready_count();
+        for (int i = 0; i < response.ready_tuos_size(); i++) {
+            pre_merger->AddReady(response.ready_tuos(i));
+        }
+        for (int i = 0; i < response.assigned_tuos_size(); i++) {
+            int tuo_now = response.assigned_tuos(i);
+            std::stringstream ss;
+            ss << FLAGS_work_dir << "/" << tuo_now << ".tuo";
+            //merged before the master restarted, its sort files are gone
+            if (g_fs->Exist(ss.str())) {
+                LOG(INFO, "lucky, tuo %d ready", tuo_now);
+                merged_tuos.push_back(tuo_now);
+                pre_merger->AddReady(tuo_now);
+                continue;
             }
             int map_from = tuo_now * FLAGS_tuo_size;
             int map_to = std::min( (tuo_now + 1) * FLAGS_tuo_size - 1, FLAGS_total - 1);
-            LOG(INFO, "merge tuo from %d to %d", map_from, map_to);
-            if (MergeOneTuo(map_from, map_to, tuo_now)) {
-                ready_tuo_set.insert(tuo_now);
-                LOG(INFO, "total #%d/%d tuo ready", ready_tuo_set.size(), n_tuo);
-                g_fs->Remove(ss_lock.str());
-            } else {
-                g_fs->Remove(my_lock_flag.str());
+            LOG(INFO, "merge tuo %d from %d to %d", tuo_now, map_from, map_to);
+            merging++;
+            pool.AddTask(boost::bind(&MergeOneTuo, &merger, map_from, map_to, tuo_now));
+        }
+        LOG(INFO, "tuo progress: #%d/%d ready, %d merging here, %lld records "
+            "merged here in %.1fs", ready_count, n_tuo, merging, merged_records,
+            (common::timer::get_micros() - start) / 1000000.0);
+        if (ready_count >= n_tuo && merging == 0 && merged_tuos.empty()) {
+            break;
+        }
+        if (merging > 0) {
+            MutexLock lock(&g_merge_mu);
+            if (g_merge_results.empty()) {
+                g_merge_cond.TimeWait(FLAGS_poll_interval * 1000);
             }
-            sleep(3);
-        } // end of for
-        sleep(5);
-    }// end of while
+        }
+    }
     return n_tuo;
 }
 
+// Wait until the master lets this reducer read the tuos, so that no more
+// reducers read the dfs at the same time than it can serve well. Returns
+// false if the master gives no leases
+bool AcquireMergeLease() {
+    RpcClient rpc_client;
+    Master_Stub* stub = NULL;
+    rpc_client.GetStub(FLAGS_master, &stub);
+    boost::scoped_ptr<Master_Stub> stub_guard(stub);
+    int failed_calls = 0;
+    int64_t start = common::timer::get_micros();
+    while (true) {
+        MergeLeaseRequest request;
+        MergeLeaseResponse response;
+        request.set_jobid(FLAGS_jobid);
+        request.set_reduce_no(FLAGS_reduce_no);
+        request.set_attempt_id(FLAGS_attempt_id);
+        request.set_wait_time(FLAGS_wait_time);
+        bool ok = rpc_client.SendRequest(stub, &Master_Stub::SyncMergeLease,
+                                         &request, &response, FLAGS_wait_time + 5, 1);
+        if (!ok) {
+            LOG(WARNING, "fail to ask master[%s] for a merge lease", FLAGS_master.c_str());
+            if (++failed_calls >= FLAGS_master_retry) {
+                return false;
+            }
+            sleep(FLAGS_retry_interval);
+            continue;
+        }
+        failed_calls = 0;
+        if (response.status() != kOk) {
+            LOG(WARNING, "master gives no merge lease: %s",
+                Status_Name(response.status()).c_str());
+            return false;
+        }
+        if (response.granted()) {
+            LOG(INFO, "got a merge lease in %.1fs, %d leases at most",
+                (common::timer::get_micros() - start) / 1000000.0,
+                response.lease_limit());
+            return true;
+        }
+        LOG(INFO, "wait for a merge lease, %d leases at most", response.lease_limit());
+    }
+}
+
+// Give the lease back with how fast the read went, the master sizes the
+// leases of the job by it
+void ReleaseMergeLease(const ReadStats& stats, bool failed) {
+    RpcClient rpc_client;
+    Master_Stub* stub = NULL;
+    rpc_client.GetStub(FLAGS_master, &stub);
+    boost::scoped_ptr<Master_Stub> stub_guard(stub);
+    MergeLeaseRequest request;
+    MergeLeaseResponse response;
+    request.set_jobid(FLAGS_jobid);
+    request.set_reduce_no(FLAGS_reduce_no);
+    request.set_attempt_id(FLAGS_attempt_id);
+    request.set_release(true);
+    request.set_read_bytes(stats.bytes);
+    request.set_read_micros(stats.micros);
+    request.set_read_failed(failed);
+    LOG(INFO, "release the merge lease, read %lld bytes in %.1fs%s",
+        stats.bytes, stats.micros / 1000000.0, failed ? " and failed" : "");
+    if (!rpc_client.SendRequest(stub, &Master_Stub::SyncMergeLease,
+                                &request, &response, 5, FLAGS_master_retry)) {
+        //the lease goes back anyway when this attempt finishes
+        LOG(WARNING, "fail to release the merge lease on master[%s]", FLAGS_master.c_str());
+    }
+}
+
 int main(int argc, char* argv[]) {
     baidu::common::SetLogFile("./shuffle_tool.log");
     baidu::common::SetWarningFile("./shuffle_tool.log.wf");
     google::ParseCommandLineFlags(&argc, &argv, true);
+    if (!FLAGS_combine_cmd.empty()) {
+        signal(SIGPIPE, SIG_IGN); //a combiner that quits early fails the writes
+    }
+    SortFileReader::EnableReadAhead(FLAGS_read_ahead_threads);
     FileSystem::Param param;
     FillParam(param);
     g_fs = FileSystem::CreateInfHdfs(param);
     if (FLAGS_total == 0 ) {
         LOG(FATAL, "invalid map task total");
     }
+    if (FLAGS_local_shuffle) {
+        MapFetcher::Options options;
+        options.master = FLAGS_master;
+        options.job_id = FLAGS_jobid;
+        options.reduce_no = FLAGS_reduce_no;
+        options.attempt_id = FLAGS_attempt_id;
+        options.fetch_dir = FLAGS_fetch_dir;
+        options.fetch_threads = FLAGS_fetch_threads;
+        options.fetch_size = FLAGS_fetch_size;
+        options.fetch_retry = FLAGS_fetch_retry;
+        options.retry_interval = FLAGS_retry_interval;
+        options.poll_interval = FLAGS_poll_interval;
+        options.format = FLAGS_format;
+        options.codec = FLAGS_codec;
+        options.codec_level = FLAGS_codec_level;
+        MapFetcher fetcher(options);
+        std::vector<std::string> file_names;
+        Status status = fetcher.FetchAll(&file_names);
+        if (status != kOk) {
+            LOG(WARNING, "fail to fetch the map outputs: %s", Status_Name(status).c_str());
+            _exit(status == kWriteFileFail || status == kReadFileFail ? 5 : 4);
+        }
+        ReadStats stats;
+        int ret = MergeAndPrint(file_names, std::vector<FileType>(file_names.size(), kLocalFile),
+                                &stats);
+        if (ret != 0) {
+            _exit(ret);
+        }
+        return 0;
+    }
     if (FLAGS_tuo_size == 0) {
         FLAGS_tuo_size = std::min((int32_t)ceil(sqrt(FLAGS_total)), 300);
         int n_tuo = (int)ceil((float)FLAGS_total / FLAGS_tuo_size);
@@ -215,19 +795,37 @@ int main(int argc, char* argv[]) {
         }
     }
     LOG(INFO, "tuo_size: %d", FLAGS_tuo_size);
-    int n_tuo = MergeTuo();
-    std::vector<std::string>  tuo_file_names;
-    for (int i = 0;  i< n_tuo; i++) {
-        std::stringstream ss;
-        ss << FLAGS_work_dir + "/" << i << ".tuo";
-        tuo_file_names.push_back(ss.str());
-    }
-    if (FLAGS_reduce_no > FLAGS_slow_start_no) {
+    PreMerger pre_merger;
+    int n_tuo = -1;
+    if (!FLAGS_master.empty()) {
+        n_tuo = MergeTuoWithMaster(&pre_merger);
+    }
+    if (n_tuo == -2) {
+        _exit(4);
+    }
+    if (n_tuo < 0) {
+        n_tuo = MergeTuo(&pre_merger);
+    }
+    std::vector<std::string> file_names;
+    std::vector<FileType> file_types;
+    pre_merger.Finish(n_tuo, &file_names, &file_types);
+    bool leased = false;
+    if (!FLAGS_master.empty()) {
+        leased = AcquireMergeLease();
+    }
+    if (!leased && FLAGS_reduce_no > FLAGS_slow_start_no) {
         double rn = rand() / (RAND_MAX+0.0);
         int random_period = static_cast<int>(rn * 90);
         LOG(INFO, "sleep a random time: %d", random_period);
         sleep(random_period);
     }
-    MergeAndPrint(tuo_file_names);
+    ReadStats stats;
+    int ret = MergeAndPrint(file_names, file_types, &stats);
+    if (leased) {
+        ReleaseMergeLease(stats, ret != 0);
+    }
+    if (ret != 0) {
+        _exit(ret);
+    }
     return 0;
 }
@@ -9,6 +9,7 @@
 #include "proto/shuttle.pb.h"
 #include "proto/sortfile.pb.h"
 #include "common/filesystem.h"
+#include "common/slice.h"
 #include "thread_pool.h"
 #include "mutex.h"
 
@@ -21,21 +22,55 @@ enum FileType {
     kLocalFile = 2
 };
 
+enum SortFileVersion {
+    kSortFileV1 = 1, // snappy compressed protobuf DataBlock
+    kSortFileV2 = 2, // snappy compressed length-prefixed records
+    kSortFileV3 = 3  // v2 records, per-block codec and crc32c
+};
+
+// Stored as one byte in the v3 block header
+enum CompressCodec {
+    kCodecNone = 0,
+    kCodecSnappy = 1,
+    kCodecLz4 = 2,   // needs HAVE_LZ4
+    kCodecZstd = 3   // needs HAVE_ZSTD
+};
+
 class SortFileReader {
 public:
     static SortFileReader* Create(FileType file_type, Status* status);
+    // Share parsed index blocks among the readers of this process,
+    // capacity is in bytes, 0 (the default) disables the cache
+    static void SetIndexCacheCapacity(int64_t capacity);
+    // Read and uncompress the next blocks of every iterator ahead of
+    // time, using a shared pool of this many threads. Can not be undone
+    static void EnableReadAhead(int threads);
     class Iterator {
     public:
         virtual bool Done() = 0;
         virtual void Next() = 0;
         virtual const std::string& Key() = 0;
         virtual const std::string& Value() = 0;
+        // Zero-copy access to current record, only valid until Next()
+        virtual Slice KeySlice() { return Key(); }
+        virtual Slice ValueSlice() { return Value(); }
         virtual Status Error() = 0;
         virtual ~Iterator() {};
         virtual const std::string GetFileName() = 0;
     };
     virtual Status Open(const std::string& path, FileSystem::Param param) = 0;
+    // One live iterator per reader: a new scan, or any other read of the
+    // reader, ends the read-ahead of the iterators before it
     virtual Iterator* Scan(const std::string& start_key, const std::string& end_key) = 0;
+    // Scan the records of one reduce partition, i.e. the keys prefixed with "%05d\t"
+    virtual Iterator* ScanPartition(int partition) = 0;
+    // Load the footer, the index and the partition directory now
+    // instead of at the first scan
+    virtual Status LoadIndex() = 0;
+    // Return kNoMore if the file has no partition directory
+    virtual Status ReadPartitionIndex(PartitionIndex* partitions) = 0;
+    // The iterators of a mapped local file decode its raw blocks in place,
+    // they must not be used after Close
     virtual Status Close() = 0;
     virtual std::string GetFileName() = 0;
     virtual ~SortFileReader() {}
@@ -43,29 +78,42 @@ public:
 
 class SortFileWriter {
 public:
+    struct Options {
+        // v2 by default, v3 is opt-in until every reader of the job is
+        // built with it
+        SortFileVersion version;
+        // v2 and later: keys are prefix compressed against their predecessor,
+        // every restart_interval records a key is stored in full.
+        // 0 disables the compression.
+        int32_t restart_interval;
+        // v2 and later: keys carry the "%05d\t" reduce prefix,
+        // record the exact block range of every partition
+        bool partitioned;
+        // v3 only: blocks that do not shrink enough are stored raw
+        CompressCodec codec;
+        int32_t codec_level;
+        // blocks are compressed on this many background threads and
+        // appended in order by another one while Put fills the next block,
+        // 0 does all of it inline in Put
+        int32_t compress_threads;
+        Options() : version(kSortFileV2), restart_interval(16), partitioned(false),
+                    codec(kCodecSnappy), codec_level(1), compress_threads(0) { }
+    };
+    // Map "none", "snappy", "lz4" or "zstd" to the codec
+    static bool ParseCodec(const std::string& name, CompressCodec* codec);
     static SortFileWriter* Create(FileType file_type, Status* status);
+    static SortFileWriter* Create(FileType file_type, const Options& options,
+                                  Status* status);
     virtual Status Open(const std::string& path, FileSystem::Param param) = 0;
-    virtual Status Put(const std::string& key, const std::string& value) = 0;
+    virtual Status Put(const Slice& key, const Slice& value) = 0;
     virtual Status Close() = 0;
     virtual ~SortFileWriter() {}
 };
 
 class MergeFileReader {
 public:
-    struct MergeItem {
-        std::string key_;
-        std::string value_;
-        int it_offset_;
-        MergeItem(const std::string& key, const std::string& value, int it_offset) {
-            key_ = key;
-            value_ = value;
-            it_offset_ = it_offset;
-        }
-        bool operator<(const MergeItem& other) const {
-            return key_ > other.key_;
-        }
-    };
-
+    // k-way merge by a loser tree over the input iterators,
+    // the current record is the one of the winning input
     class MergeIterator : public SortFileReader::Iterator {
     public:
         MergeIterator(const std::vector<SortFileReader::Iterator*>& iters,
@@ -73,35 +121,76 @@ public:
         virtual ~MergeIterator();
         bool Done();
         void Next();
-        const std::string& Key() {return key_;}
-        const std::string& Value() {return value_;}
+        const std::string& Key();
+        const std::string& Value();
+        Slice KeySlice();
+        Slice ValueSlice();
         Status Error() {return status_;};
         const std::string GetFileName() {return "";}
     private:
-        std::string key_;
-        std::string value_;
+        bool Beats(int a, int b);
+        void Replay(int input);
+        void LoadKey(int input);
+        void SetPrefix(int input);
+        std::string empty_;
         Status status_;
         std::vector<SortFileReader::Iterator*> iters_;
-        std::priority_queue<MergeItem> queue_;
+        // tree_[0] is the winner, tree_[1..k-1] the losers of the matches,
+        // input i plays its first match at node (i + k) / 2
+        std::vector<int> tree_;
+        // key of every input, valid until its Next(), and its 8 bytes
+        // after common_ big endian for the cheap comparisons
+        std::vector<Slice> keys_;
+        std::vector<uint64_t> prefixes_;
+        // shared by all the keys so far, e.g. the partition of a reduce
+        std::string common_;
+        std::vector<bool> drained_;
         MergeFileReader* merge_reader_;
     };
 
+    MergeFileReader() { }
     ~MergeFileReader();
     Status Open(const std::vector<std::string>& files, 
                 FileSystem::Param param,
                 FileType file_type);
+    // Every file with its own type, e.g. local runs and files on the dfs
+    Status Open(const std::vector<std::string>& files,
+                FileSystem::Param param,
+                const std::vector<FileType>& file_types);
     SortFileReader::Iterator* Scan(const std::string& start_key, const std::string& end_key);
+    SortFileReader::Iterator* ScanPartition(int partition);
+    // Merge the opened files into one sort file at output, records gets
+    // the number of records merged
+    Status MergeTo(const std::string& output,
+                   FileSystem::Param param,
+                   FileType file_type,
+                   const SortFileWriter::Options& options,
+                   int64_t* records);
     Status Close();
     const std::string& GetErrorFile() {return err_file_;}
 private:
+    SortFileReader::Iterator* DoScan(const std::string& start_key,
+                                     const std::string& end_key,
+                                     int partition);
     void AddIter(std::vector<SortFileReader::Iterator*>* iters,
                  SortFileReader* reader,
                  const std::string& start_key,
                  const std::string& end_key,
+                 int partition,
                  bool* has_error);
+    // the time spent by the open pool, summed over the files
+    struct OpenTimes {
+        int64_t open_micros;
+        int64_t index_micros;
+        int64_t slowest_micros;
+        std::string slowest_file;
+        OpenTimes() : open_micros(0), index_micros(0), slowest_micros(0) { }
+    };
     void AddReader(const std::string& file_name,
                    FileSystem::Param param,
                    FileType type,
+                   SortFileReader** slot,
+                   OpenTimes* times,
                    Status* st); 
     void CloseReader(SortFileReader* reader, Status* st);
     std::vector<SortFileReader*> readers_;
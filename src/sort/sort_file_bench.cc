@@ -0,0 +1,317 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+#include <algorithm>
+#include <string>
+#include <iostream>
+#include <queue>
+#include <vector>
+#include <gflags/gflags.h>
+#include <boost/algorithm/string.hpp>
+#include "sort_file.h"
+
+DEFINE_string(mode, "scan", "scan: write a file and scan it, "
+              "merge: merge sorted inputs in memory");
+DEFINE_string(fs, "local", "filesytem: 'hdfs' or 'local' ");
+DEFINE_string(file, "/tmp/sort_file_bench.data", "file to write and scan");
+DEFINE_int32(records, 2000000, "records to write");
+DEFINE_int32(value_size, 64, "bytes of every value");
+DEFINE_int32(format, 3, "sort file format to write: 2, or 3 for the codecs");
+DEFINE_string(codec, "snappy", "block codec of format 3: none/snappy/lz4/zstd");
+DEFINE_int32(rounds, 3, "full scans of the file");
+DEFINE_int32(read_ahead_threads, 0, "read-ahead threads, 0 disables read-ahead");
+DEFINE_bool(skip_write, false, "scan an existing file only");
+DEFINE_string(inputs, "16,256,2048", "numbers of merge inputs to try, in 'merge' mode");
+
+using namespace baidu::shuttle;
+
+// Count the heap allocations of the whole process, glibc only
+extern "C" {
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t n, size_t size);
+extern void* __libc_realloc(void* ptr, size_t size);
+extern void __libc_free(void* ptr);
+}
+
+static volatile int64_t g_allocs = 0;
+static volatile int64_t g_alloc_bytes = 0;
+
+static inline void CountAlloc(size_t size) {
+    __sync_fetch_and_add(&g_allocs, 1);
+    __sync_fetch_and_add(&g_alloc_bytes, (int64_t)size);
+}
+
+extern "C" void* malloc(size_t size) {
+    CountAlloc(size);
+    return __libc_malloc(size);
+}
+
+extern "C" void* calloc(size_t n, size_t size) {
+    CountAlloc(n * size);
+    return __libc_calloc(n, size);
+}
+
+extern "C" void* realloc(void* ptr, size_t size) {
+    CountAlloc(size);
+    return __libc_realloc(ptr, size);
+}
+
+extern "C" void free(void* ptr) {
+    __libc_free(ptr);
+}
+
+static double NowSeconds() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static FileType g_file_type = kLocalFile;
+
+int64_t DoWrite() {
+    SortFileWriter::Options options;
+    options.version = static_cast<SortFileVersion>(FLAGS_format);
+    if (!SortFileWriter::ParseCodec(FLAGS_codec, &options.codec)) {
+        std::cerr << "unknown codec: " << FLAGS_codec << std::endl;
+        exit(-1);
+    }
+    Status status;
+    SortFileWriter* writer = SortFileWriter::Create(g_file_type, options, &status);
+    if (writer == NULL || writer->Open(FLAGS_file, FileSystem::Param()) != kOk) {
+        std::cerr << "fail to open for write: " << FLAGS_file << std::endl;
+        exit(-1);
+    }
+    char key[64];
+    std::string value(FLAGS_value_size, 'v');
+    unsigned int seed = 2016;
+    int64_t raw_bytes = 0;
+    for (int i = 0; i < FLAGS_records; i++) {
+        snprintf(key, sizeof(key), "key_%012d", i);
+        for (size_t j = 0; j < value.size(); j++) {
+            value[j] = 'a' + rand_r(&seed) % 26;
+        }
+        if (writer->Put(key, value) != kOk) {
+            std::cerr << "fail to put: " << key << std::endl;
+            exit(-1);
+        }
+        raw_bytes += strlen(key) + value.size();
+    }
+    if (writer->Close() != kOk) {
+        std::cerr << "fail to close: " << FLAGS_file << std::endl;
+        exit(-1);
+    }
+    delete writer;
+    return raw_bytes;
+}
+
+void DoScan(int64_t raw_bytes) {
+    Status status;
+    SortFileReader* reader = SortFileReader::Create(g_file_type, &status);
+    if (reader == NULL || reader->Open(FLAGS_file, FileSystem::Param()) != kOk) {
+        std::cerr << "fail to open for read: " << FLAGS_file << std::endl;
+        exit(-1);
+    }
+    double start = NowSeconds();
+    int64_t setup_allocs = g_allocs;
+    SortFileReader::Iterator* it = reader->Scan("", "");
+    //the index and the first block are loaded by Scan
+    setup_allocs = g_allocs - setup_allocs;
+    int64_t allocs = g_allocs;
+    int64_t alloc_bytes = g_alloc_bytes;
+    int64_t records = 0;
+    int64_t bytes = 0;
+    while (!it->Done()) {
+        bytes += it->KeySlice().size() + it->ValueSlice().size();
+        records++;
+        it->Next();
+    }
+    if (it->Error() != kOk && it->Error() != kNoMore) {
+        std::cerr << "fail to scan: " << Status_Name(it->Error()) << std::endl;
+        exit(-1);
+    }
+    allocs = g_allocs - allocs;
+    alloc_bytes = g_alloc_bytes - alloc_bytes;
+    delete it;
+    double cost = NowSeconds() - start;
+    reader->Close();
+    delete reader;
+    if (raw_bytes <= 0) {
+        raw_bytes = bytes;
+    }
+    //blocks are cut at 64KB of records
+    int64_t blocks = std::max(raw_bytes / (64 << 10), (int64_t)1);
+    printf("records: %ld, ~blocks: %ld, time: %.3fs, %.1f MB/s, scan setup allocs: %ld, "
+           "allocs: %ld (%.2f per block), alloc bytes: %.1f KB per block\n",
+           records, blocks, cost, bytes / cost / (1 << 20), setup_allocs,
+           allocs, (double)allocs / blocks, alloc_bytes / 1024.0 / blocks);
+}
+
+// Sorted keys packed in memory like the records of a block,
+// one input of the merge
+struct MergeInput {
+    std::string data;
+    std::vector<size_t> offsets;
+};
+
+class MemoryIterator : public SortFileReader::Iterator {
+public:
+    MemoryIterator(const MergeInput* input,
+                   const std::vector<std::string>* values) :
+                   input_(input), values_(values), pos_(0) { }
+    bool Done() { return pos_ + 1 >= input_->offsets.size(); }
+    void Next() { pos_++; }
+    const std::string& Key() {
+        key_.assign(KeySlice().data(), KeySlice().size());
+        return key_;
+    }
+    const std::string& Value() { return (*values_)[pos_ % values_->size()]; }
+    Slice KeySlice() {
+        return Slice(input_->data.data() + input_->offsets[pos_],
+                     input_->offsets[pos_ + 1] - input_->offsets[pos_]);
+    }
+    Status Error() { return Done() ? kNoMore : kOk; }
+    const std::string GetFileName() { return ""; }
+private:
+    const MergeInput* input_;
+    const std::vector<std::string>* values_;
+    size_t pos_;
+    std::string key_;
+};
+
+// What the merge did before the loser tree: a heap of copied records
+struct HeapItem {
+    std::string key;
+    std::string value;
+    int input;
+    bool operator<(const HeapItem& other) const {
+        return key > other.key;
+    }
+};
+
+int64_t HeapMerge(const std::vector<SortFileReader::Iterator*>& iters) {
+    std::priority_queue<HeapItem> queue;
+    for (size_t i = 0; i < iters.size(); i++) {
+        if (!iters[i]->Done()) {
+            HeapItem item;
+            item.key = iters[i]->Key();
+            item.value = iters[i]->Value();
+            item.input = i;
+            queue.push(item);
+        }
+    }
+    std::string key;
+    std::string value;
+    int64_t bytes = 0;
+    while (!queue.empty()) {
+        key = queue.top().key;
+        value = queue.top().value;
+        bytes += key.size() + value.size();
+        int input = queue.top().input;
+        queue.pop();
+        iters[input]->Next();
+        if (!iters[input]->Done()) {
+            HeapItem item;
+            item.key = iters[input]->Key();
+            item.value = iters[input]->Value();
+            item.input = input;
+            queue.push(item);
+        }
+    }
+    return bytes;
+}
+
+int64_t TreeMerge(const std::vector<SortFileReader::Iterator*>& iters) {
+    MergeFileReader reader;
+    //the merge iterator owns and deletes the inputs
+    MergeFileReader::MergeIterator it(iters, &reader);
+    int64_t bytes = 0;
+    while (!it.Done()) {
+        bytes += it.KeySlice().size() + it.ValueSlice().size();
+        it.Next();
+    }
+    return bytes;
+}
+
+void DoMerge(int inputs) {
+    //keys of one reduce partition, as the shuffle merges them
+    std::vector<std::vector<std::string> > keys(inputs);
+    unsigned int seed = 2016;
+    char key[64];
+    for (int i = 0; i < FLAGS_records; i++) {
+        int n = snprintf(key, sizeof(key), "%05d\t", 3);
+        for (int j = 0; j < 16; j++) {
+            key[n++] = 'a' + rand_r(&seed) % 26;
+        }
+        keys[rand_r(&seed) % inputs].push_back(std::string(key, n));
+    }
+    std::vector<MergeInput> merge_inputs(inputs);
+    for (int i = 0; i < inputs; i++) {
+        std::sort(keys[i].begin(), keys[i].end());
+        MergeInput& input = merge_inputs[i];
+        input.offsets.push_back(0);
+        for (size_t j = 0; j < keys[i].size(); j++) {
+            input.data.append(keys[i][j]);
+            input.offsets.push_back(input.data.size());
+        }
+        std::vector<std::string>().swap(keys[i]);
+    }
+    std::vector<std::string> values(1024);
+    for (size_t i = 0; i < values.size(); i++) {
+        values[i].assign(FLAGS_value_size, 'a' + i % 26);
+    }
+    for (int round = 0; round < FLAGS_rounds; round++) {
+        std::vector<SortFileReader::Iterator*> iters;
+        for (int i = 0; i < inputs; i++) {
+            iters.push_back(new MemoryIterator(&merge_inputs[i], &values));
+        }
+        int64_t allocs = g_allocs;
+        double start = NowSeconds();
+        int64_t bytes = HeapMerge(iters);
+        double heap_cost = NowSeconds() - start;
+        int64_t heap_allocs = g_allocs - allocs;
+        for (int i = 0; i < inputs; i++) {
+            delete iters[i];
+            iters[i] = new MemoryIterator(&merge_inputs[i], &values);
+        }
+        allocs = g_allocs;
+        start = NowSeconds();
+        int64_t tree_bytes = TreeMerge(iters);
+        double tree_cost = NowSeconds() - start;
+        int64_t tree_allocs = g_allocs - allocs;
+        if (tree_bytes != bytes) {
+            std::cerr << "merged bytes differ: " << bytes << " vs " << tree_bytes << std::endl;
+            exit(-1);
+        }
+        printf("inputs: %d, records: %d, heap: %.3fs (%.0f ns/record, %ld allocs), "
+               "loser tree: %.3fs (%.0f ns/record, %ld allocs), speedup: %.2fx\n",
+               inputs, FLAGS_records,
+               heap_cost, heap_cost * 1e9 / FLAGS_records, heap_allocs,
+               tree_cost, tree_cost * 1e9 / FLAGS_records, tree_allocs,
+               heap_cost / tree_cost);
+    }
+}
+
+int main(int argc, char* argv[]) {
+    google::ParseCommandLineFlags(&argc, &argv, true);
+    if (FLAGS_mode == "merge") {
+        std::vector<std::string> inputs;
+        boost::split(inputs, FLAGS_inputs, boost::is_any_of(","));
+        for (size_t i = 0; i < inputs.size(); i++) {
+            DoMerge(atoi(inputs[i].c_str()));
+        }
+        return 0;
+    }
+    if (FLAGS_fs == "hdfs") {
+        g_file_type = kHdfsFile;
+    }
+    SortFileReader::EnableReadAhead(FLAGS_read_ahead_threads);
+    int64_t raw_bytes = 0;
+    if (!FLAGS_skip_write) {
+        raw_bytes = DoWrite();
+    }
+    for (int i = 0; i < FLAGS_rounds; i++) {
+        DoScan(raw_bytes);
+    }
+    return 0;
+}
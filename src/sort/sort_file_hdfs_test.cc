@@ -1,4 +1,6 @@
 #include <gtest/gtest.h>
+#include <stdlib.h>
+#include <algorithm>
 #include <string>
 #include "sort_file.h"
 
@@ -95,6 +97,109 @@ TEST(HdfsTest, PutSameKey) {
     printf("done\n");
 }
 
+TEST(HdfsTest, PutV1) {
+    Status status;
+    SortFileWriter::Options options;
+    options.version = kSortFileV1;
+    SortFileWriter* writer = SortFileWriter::Create(g_file_type, options, &status);
+    EXPECT_EQ(status, kOk);
+    FileSystem::Param param;
+    std::string file_path = g_work_dir + "/put_test_v1.data";
+    status = writer->Open(file_path, param);
+    EXPECT_EQ(status, kOk);
+    char key[256] = {'\0'};
+    char value[256] = {'\0'};
+    for (int i = 1; i <= 25000; i++) {
+        snprintf(key, sizeof(key), "key_%09d", i);
+        snprintf(value, sizeof(value), "value_%d", i*2);
+        status = writer->Put(key, value);
+        EXPECT_EQ(status, kOk);
+    }
+    status = writer->Close();
+    EXPECT_EQ(status, kOk);
+    delete writer;
+    printf("done\n");
+}
+
+TEST(HdfsTest, PutV2) {
+    Status status;
+    SortFileWriter::Options options;
+    options.version = kSortFileV2;
+    options.partitioned = true;
+    SortFileWriter* writer = SortFileWriter::Create(g_file_type, options, &status);
+    EXPECT_EQ(status, kOk);
+    FileSystem::Param param;
+    std::string file_path = g_work_dir + "/put_test_v2.data";
+    status = writer->Open(file_path, param);
+    EXPECT_EQ(status, kOk);
+    char key[256] = {'\0'};
+    char value[256] = {'\0'};
+    for (int i = 1; i <= 25000; i++) {
+        snprintf(key, sizeof(key), "%05d\tkey_%09d", i / 1000, i);
+        snprintf(value, sizeof(value), "value_%d", i*2);
+        status = writer->Put(key, value);
+        EXPECT_EQ(status, kOk);
+    }
+    status = writer->Close();
+    EXPECT_EQ(status, kOk);
+    delete writer;
+    printf("done\n");
+}
+
+TEST(HdfsTest, PutPlain) {
+    Status status;
+    SortFileWriter::Options options;
+    options.restart_interval = 0;
+    SortFileWriter* writer = SortFileWriter::Create(g_file_type, options, &status);
+    EXPECT_EQ(status, kOk);
+    FileSystem::Param param;
+    std::string file_path = g_work_dir + "/put_test_plain.data";
+    status = writer->Open(file_path, param);
+    EXPECT_EQ(status, kOk);
+    char key[256] = {'\0'};
+    char value[256] = {'\0'};
+    for (int i = 1; i <= 25000; i++) {
+        snprintf(key, sizeof(key), "%05d\tkey_%09d", i / 1000, i);
+        snprintf(value, sizeof(value), "value_%d", i*2);
+        status = writer->Put(key, value);
+        EXPECT_EQ(status, kOk);
+    }
+    status = writer->Close();
+    EXPECT_EQ(status, kOk);
+    delete writer;
+    printf("done\n");
+}
+
+TEST(HdfsTest, PutPartitioned) {
+    Status status;
+    SortFileWriter::Options options;
+    options.partitioned = true;
+    SortFileWriter* writer = SortFileWriter::Create(g_file_type, options, &status);
+    EXPECT_EQ(status, kOk);
+    FileSystem::Param param;
+    std::string file_path = g_work_dir + "/put_test_partition.data";
+    status = writer->Open(file_path, param);
+    EXPECT_EQ(status, kOk);
+    status = writer->Put("no_partition", "value");
+    EXPECT_EQ(status, kInvalidArg);
+    char key[256] = {'\0'};
+    char value[256] = {'\0'};
+    for (int i = 1; i <= 100000; i++) {
+        //partition 3 is left empty
+        if (i / 10000 == 3) {
+            continue;
+        }
+        snprintf(key, sizeof(key), "%05d\tkey_%09d", i / 10000, i);
+        snprintf(value, sizeof(value), "value_%d", i*2);
+        status = writer->Put(key, value);
+        EXPECT_EQ(status, kOk);
+    }
+    status = writer->Close();
+    EXPECT_EQ(status, kOk);
+    delete writer;
+    printf("done\n");
+}
+
 TEST(HdfsTest, Read) {
     Status status;
     SortFileReader* reader = SortFileReader::Create(g_file_type, &status);
@@ -336,6 +441,526 @@ TEST(HdfsTest, ReadSameKey) {
     delete it;
 }
 
+TEST(HdfsTest, ReadV1) {
+    Status status;
+    SortFileReader* reader = SortFileReader::Create(g_file_type, &status);
+    EXPECT_EQ(status, kOk);
+    FileSystem::Param param;
+    std::string file_path = g_work_dir + "/put_test_v1.data";
+    status = reader->Open(file_path, param);
+    EXPECT_EQ(status, kOk);
+    SortFileReader::Iterator *it = reader->Scan("key_000008888", "key_000018888");
+    EXPECT_EQ(it->Error(), kOk);
+    int n = 8888;
+    while (!it->Done()) {
+        char key[256];
+        char value[256];
+        snprintf(key, sizeof(key), "key_%09d", n);
+        snprintf(value, sizeof(value), "value_%d", n*2);
+        EXPECT_EQ(it->KeySlice().ToString(), std::string(key));
+        EXPECT_EQ(it->ValueSlice().ToString(), std::string(value));
+        it->Next();
+        n++;
+    }
+    EXPECT_EQ(it->Error(), kOk);
+    status = reader->Close();
+    EXPECT_EQ(status, kOk);
+    EXPECT_EQ(n, 18888);
+    delete it;
+    delete reader;
+}
+
+TEST(HdfsTest, ReadSlice) {
+    Status status;
+    SortFileReader* reader = SortFileReader::Create(g_file_type, &status);
+    EXPECT_EQ(status, kOk);
+    FileSystem::Param param;
+    std::string file_path = g_work_dir + "/put_test2.data";
+    status = reader->Open(file_path, param);
+    EXPECT_EQ(status, kOk);
+    SortFileReader::Iterator *it = reader->Scan("", "");
+    EXPECT_EQ(it->Error(), kOk);
+    int n = 1;
+    while (!it->Done()) {
+        char key[256];
+        char value[256];
+        snprintf(key, sizeof(key), "key_%09d", n);
+        snprintf(value, sizeof(value), "value_%d", n*2);
+        EXPECT_TRUE(it->KeySlice() == Slice(key));
+        EXPECT_TRUE(it->ValueSlice() == Slice(value));
+        EXPECT_EQ(it->Key(), std::string(key));
+        it->Next();
+        n++;
+    }
+    EXPECT_EQ(it->Error(), kNoMore);
+    status = reader->Close();
+    EXPECT_EQ(status, kOk);
+    EXPECT_EQ(n, 251);
+    delete it;
+    delete reader;
+}
+
+TEST(HdfsTest, ReadPlain) {
+    Status status;
+    SortFileReader* reader = SortFileReader::Create(g_file_type, &status);
+    EXPECT_EQ(status, kOk);
+    FileSystem::Param param;
+    std::string file_path = g_work_dir + "/put_test_plain.data";
+    status = reader->Open(file_path, param);
+    EXPECT_EQ(status, kOk);
+    SortFileReader::Iterator *it = reader->Scan("00003\t", "00004\t");
+    EXPECT_EQ(it->Error(), kOk);
+    int n = 3000;
+    while (!it->Done()) {
+        char key[256];
+        snprintf(key, sizeof(key), "%05d\tkey_%09d", n / 1000, n);
+        EXPECT_EQ(it->Key(), std::string(key));
+        it->Next();
+        n++;
+    }
+    EXPECT_EQ(it->Error(), kOk);
+    status = reader->Close();
+    EXPECT_EQ(status, kOk);
+    EXPECT_EQ(n, 4000);
+    delete it;
+    delete reader;
+}
+
+TEST(HdfsTest, ReadSeek) {
+    Status status;
+    SortFileReader* reader = SortFileReader::Create(g_file_type, &status);
+    EXPECT_EQ(status, kOk);
+    FileSystem::Param param;
+    std::string file_path = g_work_dir + "/put_test.data";
+    status = reader->Open(file_path, param);
+    EXPECT_EQ(status, kOk);
+    int starts[] = {1, 2, 16, 17, 33, 4097, 123457, total};
+    for (size_t i = 0; i < sizeof(starts) / sizeof(int); i++) {
+        char start_key[256];
+        char key[256];
+        //start between two keys, the first hit is the next one
+        snprintf(start_key, sizeof(start_key), "key_%09d~", starts[i] - 1);
+        snprintf(key, sizeof(key), "key_%09d", starts[i]);
+        SortFileReader::Iterator *it = reader->Scan(start_key, "");
+        EXPECT_EQ(it->Error(), kOk);
+        EXPECT_FALSE(it->Done());
+        EXPECT_EQ(it->Key(), std::string(key));
+        delete it;
+    }
+    status = reader->Close();
+    EXPECT_EQ(status, kOk);
+    delete reader;
+}
+
+TEST(HdfsTest, ReadPartition) {
+    Status status;
+    SortFileReader* reader = SortFileReader::Create(g_file_type, &status);
+    EXPECT_EQ(status, kOk);
+    FileSystem::Param param;
+    std::string file_path = g_work_dir + "/put_test_partition.data";
+    status = reader->Open(file_path, param);
+    EXPECT_EQ(status, kOk);
+    PartitionIndex partitions;
+    status = reader->ReadPartitionIndex(&partitions);
+    EXPECT_EQ(status, kOk);
+    EXPECT_EQ(partitions.items_size(), 10);
+    int64_t records = 0;
+    for (int i = 0; i < partitions.items_size(); i++) {
+        const PartitionRange& range = partitions.items(i);
+        EXPECT_NE(range.partition(), 3);
+        EXPECT_LE(range.first_block(), range.last_block());
+        records += range.records();
+    }
+    EXPECT_EQ(records, 90000);
+    for (int partition = 0; partition <= 10; partition++) {
+        SortFileReader::Iterator *it = reader->ScanPartition(partition);
+        EXPECT_EQ(it->Error(), kOk);
+        int n = (partition == 0 ? 1 : partition * 10000);
+        while (!it->Done()) {
+            char key[256];
+            snprintf(key, sizeof(key), "%05d\tkey_%09d", partition, n);
+            EXPECT_EQ(it->Key(), std::string(key));
+            it->Next();
+            n++;
+        }
+        EXPECT_TRUE(it->Error() == kOk || it->Error() == kNoMore);
+        if (partition == 3) {
+            EXPECT_EQ(n, 30000);
+        } else if (partition == 10) {
+            EXPECT_EQ(n, 100001);
+        } else {
+            EXPECT_EQ(n, (partition + 1) * 10000);
+        }
+        delete it;
+    }
+    status = reader->Close();
+    EXPECT_EQ(status, kOk);
+    delete reader;
+}
+
+TEST(HdfsTest, ReadPartitionNoIndex) {
+    Status status;
+    SortFileReader* reader = SortFileReader::Create(g_file_type, &status);
+    EXPECT_EQ(status, kOk);
+    FileSystem::Param param;
+    std::string file_path = g_work_dir + "/put_test_plain.data";
+    status = reader->Open(file_path, param);
+    EXPECT_EQ(status, kOk);
+    PartitionIndex partitions;
+    status = reader->ReadPartitionIndex(&partitions);
+    EXPECT_EQ(status, kNoMore);
+    SortFileReader::Iterator *it = reader->ScanPartition(3);
+    EXPECT_EQ(it->Error(), kOk);
+    int n = 3000;
+    while (!it->Done()) {
+        it->Next();
+        n++;
+    }
+    EXPECT_EQ(n, 4000);
+    delete it;
+    status = reader->Close();
+    EXPECT_EQ(status, kOk);
+    delete reader;
+}
+
+static void PutSeries(const std::string& file_path, int from, int to) {
+    Status status;
+    SortFileWriter* writer = SortFileWriter::Create(g_file_type, &status);
+    EXPECT_EQ(status, kOk);
+    FileSystem::Param param;
+    status = writer->Open(file_path, param);
+    EXPECT_EQ(status, kOk);
+    char key[256] = {'\0'};
+    for (int i = from; i < to; i++) {
+        snprintf(key, sizeof(key), "key_%09d", i);
+        status = writer->Put(key, "value");
+        EXPECT_EQ(status, kOk);
+    }
+    status = writer->Close();
+    EXPECT_EQ(status, kOk);
+    delete writer;
+}
+
+static int CountRange(SortFileReader* reader, const std::string& start_key,
+                      const std::string& end_key) {
+    SortFileReader::Iterator *it = reader->Scan(start_key, end_key);
+    EXPECT_EQ(it->Error(), kOk);
+    int count = 0;
+    while (!it->Done()) {
+        count++;
+        it->Next();
+    }
+    delete it;
+    return count;
+}
+
+TEST(HdfsTest, ReadIndexCache) {
+    SortFileReader::SetIndexCacheCapacity(64 << 20);
+    std::string file_path = g_work_dir + "/put_test_cache.data";
+    PutSeries(file_path, 0, 20000);
+    FileSystem::Param param;
+    Status status;
+    for (int round = 0; round < 2; round++) {
+        //the second reader is served by the cache
+        SortFileReader* reader = SortFileReader::Create(g_file_type, &status);
+        EXPECT_EQ(status, kOk);
+        status = reader->Open(file_path, param);
+        EXPECT_EQ(status, kOk);
+        EXPECT_EQ(CountRange(reader, "key_000001000", "key_000002000"), 1000);
+        EXPECT_EQ(CountRange(reader, "key_000015000", ""), 5000);
+        status = reader->Close();
+        EXPECT_EQ(status, kOk);
+        delete reader;
+    }
+    //a rewritten file must not reuse the stale index
+    PutSeries(file_path, 10000, 40000);
+    SortFileReader* reader = SortFileReader::Create(g_file_type, &status);
+    EXPECT_EQ(status, kOk);
+    status = reader->Open(file_path, param);
+    EXPECT_EQ(status, kOk);
+    EXPECT_EQ(CountRange(reader, "key_000001000", "key_000002000"), 0);
+    EXPECT_EQ(CountRange(reader, "key_000015000", ""), 25000);
+    status = reader->Close();
+    EXPECT_EQ(status, kOk);
+    delete reader;
+    SortFileReader::SetIndexCacheCapacity(0);
+}
+
+TEST(HdfsTest, ReadAhead) {
+    SortFileReader::EnableReadAhead(4);
+    Status status;
+    SortFileReader* reader = SortFileReader::Create(g_file_type, &status);
+    EXPECT_EQ(status, kOk);
+    FileSystem::Param param;
+    std::string file_path = g_work_dir + "/put_test.data";
+    status = reader->Open(file_path, param);
+    EXPECT_EQ(status, kOk);
+    EXPECT_EQ(CountRange(reader, "", ""), total);
+    EXPECT_EQ(CountRange(reader, "key_000080000", "key_000090000"), 10000);
+    //stop the read-ahead of a live iterator by closing the reader
+    SortFileReader::Iterator *it = reader->Scan("key_000100000", "");
+    EXPECT_EQ(it->Error(), kOk);
+    EXPECT_EQ(it->Key(), "key_000100000");
+    status = reader->Close();
+    EXPECT_EQ(status, kOk);
+    delete it;
+    delete reader;
+    //a second scan ends the read-ahead of the first iterator, which fails
+    //after its blocks read so far instead of reading at the moved cursor
+    reader = SortFileReader::Create(g_file_type, &status);
+    status = reader->Open(file_path, param);
+    EXPECT_EQ(status, kOk);
+    SortFileReader::Iterator* first = reader->Scan("", "");
+    SortFileReader::Iterator* second = reader->Scan("key_000050000", "");
+    int n = 0;
+    while (!first->Done()) {
+        EXPECT_EQ(atoi(first->Key().c_str() + 4), n + 1);
+        first->Next();
+        n++;
+    }
+    EXPECT_LT(n, total);
+    EXPECT_EQ(first->Error(), kReadFileFail);
+    n = 0;
+    while (!second->Done()) {
+        second->Next();
+        n++;
+    }
+    EXPECT_EQ(n, total - 49999);
+    //the iterators may go after the reader
+    status = reader->Close();
+    EXPECT_EQ(status, kOk);
+    delete reader;
+    delete second;
+    delete first;
+}
+
+TEST(HdfsTest, ReadV2) {
+    Status status;
+    SortFileReader* reader = SortFileReader::Create(g_file_type, &status);
+    EXPECT_EQ(status, kOk);
+    FileSystem::Param param;
+    std::string file_path = g_work_dir + "/put_test_v2.data";
+    status = reader->Open(file_path, param);
+    EXPECT_EQ(status, kOk);
+    SortFileReader::Iterator *it = reader->ScanPartition(7);
+    EXPECT_EQ(it->Error(), kOk);
+    int n = 7000;
+    while (!it->Done()) {
+        char key[256];
+        snprintf(key, sizeof(key), "%05d\tkey_%09d", n / 1000, n);
+        EXPECT_EQ(it->Key(), std::string(key));
+        it->Next();
+        n++;
+    }
+    EXPECT_EQ(n, 8000);
+    delete it;
+    status = reader->Close();
+    EXPECT_EQ(status, kOk);
+    delete reader;
+}
+
+TEST(HdfsTest, ReadTwoLevel) {
+    Status status;
+    SortFileWriter::Options options;
+    options.version = kSortFileV3;
+    SortFileWriter* writer = SortFileWriter::Create(g_file_type, options, &status);
+    EXPECT_EQ(status, kOk);
+    FileSystem::Param param;
+    std::string file_path = g_work_dir + "/put_test_v3.data";
+    status = writer->Open(file_path, param);
+    EXPECT_EQ(status, kOk);
+    char start_key[256] = {'\0'};
+    char end_key[256] = {'\0'};
+    for (int i = 1; i <= total; i++) {
+        snprintf(start_key, sizeof(start_key), "key_%09d", i);
+        snprintf(end_key, sizeof(end_key), "value_%d", i*2);
+        status = writer->Put(start_key, end_key);
+        EXPECT_EQ(status, kOk);
+    }
+    status = writer->Close();
+    EXPECT_EQ(status, kOk);
+    delete writer;
+
+    SortFileReader* reader = SortFileReader::Create(g_file_type, &status);
+    EXPECT_EQ(status, kOk);
+    status = reader->Open(file_path, param);
+    EXPECT_EQ(status, kOk);
+    //the blocks of put_test_v3.data span more than one index segment
+    for (int i = 1; i <= total; i += 37501) {
+        snprintf(start_key, sizeof(start_key), "key_%09d", i);
+        snprintf(end_key, sizeof(end_key), "key_%09d", i + 100);
+        SortFileReader::Iterator *it = reader->Scan(start_key, end_key);
+        EXPECT_EQ(it->Error(), kOk);
+        EXPECT_FALSE(it->Done());
+        EXPECT_EQ(it->Key(), std::string(start_key));
+        delete it;
+        EXPECT_EQ(CountRange(reader, start_key, end_key), std::min(100, total - i + 1));
+    }
+    status = reader->Close();
+    EXPECT_EQ(status, kOk);
+    delete reader;
+}
+
+TEST(HdfsTest, ReadIncompressible) {
+    std::string file_path = g_work_dir + "/put_test_random.data";
+    Status status;
+    SortFileWriter::Options options;
+    options.version = kSortFileV3;
+    SortFileWriter* writer = SortFileWriter::Create(g_file_type, options, &status);
+    EXPECT_EQ(status, kOk);
+    FileSystem::Param param;
+    status = writer->Open(file_path, param);
+    EXPECT_EQ(status, kOk);
+    char key[256] = {'\0'};
+    std::vector<std::string> values;
+    unsigned int seed = 12345;
+    for (int i = 0; i < 20000; i++) {
+        std::string value;
+        for (int j = 0; j < 64; j++) {
+            value.push_back((char)(rand_r(&seed) & 0xFF));
+        }
+        values.push_back(value);
+        snprintf(key, sizeof(key), "key_%09d", i);
+        status = writer->Put(key, value);
+        EXPECT_EQ(status, kOk);
+    }
+    status = writer->Close();
+    EXPECT_EQ(status, kOk);
+    delete writer;
+
+    SortFileReader* reader = SortFileReader::Create(g_file_type, &status);
+    EXPECT_EQ(status, kOk);
+    status = reader->Open(file_path, param);
+    EXPECT_EQ(status, kOk);
+    SortFileReader::Iterator *it = reader->Scan("", "");
+    int n = 0;
+    while (!it->Done()) {
+        EXPECT_TRUE(it->ValueSlice() == Slice(values[n]));
+        it->Next();
+        n++;
+    }
+    EXPECT_EQ(it->Error(), kNoMore);
+    EXPECT_EQ(n, 20000);
+    delete it;
+    status = reader->Close();
+    EXPECT_EQ(status, kOk);
+    delete reader;
+}
+
+TEST(HdfsTest, ReadPipelined) {
+    std::string file_path = g_work_dir + "/put_test_pipelined.data";
+    Status status;
+    SortFileWriter::Options options;
+    options.partitioned = true;
+    options.compress_threads = 4;
+    SortFileWriter* writer = SortFileWriter::Create(g_file_type, options, &status);
+    EXPECT_EQ(status, kOk);
+    FileSystem::Param param;
+    status = writer->Open(file_path, param);
+    EXPECT_EQ(status, kOk);
+    char key[256] = {'\0'};
+    char value[256] = {'\0'};
+    for (int i = 1; i <= 100000; i++) {
+        if (i / 10000 == 3) {
+            continue;
+        }
+        snprintf(key, sizeof(key), "%05d\tkey_%09d", i / 10000, i);
+        snprintf(value, sizeof(value), "value_%d", i*2);
+        status = writer->Put(key, value);
+        EXPECT_EQ(status, kOk);
+    }
+    status = writer->Close();
+    EXPECT_EQ(status, kOk);
+    delete writer;
+
+    //same records as PutPartitioned, so the same layout
+    SortFileReader* reader = SortFileReader::Create(g_file_type, &status);
+    EXPECT_EQ(status, kOk);
+    status = reader->Open(g_work_dir + "/put_test_partition.data", param);
+    EXPECT_EQ(status, kOk);
+    PartitionIndex expected;
+    status = reader->ReadPartitionIndex(&expected);
+    EXPECT_EQ(status, kOk);
+    reader->Close();
+    delete reader;
+
+    reader = SortFileReader::Create(g_file_type, &status);
+    EXPECT_EQ(status, kOk);
+    status = reader->Open(file_path, param);
+    EXPECT_EQ(status, kOk);
+    PartitionIndex partitions;
+    status = reader->ReadPartitionIndex(&partitions);
+    EXPECT_EQ(status, kOk);
+    EXPECT_EQ(partitions.SerializeAsString(), expected.SerializeAsString());
+    for (int partition = 0; partition <= 10; partition++) {
+        SortFileReader::Iterator *it = reader->ScanPartition(partition);
+        int n = (partition == 0 ? 1 : partition * 10000);
+        while (!it->Done()) {
+            snprintf(key, sizeof(key), "%05d\tkey_%09d", partition, n);
+            EXPECT_EQ(it->Key(), std::string(key));
+            it->Next();
+            n++;
+        }
+        EXPECT_TRUE(it->Error() == kOk || it->Error() == kNoMore);
+        delete it;
+    }
+    EXPECT_EQ(CountRange(reader, "", ""), 90000);
+    status = reader->Close();
+    EXPECT_EQ(status, kOk);
+    delete reader;
+}
+
+TEST(HdfsTest, ReadCorrupt) {
+    if (g_file_type != kLocalFile) {
+        return;
+    }
+    std::string file_path = g_work_dir + "/put_test_corrupt.data";
+    Status status;
+    SortFileWriter::Options options;
+    options.version = kSortFileV3;
+    SortFileWriter* writer = SortFileWriter::Create(g_file_type, options, &status);
+    EXPECT_EQ(status, kOk);
+    FileSystem::Param param;
+    status = writer->Open(file_path, param);
+    EXPECT_EQ(status, kOk);
+    char key[256] = {'\0'};
+    for (int i = 0; i < 50000; i++) {
+        snprintf(key, sizeof(key), "key_%09d", i);
+        status = writer->Put(key, "value");
+        EXPECT_EQ(status, kOk);
+    }
+    status = writer->Close();
+    EXPECT_EQ(status, kOk);
+    delete writer;
+    //flip one byte in the middle of the data blocks
+    FILE* fp = fopen(file_path.c_str(), "r+");
+    ASSERT_TRUE(fp != NULL);
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    fseek(fp, size / 3, SEEK_SET);
+    int c = fgetc(fp);
+    fseek(fp, size / 3, SEEK_SET);
+    fputc(c ^ 0x5a, fp);
+    fclose(fp);
+
+    SortFileReader* reader = SortFileReader::Create(g_file_type, &status);
+    EXPECT_EQ(status, kOk);
+    status = reader->Open(file_path, param);
+    EXPECT_EQ(status, kOk);
+    SortFileReader::Iterator *it = reader->Scan("", "");
+    int n = 0;
+    while (!it->Done()) {
+        it->Next();
+        n++;
+    }
+    EXPECT_EQ(it->Error(), kDataCorrupt);
+    EXPECT_LT(n, 50000);
+    delete it;
+    status = reader->Close();
+    EXPECT_EQ(status, kOk);
+    delete reader;
+}
+
 int main(int argc, char* argv[]) {
     if (argc < 2) {
         printf("./sort_test [hdfs work dir] [filetype](optional) \n");
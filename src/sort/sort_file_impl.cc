@@ -1,6 +1,15 @@
 #include "sort_file_impl.h"
 #include "logging.h"
+#include <sstream>
+#include <boost/bind.hpp>
 #include <snappy.h>
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#include "common/crc32c.h"
 
 using baidu::common::INFO;
 using baidu::common::WARNING;
@@ -10,47 +19,428 @@ namespace shuttle {
 
 const static int32_t sBlockSize = (64 << 10);
 const static int32_t sMagicNumber = 25997;
+const static int32_t sMagicNumberV2 = 25998;
+const static int32_t sMagicNumberV2Partition = 25999;
+const static int32_t sMagicNumberV3 = 26000;
 const static int32_t sMaxIndexSize = 15000;
 const static size_t sMaxIndexBytes = (56 << 20);
 
+const static int sInitReadAhead = 1;
+const static int sMaxReadAhead = 16;
+const static int sShrinkReadAheadHits = 8;
+const static int sBadCompressLimit = 4;
+const static int sSkipCompressBlocks = 32;
+const static int sPendingBlocksPerThread = 2;
+// v3: every data block is indexed, one index segment per sSegmentBlocks blocks
+const static int sSegmentBlocks = 1024;
+const static char sIndexSegmentFlag = 0x40;
+
+static IndexCache g_index_cache;
+static ThreadPool* g_read_ahead_pool = NULL;
+
+void SortFileReader::SetIndexCacheCapacity(int64_t capacity) {
+    g_index_cache.SetCapacity(capacity);
+}
+
+void SortFileReader::EnableReadAhead(int threads) {
+    if (g_read_ahead_pool == NULL && threads > 0) {
+        g_read_ahead_pool = new ThreadPool(threads);
+    }
+}
+
+IndexCache::IndexCache() : capacity_(0), usage_(0) {
+
+}
+
+void IndexCache::SetCapacity(int64_t capacity) {
+    MutexLock lock(&mu_);
+    capacity_ = capacity;
+    Evict();
+}
+
+bool IndexCache::Enabled() {
+    MutexLock lock(&mu_);
+    return capacity_ > 0;
+}
+
+boost::shared_ptr<const IndexBlock> IndexCache::Lookup(const std::string& key) {
+    MutexLock lock(&mu_);
+    std::map<std::string, std::list<Entry>::iterator>::iterator it = table_.find(key);
+    if (it == table_.end()) {
+        return boost::shared_ptr<const IndexBlock>();
+    }
+    //move to the front as the most recently used
+    lru_.splice(lru_.begin(), lru_, it->second);
+    return it->second->index;
+}
+
+void IndexCache::Insert(const std::string& key,
+                        const boost::shared_ptr<const IndexBlock>& index) {
+    int64_t charge = key.size() + sizeof(IndexBlock);
+    for (int i = 0; i < index->items_size(); i++) {
+        charge += index->items(i).key().size() + sizeof(KeyOffset);
+    }
+    MutexLock lock(&mu_);
+    if (charge > capacity_) {
+        return;
+    }
+    std::map<std::string, std::list<Entry>::iterator>::iterator it = table_.find(key);
+    if (it != table_.end()) {
+        usage_ -= it->second->charge;
+        lru_.erase(it->second);
+        table_.erase(it);
+    }
+    Entry entry;
+    entry.key = key;
+    entry.index = index;
+    entry.charge = charge;
+    lru_.push_front(entry);
+    table_[key] = lru_.begin();
+    usage_ += charge;
+    Evict();
+}
+
+void IndexCache::Evict() {
+    mu_.AssertHeld();
+    while (usage_ > capacity_ && !lru_.empty()) {
+        const Entry& victim = lru_.back();
+        usage_ -= victim.charge;
+        table_.erase(victim.key);
+        lru_.pop_back();
+    }
+}
+
 SortFileReader* SortFileReader::Create(FileType file_type, Status* status) {
     if (file_type == kHdfsFile) {
         *status = kOk;
         return new SortFileReaderImpl(FileSystem::CreateInfHdfs());
     } else if (file_type == kLocalFile) {
         *status = kOk;
-        return new SortFileReaderImpl(FileSystem::CreateLocalFs());
+        return new SortFileReaderImpl(FileSystem::CreateMmapFs());
     } else {
         *status = kNotImplement;
         return NULL;
     }
 }
 
+static bool CodecAvailable(CompressCodec codec) {
+    switch (codec) {
+    case kCodecNone:
+    case kCodecSnappy:
+        return true;
+#ifdef HAVE_LZ4
+    case kCodecLz4:
+        return true;
+#endif
+#ifdef HAVE_ZSTD
+    case kCodecZstd:
+        return true;
+#endif
+    default:
+        return false;
+    }
+}
+
+bool SortFileWriter::ParseCodec(const std::string& name, CompressCodec* codec) {
+    if (name == "none") {
+        *codec = kCodecNone;
+    } else if (name == "snappy") {
+        *codec = kCodecSnappy;
+    } else if (name == "lz4") {
+        *codec = kCodecLz4;
+    } else if (name == "zstd") {
+        *codec = kCodecZstd;
+    } else {
+        return false;
+    }
+    return true;
+}
+
 SortFileWriter* SortFileWriter::Create(FileType file_type, Status* status) {
+    return Create(file_type, Options(), status);
+}
+
+SortFileWriter* SortFileWriter::Create(FileType file_type, const Options& options,
+                                       Status* status) {
+    if (options.version != kSortFileV1 && options.version != kSortFileV2
+        && options.version != kSortFileV3) {
+        *status = kInvalidArg;
+        return NULL;
+    }
+    if (options.version == kSortFileV3 && !CodecAvailable(options.codec)) {
+        LOG(WARNING, "codec not built in: %d", options.codec);
+        *status = kNotImplement;
+        return NULL;
+    }
     if (file_type == kHdfsFile) {
         *status = kOk;
-        return new SortFileWriterImpl(FileSystem::CreateInfHdfs());
+        return new SortFileWriterImpl(FileSystem::CreateInfHdfs(), options);
     } else if (file_type == kLocalFile) {
         *status = kOk;
-        return new SortFileWriterImpl(FileSystem::CreateLocalFs());
+        return new SortFileWriterImpl(FileSystem::CreateLocalFs(), options);
     } else {
         *status = kNotImplement;
         return NULL;
     }
 }
 
+static inline void PutVarint32(std::string* dst, uint32_t v) {
+    char buf[5];
+    int len = 0;
+    while (v >= 128) {
+        buf[len++] = (char)(v | 128);
+        v >>= 7;
+    }
+    buf[len++] = (char)v;
+    dst->append(buf, len);
+}
+
+static inline const char* GetVarint32Ptr(const char* p, const char* limit,
+                                         uint32_t* value) {
+    uint32_t result = 0;
+    for (uint32_t shift = 0; shift <= 28 && p < limit; shift += 7) {
+        uint32_t byte = *(reinterpret_cast<const unsigned char*>(p));
+        p++;
+        if (byte & 128) {
+            result |= ((byte & 127) << shift);
+        } else {
+            result |= (byte << shift);
+            *value = result;
+            return p;
+        }
+    }
+    return NULL;
+}
+
+// Fixed-width integers use host byte order, like the block sizes and the footer
+static inline void PutFixed32(std::string* dst, uint32_t v) {
+    dst->append(reinterpret_cast<const char*>(&v), sizeof(uint32_t));
+}
+
+static inline uint32_t DecodeFixed32(const char* p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(uint32_t));
+    return v;
+}
+
+// Checksum of a v3 block, covers the codec byte and the stored bytes
+static uint32_t BlockCrc(char codec, const char* data, size_t n) {
+    return crc32c::Extend(crc32c::Value(&codec, 1), data, n);
+}
+
+// lz4 and zstd output is prefixed with the varint32 raw length
+static bool CompressWith(CompressCodec codec, int32_t level,
+                         const std::string& raw, std::string* output) {
+    output->clear();
+    switch (codec) {
+    case kCodecSnappy:
+        snappy::Compress(raw.data(), raw.size(), output);
+        return true;
+#ifdef HAVE_LZ4
+    case kCodecLz4: {
+        PutVarint32(output, raw.size());
+        size_t head = output->size();
+        output->resize(head + LZ4_compressBound(raw.size()));
+        int n = LZ4_compress_default(raw.data(), &(*output)[head],
+                                     raw.size(), output->size() - head);
+        if (n <= 0) {
+            return false;
+        }
+        output->resize(head + n);
+        return true;
+    }
+#endif
+#ifdef HAVE_ZSTD
+    case kCodecZstd: {
+        PutVarint32(output, raw.size());
+        size_t head = output->size();
+        output->resize(head + ZSTD_compressBound(raw.size()));
+        size_t n = ZSTD_compress(&(*output)[head], output->size() - head,
+                                 raw.data(), raw.size(), level);
+        if (ZSTD_isError(n)) {
+            return false;
+        }
+        output->resize(head + n);
+        return true;
+    }
+#endif
+    default:
+        return false;
+    }
+}
+
+static bool UncompressWith(CompressCodec codec, const char* input, size_t input_len,
+                           std::string* output) {
+    switch (codec) {
+    case kCodecNone:
+        output->assign(input, input_len);
+        return true;
+    case kCodecSnappy:
+        output->clear();
+        return snappy::Uncompress(input, input_len, output);
+#if defined(HAVE_LZ4) || defined(HAVE_ZSTD)
+    case kCodecLz4:
+    case kCodecZstd: {
+        const char* limit = input + input_len;
+        uint32_t raw_len = 0;
+        const char* p = GetVarint32Ptr(input, limit, &raw_len);
+        if (p == NULL) {
+            return false;
+        }
+        output->resize(raw_len);
+        if (raw_len == 0) {
+            return true;
+        }
+#ifdef HAVE_LZ4
+        if (codec == kCodecLz4) {
+            int n = LZ4_decompress_safe(p, &(*output)[0], limit - p, raw_len);
+            return n == (int)raw_len;
+        }
+#endif
+#ifdef HAVE_ZSTD
+        if (codec == kCodecZstd) {
+            size_t n = ZSTD_decompress(&(*output)[0], raw_len, p, limit - p);
+            return !ZSTD_isError(n) && n == raw_len;
+        }
+#endif
+        return false;
+    }
+#endif
+    default:
+        return false;
+    }
+}
+
+BlockPrefetcher::BlockPrefetcher(SortFileReaderImpl* reader,
+                                 ThreadPool* pool) : reader_(reader),
+                                                     path_(reader->path_),
+                                                     pool_(pool),
+                                                     cond_(&mu_),
+                                                     depth_(sInitReadAhead),
+                                                     idle_hits_(0),
+                                                     fetching_(false),
+                                                     eof_(false),
+                                                     stop_(false) {
+    MutexLock lock(&reader_->prefetch_mu_);
+    reader_->prefetchers_.insert(this);
+}
+
+BlockPrefetcher::~BlockPrefetcher() {
+    SortFileReaderImpl* reader = NULL;
+    {
+        MutexLock lock(&mu_);
+        stop_ = true;
+        while (fetching_) {
+            cond_.Wait();
+        }
+        reader = reader_;
+    }
+    //a reader closed or deleted first has detached this already
+    if (reader != NULL) {
+        MutexLock lock(&reader->prefetch_mu_);
+        reader->prefetchers_.erase(this);
+    }
+}
+
+void BlockPrefetcher::Detach() {
+    MutexLock lock(&mu_);
+    stop_ = true;
+    while (fetching_) {
+        cond_.Wait();
+    }
+    reader_ = NULL;
+}
+
+Status BlockPrefetcher::Next(std::string* buf, Slice* block) {
+    MutexLock lock(&mu_);
+    if (ready_.empty()) {
+        //the consumer is faster than the reads, go deeper
+        depth_ = std::min(depth_ * 2, sMaxReadAhead);
+        idle_hits_ = 0;
+        Schedule();
+        while (ready_.empty() && fetching_) {
+            cond_.Wait();
+        }
+        if (ready_.empty()) {
+            LOG(WARNING, "read-ahead is stopped, %s", path_.c_str());
+            return kReadFileFail;
+        }
+    } else if ((int)ready_.size() >= depth_ && ++idle_hits_ >= sShrinkReadAheadHits) {
+        //blocks keep waiting for the consumer, hold less of them
+        depth_ = std::max(depth_ / 2, 1);
+        idle_hits_ = 0;
+    }
+    Block& head = ready_.front();
+    Status status = head.status;
+    buf->swap(head.data);
+    *block = head.in_place ? head.mapped : Slice(*buf);
+    if (status == kOk) {
+        //the consumer's previous block becomes a buffer for the next read
+        if ((int)free_bufs_.size() < sMaxReadAhead) {
+            free_bufs_.push_back(std::string());
+            free_bufs_.back().swap(head.data);
+        }
+        ready_.pop_front();
+    }
+    Schedule();
+    return status;
+}
+
+void BlockPrefetcher::Schedule() {
+    mu_.AssertHeld();
+    if (fetching_ || eof_ || stop_ || (int)ready_.size() >= depth_) {
+        return;
+    }
+    fetching_ = true;
+    pool_->AddTask(boost::bind(&BlockPrefetcher::Fetch, this));
+}
+
+// Runs in the read-ahead pool, the only user of the file handle meanwhile
+void BlockPrefetcher::Fetch() {
+    MutexLock lock(&mu_);
+    while (!stop_ && !eof_ && (int)ready_.size() < depth_) {
+        Block block;
+        if (!free_bufs_.empty()) {
+            block.data.swap(free_bufs_.back());
+            free_bufs_.pop_back();
+        }
+        mu_.Unlock();
+        block.status = reader_->ReadNextBlock(&block.data, &block.mapped);
+        mu_.Lock();
+        if (block.status != kOk) {
+            eof_ = true;
+        }
+        //a view into data would not survive the swap, it is made again in Next
+        block.in_place = block.status == kOk && block.mapped.data() != block.data.data();
+        ready_.push_back(Block());
+        ready_.back().data.swap(block.data);
+        ready_.back().mapped = block.mapped;
+        ready_.back().in_place = block.in_place;
+        ready_.back().status = block.status;
+        cond_.Signal();
+    }
+    fetching_ = false;
+    cond_.Signal();
+}
+
 SortFileReaderImpl::IteratorImpl::IteratorImpl(const std::string& start_key,
                                                const std::string& end_key,
                                                SortFileReaderImpl* reader) {
     reader_ = reader;
+    prefetcher_ = NULL;
     has_more_ = false;
     error_ = kOk;
-    cur_offset_ = 0;
+    legacy_offset_ = 0;
+    cur_ptr_ = NULL;
+    limit_ptr_ = NULL;
+    restarts_ = NULL;
+    num_restarts_ = 0;
     start_key_ = start_key;
     end_key_ = end_key;
 }
 
 SortFileReaderImpl::IteratorImpl::~IteratorImpl() {
+    delete prefetcher_;
 
 }
 
@@ -62,42 +452,185 @@ const std::string SortFileReaderImpl::IteratorImpl::GetFileName() {
     }
 }
 
+Status SortFileReaderImpl::IteratorImpl::LoadNextBlock() {
+    if (prefetcher_ == NULL && g_read_ahead_pool != NULL) {
+        prefetcher_ = new BlockPrefetcher(reader_, g_read_ahead_pool);
+    }
+    Status status = kOk;
+    if (prefetcher_ != NULL) {
+        status = prefetcher_->Next(&block_buf_, &block_);
+    } else {
+        status = reader_->ReadNextBlock(&block_buf_, &block_);
+    }
+    if (status != kOk) {
+        return status;
+    }
+    if (reader_->version_ == kSortFileV1) {
+        if (!legacy_block_.ParseFromArray(block_.data(), block_.size())) {
+            LOG(WARNING, "bad format block, %s", reader_->path_.c_str());
+            return kUnKnown;
+        }
+        legacy_offset_ = -1;
+        return kOk;
+    }
+    cur_ptr_ = block_.data();
+    limit_ptr_ = cur_ptr_ + block_.size();
+    restarts_ = NULL;
+    num_restarts_ = 0;
+    key_buf_.clear();
+    if (reader_->restart_interval_ > 0) {
+        //the block ends with the restart offsets and their count
+        size_t max_restarts = 0;
+        if (block_.size() >= sizeof(uint32_t)) {
+            num_restarts_ = DecodeFixed32(limit_ptr_ - sizeof(uint32_t));
+            max_restarts = block_.size() / sizeof(uint32_t) - 1;
+        }
+        if (num_restarts_ == 0 || num_restarts_ > max_restarts) {
+            LOG(WARNING, "bad format block, %s", reader_->path_.c_str());
+            return kUnKnown;
+        }
+        restarts_ = limit_ptr_ - (num_restarts_ + 1) * sizeof(uint32_t);
+        limit_ptr_ = restarts_;
+    }
+    return kOk;
+}
+
+// Step to the next record of the current block,
+// return false when the block is drained or corrupted
+bool SortFileReaderImpl::IteratorImpl::NextInBlock() {
+    if (reader_->version_ == kSortFileV1) {
+        if (legacy_offset_ + 1 >= legacy_block_.items_size()) {
+            return false;
+        }
+        legacy_offset_ ++;
+        const KeyValue& item = legacy_block_.items(legacy_offset_);
+        key_slice_ = Slice(item.key());
+        value_slice_ = Slice(item.value());
+        return true;
+    }
+    if (cur_ptr_ == NULL || cur_ptr_ >= limit_ptr_) {
+        return false;
+    }
+    uint32_t shared = 0;
+    uint32_t key_len = 0;
+    uint32_t value_len = 0;
+    const char* p = cur_ptr_;
+    if (num_restarts_ > 0) {
+        p = GetVarint32Ptr(p, limit_ptr_, &shared);
+    }
+    if (p != NULL) {
+        p = GetVarint32Ptr(p, limit_ptr_, &key_len);
+    }
+    if (p != NULL) {
+        p = GetVarint32Ptr(p, limit_ptr_, &value_len);
+    }
+    if (p == NULL || shared > key_buf_.size()
+        || (size_t)(limit_ptr_ - p) < (size_t)key_len + value_len) {
+        LOG(WARNING, "bad format block, %s", reader_->path_.c_str());
+        error_ = kUnKnown;
+        cur_ptr_ = limit_ptr_;
+        return false;
+    }
+    if (num_restarts_ > 0) {
+        //key_len is the length of the unshared suffix here
+        key_buf_.resize(shared);
+        key_buf_.append(p, key_len);
+        key_slice_ = Slice(key_buf_);
+    } else {
+        key_slice_ = Slice(p, key_len);
+    }
+    value_slice_ = Slice(p + key_len, value_len);
+    cur_ptr_ = p + key_len + value_len;
+    return true;
+}
+
+// Decode the full key stored at a restart point
+bool SortFileReaderImpl::IteratorImpl::RestartKey(uint32_t index, Slice* key) {
+    uint32_t offset = DecodeFixed32(restarts_ + index * sizeof(uint32_t));
+    const char* base = block_.data();
+    if (offset >= (uint32_t)(limit_ptr_ - base)) {
+        return false;
+    }
+    uint32_t shared = 0;
+    uint32_t key_len = 0;
+    uint32_t value_len = 0;
+    const char* p = GetVarint32Ptr(base + offset, limit_ptr_, &shared);
+    if (p != NULL) {
+        p = GetVarint32Ptr(p, limit_ptr_, &key_len);
+    }
+    if (p != NULL) {
+        p = GetVarint32Ptr(p, limit_ptr_, &value_len);
+    }
+    if (p == NULL || shared != 0 || (size_t)(limit_ptr_ - p) < key_len) {
+        return false;
+    }
+    *key = Slice(p, key_len);
+    return true;
+}
+
+// Position on the first record >= target in a prefix compressed block,
+// return false when every record of the block is less than target
+bool SortFileReaderImpl::IteratorImpl::SeekInBlock(const Slice& target) {
+    //binary search the last restart point whose key is less than target
+    uint32_t left = 0;
+    uint32_t right = num_restarts_ - 1;
+    while (left < right) {
+        uint32_t mid = left + (right - left + 1) / 2;
+        Slice mid_key;
+        if (!RestartKey(mid, &mid_key)) {
+            LOG(WARNING, "bad format block, %s", reader_->path_.c_str());
+            error_ = kUnKnown;
+            return false;
+        }
+        if (mid_key < target) {
+            left = mid;
+        } else {
+            right = mid - 1;
+        }
+    }
+    cur_ptr_ = block_.data() + DecodeFixed32(restarts_ + left * sizeof(uint32_t));
+    key_buf_.clear();
+    while (NextInBlock()) {
+        if (key_slice_ >= target) {
+            return true;
+        }
+    }
+    return false;
+}
+
 void SortFileReaderImpl::IteratorImpl::Init() {
-    if (has_more_ && cur_block_.items_size() == 0) {
-        //Initiate data for the iterator, locate to the right place
-        Status status = reader_->ReadNextRecord(cur_block_);
+    if (!has_more_) {
+        return;
+    }
+    //Initiate data for the iterator, locate to the right place
+    Slice start(start_key_);
+    bool found = false;
+    while (!found) {
+        Status status = LoadNextBlock();
         if (status != kOk) {
             error_ = status;
             has_more_ = false;
             return;
         }
-        while (status == kOk) {
-            while(cur_offset_ < cur_block_.items_size() &&
-                  cur_block_.items(cur_offset_).key() < start_key_) {
-                cur_offset_ ++;
-                //printf("%d\n", cur_offset_);
+        if (num_restarts_ > 0) {
+            found = SeekInBlock(start);
+        } else {
+            while (NextInBlock()) {
+                if (key_slice_ >= start) {
+                    found = true;
+                    break;
+                }
             } //skip the items less than start_key
-            if (cur_offset_ >= cur_block_.items_size()) {
-                status = reader_->ReadNextRecord(cur_block_);
-                cur_offset_ = 0;
-                //printf("read next block\n");
-                //read the next block
-            } else {
-                break;
-            }
         }
-        if (status != kOk) {
-            error_ = status;
-            has_more_ = false;
-            return;
-        }
-        key_ = cur_block_.items(cur_offset_).key();
-        value_ =  cur_block_.items(cur_offset_).value();
-        if (key_ >= end_key_ && !end_key_.empty()) {
+        if (error_ != kOk) {
             has_more_ = false;
             return;
         }
     }
+    if (!end_key_.empty() && key_slice_ >= Slice(end_key_)) {
+        has_more_ = false;
+        return;
+    }
 }
 
 bool SortFileReaderImpl::IteratorImpl::Done() {
@@ -105,33 +638,46 @@ bool SortFileReaderImpl::IteratorImpl::Done() {
 }
 
 void SortFileReaderImpl::IteratorImpl::Next() {
-    cur_offset_ ++ ;
-    if (cur_offset_ >= cur_block_.items_size()) {
-        Status status = reader_->ReadNextRecord(cur_block_);
+    if (!NextInBlock()) {
+        if (error_ != kOk) {
+            has_more_ = false;
+            return;
+        }
+        Status status = LoadNextBlock();
+        if (status == kOk && !NextInBlock()) {
+            LOG(WARNING, "empty data block, %s", reader_->path_.c_str());
+            status = kUnKnown;
+        }
         if (status != kOk) {
             error_ = status;
             has_more_ = false;
             return;
         }
-        cur_offset_ = 0;
     }
-    if (cur_block_.items(cur_offset_).key() >= end_key_
-        && !end_key_.empty()) {
+    if (!end_key_.empty() && key_slice_ >= Slice(end_key_)) {
         has_more_ = false;
         return;
     }
-    key_ = cur_block_.items(cur_offset_).key();
-    value_ = cur_block_.items(cur_offset_).value();
 }
 
 const std::string& SortFileReaderImpl::IteratorImpl::Key() {
+    key_.assign(key_slice_.data(), key_slice_.size());
     return key_;
 }
 
 const std::string& SortFileReaderImpl::IteratorImpl::Value() {
+    value_.assign(value_slice_.data(), value_slice_.size());
     return value_;
 }
 
+Slice SortFileReaderImpl::IteratorImpl::KeySlice() {
+    return key_slice_;
+}
+
+Slice SortFileReaderImpl::IteratorImpl::ValueSlice() {
+    return value_slice_;
+}
+
 Status SortFileReaderImpl::IteratorImpl::Error() {
     return error_;
 }
@@ -144,58 +690,62 @@ void SortFileReaderImpl::IteratorImpl::SetHasMore(bool has_more) {
     has_more_ = has_more;
 }
 
+// Read len bytes straight into result_buf, a reused buffer keeps its capacity
 Status SortFileReaderImpl::ReadFull(std::string* result_buf, int32_t len,
                                     bool is_read_data) {
     if (result_buf == NULL || len < 0 ) {
         return kInvalidArg;
     }
     //LOG(INFO, "cur offset: %ld, need: %d", fs_->Tell(), len);
-    result_buf->reserve(len);
-    Status status = kOk;
-    int once_buf_size = std::min(40960, len); //at most 40K
-    char* buf = (char*)malloc(once_buf_size);
-    int n_read = fs_->Read((void*)buf, once_buf_size);
-
-    if (n_read < 0) {
-        free(buf);
-        LOG(WARNING, "fail to read block of %s", path_.c_str());
-        return kReadFileFail;
-    }
-    if (n_read == 0) {
-        LOG(WARNING, "read EOF, %s", path_.c_str());
-        free(buf);
-        return kNoMore;
-    }
-
-    if (is_read_data) {
-        int64_t cur_offset = fs_->Tell();
-        if (cur_offset > idx_offset_) {
-            free(buf);
-            LOG(WARNING, "no more data block, %s", path_.c_str());
+    result_buf->resize(len);
+    int32_t n_done = 0;
+    while (n_done < len) {
+        int n_read = fs_->Read((void*)(&(*result_buf)[0] + n_done), len - n_done);
+        if (n_read < 0) {
+            LOG(WARNING, "fail to read block of %s", path_.c_str());
+            result_buf->resize(n_done);
+            return kReadFileFail;
+        }
+        if (n_read == 0) {
+            LOG(WARNING, "read EOF, %s", path_.c_str());
+            result_buf->resize(n_done);
             return kNoMore;
         }
+        if (n_done == 0 && is_read_data) {
+            int64_t cur_offset = fs_->Tell();
+            if (cur_offset > idx_offset_) {
+                LOG(WARNING, "no more data block, %s", path_.c_str());
+                result_buf->clear();
+                return kNoMore;
+            }
+        }
+        n_done += n_read;
     }
+    //LOG(INFO, "after, cur offset: %ld", fs_->Tell());
+    return kOk;
+}
 
-    result_buf->append(buf, n_read);
-    while (result_buf->size() < (size_t)len) {
-        int try_read_count = std::min((size_t)once_buf_size, len - result_buf->size());
-        n_read = fs_->Read((void*)buf, try_read_count);
-        if (n_read < 0) {
-            status = kReadFileFail;
-            break;
-        } else if (n_read == 0) {
-            status = kNoMore;
-            break;
-        } else {
-            result_buf->append(buf, n_read);
+Status SortFileReaderImpl::ReadNextBlock(std::string* buf, Slice* block) {
+    while (true) {
+        if (idx_offset_ > 0 && fs_->Tell() >= idx_offset_) {
+            return kNoMore;
+        }
+        bool index_segment = false;
+        Status status = ReadBlock(buf, block, true, &index_segment);
+        if (status != kOk || !index_segment) {
+            return status;
         }
     }
-    free(buf);
-    //LOG(INFO, "after, cur offset: %ld", fs_->Tell());
-    return status;
 }
 
-Status SortFileReaderImpl::ReadNextRecord(DataBlock& data_block) {
+// v1 and v2 blocks: [int32 size][snappy data]
+// v3 blocks: [int32 size][uint8 codec][uint32 crc32c][data],
+// index segments have sIndexSegmentFlag set in the codec and are
+// skipped without reading when is_read_data. A raw block of a mapped
+// file is handed out in place, buf is left alone then
+Status SortFileReaderImpl::ReadBlock(std::string* buf, Slice* block, bool is_read_data,
+                                     bool* index_segment) {
+    int64_t offset = fs_->Tell();
     int32_t block_size;
     int n_read = fs_->Read((void*)&block_size, sizeof(int32_t));
     //LOG(INFO, "read: %s, block_size: %ld", path_.c_str(), block_size);
@@ -203,25 +753,86 @@ Status SortFileReaderImpl::ReadNextRecord(DataBlock& data_block) {
         LOG(WARNING, "fail to read block size, %s", path_.c_str());
         return kReadFileFail;
     }
-    std::string block_raw, block_uncompress;
-    Status status = ReadFull(&block_raw, block_size, true);
-    if (status != kOk) {
-        return status;
+    char codec = kCodecSnappy;
+    uint32_t crc = 0;
+    if (version_ == kSortFileV3) {
+        char header[sizeof(char) + sizeof(uint32_t)];
+        n_read = fs_->Read((void*)header, sizeof(header));
+        if (n_read != (int)sizeof(header)) {
+            LOG(WARNING, "fail to read block header, %s", path_.c_str());
+            return kReadFileFail;
+        }
+        codec = header[0];
+        crc = DecodeFixed32(header + 1);
     }
-    snappy::Uncompress(block_raw.data(), block_raw.size(), &block_uncompress);
-    bool ret = data_block.ParseFromString(block_uncompress);
-    if (!ret) {
-        LOG(WARNING, "bad format block, %s", path_.c_str());
-        return kUnKnown;
+    if (block_size < 0 || (is_read_data && idx_offset_ > 0
+                           && offset + block_size > idx_offset_)) {
+        LOG(WARNING, "bad block size %d at %ld, %s", block_size, offset, path_.c_str());
+        return kDataCorrupt;
+    }
+    if (version_ == kSortFileV3 && (codec & sIndexSegmentFlag)) {
+        if (index_segment != NULL) {
+            *index_segment = true;
+        }
+        if (is_read_data) {
+            if (!fs_->Seek(fs_->Tell() + block_size)) {
+                LOG(WARNING, "fail to skip index segment at %ld, %s", offset, path_.c_str());
+                return kReadFileFail;
+            }
+            return kOk;
+        }
+    }
+    //a mapped file hands out the block in place, others read into compressed_buf_
+    const char* block_raw = NULL;
+    int32_t n_mapped = block_size > 0 ? fs_->ReadMapped(&block_raw, block_size) : -1;
+    if (n_mapped >= 0 && n_mapped < block_size) {
+        LOG(WARNING, "read EOF, %s", path_.c_str());
+        return kNoMore;
+    }
+    if (n_mapped < 0) {
+        compressed_buf_.clear();
+        if (block_size > 0) {
+            Status status = ReadFull(&compressed_buf_, block_size, is_read_data);
+            if (status != kOk) {
+                return status;
+            }
+        }
+        block_raw = compressed_buf_.data();
+    }
+    if (version_ == kSortFileV3
+        && BlockCrc(codec, block_raw, block_size) != crc) {
+        LOG(WARNING, "checksum mismatch of block at %ld, %s", offset, path_.c_str());
+        return kDataCorrupt;
+    }
+    if (version_ == kSortFileV3) {
+        codec &= ~sIndexSegmentFlag;
+    }
+    if (codec == kCodecNone && n_mapped >= 0) {
+        *block = Slice(block_raw, block_size);
+        return kOk;
     }
+    if (codec == kCodecNone) {
+        //trade buffers with the caller instead of copying
+        buf->swap(compressed_buf_);
+        *block = Slice(*buf);
+        return kOk;
+    }
+    if (!UncompressWith((CompressCodec)codec, block_raw, block_size, buf)) {
+        LOG(WARNING, "bad format block at %ld, codec: %d, %s",
+            offset, codec, path_.c_str());
+        return version_ == kSortFileV3 ? kDataCorrupt : kUnKnown;
+    }
+    *block = Slice(*buf);
     return kOk;
 }
 
-Status SortFileReaderImpl::LoadIndexBlock(IndexBlock* idx_block) {
+// Footer: [int64 index offset][int32 magic], v3 files and v2 files with
+// a partition directory put the [int64 partition offset] in front of it,
+// 0 for a v3 file means no directory
+Status SortFileReaderImpl::LoadFooter() {
     int64_t file_size = fs_->GetSize();
     int32_t magic_number;
     int64_t index_offset;
-    int32_t index_size;
     int32_t span = sizeof(int32_t) + sizeof(int64_t);
     if (file_size <= 0 || !fs_->Seek(file_size - span)) {
         LOG(WARNING, "fail to seek the foot of %s", path_.c_str());
@@ -233,44 +844,165 @@ Status SortFileReaderImpl::LoadIndexBlock(IndexBlock* idx_block) {
         return kOpenFileFail;
     }
     n_read = fs_->Read((void*)&magic_number, sizeof(int32_t));
-    if (n_read != sizeof(int32_t) || magic_number != sMagicNumber) {
+    partition_offset_ = 0;
+    if (n_read == sizeof(int32_t) && magic_number == sMagicNumber) {
+        version_ = kSortFileV1;
+    } else if (n_read == sizeof(int32_t) && magic_number == sMagicNumberV2) {
+        version_ = kSortFileV2;
+    } else if (n_read == sizeof(int32_t) && (magic_number == sMagicNumberV2Partition
+                                             || magic_number == sMagicNumberV3)) {
+        version_ = magic_number == sMagicNumberV3 ? kSortFileV3 : kSortFileV2;
+        span += sizeof(int64_t);
+        if (file_size < span || !fs_->Seek(file_size - span)) {
+            LOG(WARNING, "fail to seek the partition offset of %s", path_.c_str());
+            return kOpenFileFail;
+        }
+        n_read = fs_->Read((void*)&partition_offset_, sizeof(int64_t));
+        if (n_read != sizeof(int64_t)) {
+            LOG(WARNING, "fail to read partition offset, %s, %d", path_.c_str(), n_read);
+            return kOpenFileFail;
+        }
+    } else {
         LOG(WARNING, "fail to read index magic, %s, %d", path_.c_str(), magic_number);
         return kBadMagic;
     }
-    if (!fs_->Seek(index_offset)) {
-        LOG(WARNING, "fail to seek the start index offset of %s at %ld",
-            path_.c_str(), index_offset);
-        return kOpenFileFail;
-    }
     idx_offset_ = index_offset;
-    n_read = fs_->Read((void*)&index_size, sizeof(int32_t));
-    if (n_read != sizeof(int32_t)) {
-        LOG(WARNING, "fail to read size of index, %s, %d", path_.c_str(), n_read);
+    return kOk;
+}
+
+// Meta blocks are [int32 size][snappy compressed protobuf]
+Status SortFileReaderImpl::LoadMetaBlock(int64_t offset,
+                                         ::google::protobuf::Message* meta) {
+    if (!fs_->Seek(offset)) {
+        LOG(WARNING, "fail to seek the meta block of %s at %ld",
+            path_.c_str(), offset);
         return kOpenFileFail;
     }
-    std::string index_raw_buf;
-    Status status = ReadFull(&index_raw_buf, index_size);
+    std::string tmp_buf;
+    Slice block;
+    Status status = ReadBlock(&tmp_buf, &block, false);
     if (status != kOk) {
-        LOG(WARNING, "read index block fail, %s", Status_Name(status).c_str());
-        if (status == kNoMore) { //empty index
-            return kOk;
-        }
+        LOG(WARNING, "read meta block fail, %s", Status_Name(status).c_str());
         return status;
     }
-    std::string tmp_buf;
-    snappy::Uncompress(index_raw_buf.data(), index_raw_buf.size(), &tmp_buf);
-    bool ret = idx_block->ParseFromString(tmp_buf);
+    bool ret = meta->ParseFromArray(block.data(), block.size());
     if (!ret) {
-        LOG(WARNING, "unserialize index block fail, %s, buf_len:%ld", path_.c_str(), tmp_buf.size());
+        LOG(WARNING, "unserialize meta block fail, %s, buf_len:%ld", path_.c_str(), block.size());
         return kUnKnown;
     }
-    //printf("debug: %s\n", idx_block->DebugString().c_str());
     return kOk;
 }
 
+Status SortFileReaderImpl::LoadIndexBlock() {
+    if (index_) {
+        return kOk;
+    }
+    if (!footer_loaded_) {
+        Status status = LoadFooter();
+        if (status != kOk) {
+            return status;
+        }
+        footer_loaded_ = true;
+    }
+    std::string cache_key;
+    if (g_index_cache.Enabled()) {
+        FileInfo info;
+        if (fs_->Stat(path_, &info)) {
+            std::stringstream ss;
+            ss << path_ << "\t" << info.size << "\t" << info.mtime;
+            cache_key = ss.str();
+            index_cache_key_ = cache_key;
+            index_ = g_index_cache.Lookup(cache_key);
+            if (index_) {
+                return kOk;
+            }
+        }
+    }
+    IndexBlock* idx_block = new IndexBlock();
+    boost::shared_ptr<const IndexBlock> index(idx_block);
+    Status status = LoadMetaBlock(idx_offset_, idx_block);
+    if (status == kNoMore) { //empty index
+        idx_block->Clear();
+        status = kOk;
+    }
+    if (status != kOk) {
+        return status;
+    }
+    index_ = index;
+    if (!cache_key.empty()) {
+        g_index_cache.Insert(cache_key, index_);
+    }
+    return kOk;
+}
+
+Status SortFileReaderImpl::LoadPartitionIndex() {
+    if (partitions_) {
+        return kOk;
+    }
+    if (!footer_loaded_) {
+        Status status = LoadFooter();
+        if (status != kOk) {
+            return status;
+        }
+        footer_loaded_ = true;
+    }
+    if (partition_offset_ <= 0) {
+        return kNoMore;
+    }
+    PartitionIndex* partitions = new PartitionIndex();
+    boost::shared_ptr<const PartitionIndex> guard(partitions);
+    Status status = LoadMetaBlock(partition_offset_, partitions);
+    if (status != kOk) {
+        return status;
+    }
+    partitions_ = guard;
+    return kOk;
+}
+
+Status SortFileReaderImpl::LoadIndex() {
+    StopReadAhead();
+    Status status = LoadIndexBlock();
+    for (int i = 0; i < 3 && status != kOk; i++) {
+        status = LoadIndexBlock();
+        sleep(1);
+    }
+    if (status != kOk) {
+        LOG(WARNING, "faild to load index block, %s", path_.c_str());
+        return status;
+    }
+    status = LoadPartitionIndex();
+    for (int i = 0; i < 3 && status != kOk && status != kNoMore; i++) {
+        status = LoadPartitionIndex();
+        sleep(1);
+    }
+    if (status != kOk && status != kNoMore) {
+        LOG(WARNING, "faild to load partition index, %s", path_.c_str());
+        return status;
+    }
+    return kOk;
+}
+
+Status SortFileReaderImpl::ReadPartitionIndex(PartitionIndex* partitions) {
+    StopReadAhead();
+    Status status = LoadPartitionIndex();
+    for (int i = 0; i < 3 && status != kOk && status != kNoMore; i++) {
+        status = LoadPartitionIndex();
+        sleep(1);
+    }
+    if (status == kOk) {
+        partitions->CopyFrom(*partitions_);
+    }
+    return status;
+}
+
 Status SortFileReaderImpl::Open(const std::string& path, FileSystem::Param param) {
     LOG(INFO, "try to open: %s", path.c_str());
+    StopReadAhead();
     path_ = path;
+    footer_loaded_ = false;
+    index_.reset();
+    partitions_.reset();
+    index_cache_key_.clear();
     if (!fs_->Open(path, param, kReadFile)) {
         return kOpenFileFail;
     }
@@ -279,6 +1011,7 @@ Status SortFileReaderImpl::Open(const std::string& path, FileSystem::Param param
 
 SortFileReader::Iterator* SortFileReaderImpl::Scan(const std::string& start_key, 
                                                    const std::string& end_key) {
+    StopReadAhead();
     if (start_key > end_key && !end_key.empty()) {
         IteratorImpl* it = new IteratorImpl(start_key, end_key, this);
         it->SetHasMore(false);
@@ -288,12 +1021,10 @@ SortFileReader::Iterator* SortFileReaderImpl::Scan(const std::string& start_key,
         return it; 
     }
 
-    IndexBlock idx_block;
     LOG(INFO, "try load index of: %s", path_.c_str());
-    Status status = LoadIndexBlock(&idx_block);
+    Status status = LoadIndexBlock();
     for(int i = 0; i < 3 && status != kOk; i++) {
-        idx_block.Clear();
-        status = LoadIndexBlock(&idx_block);
+        status = LoadIndexBlock();
         sleep(1);
     }
     if (status != kOk) {
@@ -304,6 +1035,8 @@ SortFileReader::Iterator* SortFileReaderImpl::Scan(const std::string& start_key,
         return it;
     }
 
+    const IndexBlock& idx_block = *index_;
+    restart_interval_ = idx_block.restart_interval();
     int low = 0;
     int high = idx_block.items_size() - 1;
 
@@ -313,6 +1046,37 @@ SortFileReader::Iterator* SortFileReaderImpl::Scan(const std::string& start_key,
         return it; //return an empty iterator
     }
 
+    int64_t offset = 0;
+    status = LocateBlock(start_key, &offset);
+    //the scan stops in the block of end_key or at the first record after it,
+    //located before the seek since an index segment may have to be read
+    int64_t end = idx_offset_;
+    int64_t end_block = 0;
+    if (status == kOk && !end_key.empty() && LocateBlock(end_key, &end_block) == kOk) {
+        end = std::min(end_block + 2 * sBlockSize, idx_offset_);
+    }
+    IteratorImpl* it = new IteratorImpl(start_key, end_key, this);
+    if (status != kOk) {
+        LOG(WARNING, "faild to locate %s in %s", start_key.c_str(), path_.c_str());
+        it->SetHasMore(false);
+        it->SetError(status);
+    } else if (!fs_->Seek(offset)) {
+        LOG(WARNING, "fail to seek the data block at %ld", offset);
+        it->SetHasMore(false);
+        it->SetError(kReadFileFail);
+    } else {
+        fs_->WillRead(offset, end - offset);
+        it->SetHasMore(true);
+    }
+    it->Init();
+    return it;
+}
+
+// The offset of the item to start a scan of start_key from,
+// the index must not be empty
+static int64_t SearchIndex(const IndexBlock& idx_block, const std::string& start_key) {
+    int low = 0;
+    int high = idx_block.items_size() - 1;
     while (low < high) {
         int mid = low + (high - low) / 2;
         const std::string& mid_key = idx_block.items(mid).key();
@@ -324,40 +1088,163 @@ SortFileReader::Iterator* SortFileReaderImpl::Scan(const std::string& start_key,
     }
 
     const std::string& bound_key = idx_block.items(low).key();
-    int64_t offset;
     if (bound_key < start_key) {
-        offset = idx_block.items(low).offset();
+        return idx_block.items(low).offset();
     } else {
         if (low > 0) {
-            offset = idx_block.items(low-1).offset();
+            return idx_block.items(low-1).offset();
         } else {
-            offset = idx_block.items(0).offset();
+            return idx_block.items(0).offset();
+        }
+    }
+}
+
+// Find the data block to start from in the loaded index,
+// every level past the first costs one more read of an index segment
+Status SortFileReaderImpl::LocateBlock(const std::string& start_key, int64_t* offset) {
+    const IndexBlock& idx_block = *index_;
+    *offset = SearchIndex(idx_block, start_key);
+    for (int level = idx_block.levels(); level >= 2; level--) {
+        boost::shared_ptr<const IndexBlock> segment;
+        Status status = LoadIndexSegment(*offset, &segment);
+        if (status != kOk) {
+            return status;
         }
+        *offset = SearchIndex(*segment, start_key);
+    }
+    return kOk;
+}
+
+// The index segment at offset, shared through the index cache
+Status SortFileReaderImpl::LoadIndexSegment(int64_t offset,
+                                            boost::shared_ptr<const IndexBlock>* segment) {
+    std::string cache_key;
+    if (!index_cache_key_.empty()) {
+        std::stringstream ss;
+        ss << index_cache_key_ << "\t" << offset;
+        cache_key = ss.str();
+        *segment = g_index_cache.Lookup(cache_key);
+        if (*segment) {
+            return kOk;
+        }
+    }
+    IndexBlock* segment_block = new IndexBlock();
+    boost::shared_ptr<const IndexBlock> guard(segment_block);
+    Status status = LoadMetaBlock(offset, segment_block);
+    if (status != kOk) {
+        return status;
+    }
+    if (segment_block->items_size() == 0) {
+        LOG(WARNING, "empty index segment at %ld, %s", offset, path_.c_str());
+        return kDataCorrupt;
+    }
+    if (!cache_key.empty()) {
+        g_index_cache.Insert(cache_key, guard);
+    }
+    *segment = guard;
+    return kOk;
+}
+
+SortFileReader::Iterator* SortFileReaderImpl::ScanPartition(int partition) {
+    StopReadAhead();
+    char s_reduce_no[256];
+    snprintf(s_reduce_no, sizeof(s_reduce_no), "%05d", partition);
+    std::string start_key(s_reduce_no);
+    std::string end_key = start_key + "\xff";
+    Status status = LoadPartitionIndex();
+    for (int i = 0; i < 3 && status != kOk && status != kNoMore; i++) {
+        status = LoadPartitionIndex();
+        sleep(1);
+    }
+    if (status == kNoMore) {
+        //no directory, fall back to the sampled index
+        return Scan(start_key, end_key);
     }
     IteratorImpl* it = new IteratorImpl(start_key, end_key, this);
+    if (status != kOk) {
+        LOG(WARNING, "faild to load partition index, %s", path_.c_str());
+        it->SetHasMore(false);
+        it->SetError(kReadFileFail);
+        return it;
+    }
+    const PartitionIndex& partitions = *partitions_;
+    int low = 0;
+    int high = partitions.items_size() - 1;
+    while (low < high) {
+        int mid = low + (high - low) / 2;
+        if (partitions.items(mid).partition() < partition) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    if (low > high || partitions.items(low).partition() != partition) {
+        it->SetHasMore(false);
+        return it; //nothing of this partition in the file
+    }
+    restart_interval_ = partitions.restart_interval();
+    int64_t offset = partitions.items(low).first_block();
     if (!fs_->Seek(offset)) {
         LOG(WARNING, "fail to seek the data block at %ld", offset);
         it->SetHasMore(false);
         it->SetError(kReadFileFail);
     } else {
+        //the size of the last block is not recorded, allow for a large one
+        int64_t end = std::min(partitions.items(low).last_block() + 2 * sBlockSize,
+                               idx_offset_);
+        fs_->WillRead(offset, end - offset);
         it->SetHasMore(true);
     }
     it->Init();
     return it;
 }
 
+void SortFileReaderImpl::StopReadAhead() {
+    MutexLock lock(&prefetch_mu_);
+    std::set<BlockPrefetcher*>::iterator it;
+    for (it = prefetchers_.begin(); it != prefetchers_.end(); it++) {
+        (*it)->Detach();
+    }
+    prefetchers_.clear();
+}
+
 Status SortFileReaderImpl::Close() {
     LOG(INFO, "try close file: %s", path_.c_str());
+    //the file handle is going away, stop reading ahead on it
+    StopReadAhead();
     if (!fs_->Close()) {
         return kCloseFileFail;
     }
     return kOk;
 }
 
-SortFileWriterImpl::SortFileWriterImpl(FileSystem* fs) : cur_block_size_(0),
-                                                         fs_(fs),
-                                                         data_block_count_(0) {
+SortFileWriterImpl::SortFileWriterImpl(FileSystem* fs,
+                                       const Options& options) : options_(options),
+                                                                 block_items_(0),
+                                                                 restart_counter_(0),
+                                                                 block_seq_(0),
+                                                                 skip_compress_(0),
+                                                                 bad_compress_(0),
+                                                                 cur_block_size_(0),
+                                                                 fs_(fs),
+                                                                 data_block_count_(0),
+                                                                 compress_pool_(NULL),
+                                                                 append_pool_(NULL),
+                                                                 cond_(&mu_),
+                                                                 pipeline_status_(kOk) {
+    if (options_.compress_threads > 0) {
+        compress_pool_ = new ThreadPool(options_.compress_threads);
+        append_pool_ = new ThreadPool(1);
+    }
+}
 
+SortFileWriterImpl::~SortFileWriterImpl() {
+    if (compress_pool_ != NULL) {
+        WaitPending();
+        delete compress_pool_;
+        delete append_pool_;
+    }
+    delete fs_;
 }
 
 Status SortFileWriterImpl::Open(const std::string& path, FileSystem::Param param) {
@@ -368,10 +1255,23 @@ Status SortFileWriterImpl::Open(const std::string& path, FileSystem::Param param
     return kOk;
 }
 
-Status SortFileWriterImpl::Put(const std::string& key, const std::string& value) {
-    if (key < last_key_) {
+// The partition number of a "%05d\t" prefixed key, -1 if there is none
+int SortFileWriterImpl::ParsePartition(const Slice& key) {
+    int partition = 0;
+    size_t i = 0;
+    for (; i < key.size() && key[i] >= '0' && key[i] <= '9'; i++) {
+        partition = partition * 10 + (key[i] - '0');
+    }
+    if (i == 0 || i >= key.size() || key[i] != '\t') {
+        return -1;
+    }
+    return partition;
+}
+
+Status SortFileWriterImpl::Put(const Slice& key, const Slice& value) {
+    if (key < Slice(last_key_)) {
         LOG(WARNING, "try to put a un-ordered key: %s \n last: %s",
-            key.c_str(), last_key_.c_str());
+            key.ToString().c_str(), last_key_.c_str());
         return kInvalidArg;
     }
     if (cur_block_size_ >= sBlockSize) {
@@ -380,23 +1280,95 @@ Status SortFileWriterImpl::Put(const std::string& key, const std::string& value)
             return status;
         }
     }
-    KeyValue* item = cur_block_.add_items();
-    item->set_key(key);
-    item->set_value(value);
-    cur_block_size_ += (key.size() + value.size());
-    last_key_ = key;
+    if (block_items_ == 0) {
+        block_first_key_.assign(key.data(), key.size());
+    }
+    if (options_.version != kSortFileV1 && options_.partitioned) {
+        int partition = ParsePartition(key);
+        if (partition < 0) {
+            LOG(WARNING, "no partition prefix in key: %s", key.ToString().c_str());
+            return kInvalidArg;
+        }
+        int n = partitions_.items_size();
+        PartitionRange* range = NULL;
+        if (n > 0 && partitions_.items(n - 1).partition() == partition) {
+            range = partitions_.mutable_items(n - 1);
+        } else {
+            range = partitions_.add_items();
+            range->set_partition(partition);
+            range->set_first_block(block_seq_);
+        }
+        //block sequence numbers until the offsets are known in FlushIdxBlock
+        range->set_last_block(block_seq_);
+        range->set_bytes(range->bytes() + key.size() + value.size());
+        range->set_records(range->records() + 1);
+    }
+    if (options_.version == kSortFileV1) {
+        KeyValue* item = cur_block_.add_items();
+        item->set_key(key.data(), key.size());
+        item->set_value(value.data(), value.size());
+        cur_block_size_ += (key.size() + value.size());
+    } else if (options_.restart_interval > 0) {
+        size_t shared = 0;
+        if (block_items_ > 0 && restart_counter_ < options_.restart_interval) {
+            size_t min_len = std::min(key.size(), last_key_.size());
+            while (shared < min_len && key[shared] == last_key_[shared]) {
+                shared++;
+            }
+        } else {
+            restarts_.push_back(block_buf_.size());
+            restart_counter_ = 0;
+        }
+        PutVarint32(&block_buf_, shared);
+        PutVarint32(&block_buf_, key.size() - shared);
+        PutVarint32(&block_buf_, value.size());
+        block_buf_.append(key.data() + shared, key.size() - shared);
+        block_buf_.append(value.data(), value.size());
+        restart_counter_ ++;
+        cur_block_size_ = block_buf_.size();
+    } else {
+        PutVarint32(&block_buf_, key.size());
+        PutVarint32(&block_buf_, value.size());
+        block_buf_.append(key.data(), key.size());
+        block_buf_.append(value.data(), value.size());
+        cur_block_size_ = block_buf_.size();
+    }
+    block_items_ ++;
+    last_key_.assign(key.data(), key.size());
     return kOk;
 }
 
 Status SortFileWriterImpl::FlushIdxBlock() {
+    if (options_.version == kSortFileV3) {
+        if (segment_index_.items_size() > 0) {
+            Status status = FlushIndexSegment();
+            if (status != kOk) {
+                return status;
+            }
+        }
+        idx_block_.set_levels(2);
+    }
     std::sort(idx_buffer_.begin(), idx_buffer_.end(), IndexSampleOrder());
+    if (options_.version != kSortFileV1) {
+        idx_block_.set_restart_interval(std::max(options_.restart_interval, 0));
+    }
     for (size_t i = 0; i < idx_buffer_.size(); i++) {
         idx_block_.add_items()->CopyFrom(idx_buffer_[i]);
     }
+    //a sparse v3 index would lose whole segments of blocks, it goes one
+    //level deeper instead
+    while (options_.version == kSortFileV3
+           && (idx_block_.items_size() > sMaxIndexSize
+               || (size_t)idx_block_.ByteSize() > sMaxIndexBytes)) {
+        Status status = AddIndexLevel();
+        if (status != kOk) {
+            return status;
+        }
+    }
     while (idx_block_.items_size() > sMaxIndexSize) {
         MakeIndexSparse();
     }
-    std::string raw_buf, tmp_buf;
+    std::string tmp_buf;
     bool ret = idx_block_.SerializeToString(&tmp_buf);
     if (!ret) {
         LOG(WARNING, "serialize index fail");
@@ -411,29 +1383,56 @@ Status SortFileWriterImpl::FlushIdxBlock() {
             return kUnKnown;
         }
     }
-    snappy::Compress(tmp_buf.data(), tmp_buf.size(), &raw_buf);
-    int64_t offset = fs_->Tell();
-    if (offset == -1) {
-        LOG(WARNING, "get offset fail");
-        return kWriteFileFail;
+    int64_t offset = 0;
+    int64_t meta_size = 0;
+    Status status = WriteBlock(tmp_buf, &offset, &meta_size);
+    if (status != kOk) {
+        LOG(WARNING, "write index block fail");
+        return status;
     }
-    int32_t block_size = raw_buf.size();
-    int32_t h_ret = fs_->Write((void*)&block_size, sizeof(int32_t));
-    if (h_ret != sizeof(int32_t) ) {
-        LOG(WARNING, "write index size fail");
-        return kWriteFileFail;
+    int32_t magic_number = sMagicNumber;
+    if (options_.version == kSortFileV2) {
+        magic_number = sMagicNumberV2;
     }
-    h_ret = fs_->Write((void*)raw_buf.data(), raw_buf.size());
-    if (h_ret != (int32_t)raw_buf.size()) {
-        LOG(WARNING, "wirte index block fail");
-        return kWriteFileFail;
+    int64_t partition_offset = 0;
+    if (options_.version != kSortFileV1 && options_.partitioned) {
+        partitions_.set_restart_interval(std::max(options_.restart_interval, 0));
+        for (int i = 0; i < partitions_.items_size(); i++) {
+            PartitionRange* range = partitions_.mutable_items(i);
+            assert(range->last_block() < (int64_t)block_offsets_.size());
+            range->set_first_block(block_offsets_[range->first_block()]);
+            range->set_last_block(block_offsets_[range->last_block()]);
+        }
+        ret = partitions_.SerializeToString(&tmp_buf);
+        if (!ret) {
+            LOG(WARNING, "serialize partition index fail");
+            return kUnKnown;
+        }
+        status = WriteBlock(tmp_buf, &partition_offset, &meta_size);
+        if (status != kOk) {
+            LOG(WARNING, "write partition index fail");
+            return status;
+        }
+        if (options_.version == kSortFileV2) {
+            magic_number = sMagicNumberV2Partition;
+        }
     }
-    h_ret = fs_->Write((void*)&offset, sizeof(int64_t));
+    if (options_.version == kSortFileV3) {
+        magic_number = sMagicNumberV3;
+    }
+    if (magic_number == sMagicNumberV2Partition || magic_number == sMagicNumberV3) {
+        int32_t h_ret = fs_->Write((void*)&partition_offset, sizeof(int64_t));
+        if (h_ret != sizeof(int64_t)) {
+            LOG(WARNING, "write start-offset of partition index fail");
+            return kWriteFileFail;
+        }
+    }
+    int32_t h_ret = fs_->Write((void*)&offset, sizeof(int64_t));
     if (h_ret != sizeof(int64_t)) {
         LOG(WARNING, "write start-offset of index fail");
         return kWriteFileFail;
     }
-    h_ret = fs_->Write((void*)&sMagicNumber, sizeof(int32_t));
+    h_ret = fs_->Write((void*)&magic_number, sizeof(int32_t));
     if (h_ret != sizeof(int32_t) ) {
         LOG(WARNING, "write magic number fail");
         return kWriteFileFail;
@@ -441,48 +1440,106 @@ Status SortFileWriterImpl::FlushIdxBlock() {
     return kOk;
 }
 
-void SortFileWriterImpl::MakeIndexSparse() {
-    IndexBlock tmp_index;
-    tmp_index.Swap(&idx_block_);
-    assert(idx_block_.items_size() == 0);
-    for (int i = 0; i < tmp_index.items_size(); i+=2) {
-        KeyOffset* item = idx_block_.add_items();
-        item->CopyFrom(tmp_index.items(i));
+// Pick what to store for a v3 block, kCodecNone keeps it raw.
+// After a run of blocks that do not shrink, skip trying for a while.
+CompressCodec SortFileWriterImpl::CompressBlock(const std::string& raw_buf,
+                                                std::string* compressed_buf) {
+    if (options_.codec == kCodecNone || raw_buf.empty()) {
+        return kCodecNone;
+    }
+    {
+        MutexLock lock(&mu_);
+        if (skip_compress_ > 0) {
+            skip_compress_--;
+            return kCodecNone;
+        }
     }
+    bool shrunk = CompressWith(options_.codec, options_.codec_level,
+                               raw_buf, compressed_buf)
+        && compressed_buf->size() < raw_buf.size() - raw_buf.size() / 8;
+    MutexLock lock(&mu_);
+    if (!shrunk) {
+        if (++bad_compress_ >= sBadCompressLimit) {
+            skip_compress_ = sSkipCompressBlocks;
+            bad_compress_ = 0;
+        }
+        return kCodecNone;
+    }
+    bad_compress_ = 0;
+    return options_.codec;
 }
 
-Status SortFileWriterImpl::FlushCurBlock() {
-    if (cur_block_.items_size() == 0) {
-        return kOk;
-    }
-    std::string raw_buf, compressed_buf;
-    bool ret = cur_block_.SerializeToString(&raw_buf);
-    if (!ret) {
-        LOG(WARNING, "serialize data block fail");
-        return kUnKnown;
+// Build the header and payload of a block, stored_raw means the payload is raw_buf
+void SortFileWriterImpl::EncodeBlock(const std::string& raw_buf, std::string* header,
+                                     std::string* compressed_buf, bool* stored_raw,
+                                     char flags) {
+    int32_t block_size = 0;
+    *stored_raw = false;
+    if (options_.version == kSortFileV3) {
+        char codec = CompressBlock(raw_buf, compressed_buf);
+        *stored_raw = (codec == kCodecNone);
+        const std::string& payload = *stored_raw ? raw_buf : *compressed_buf;
+        block_size = payload.size();
+        codec |= flags;
+        header->append((const char*)&block_size, sizeof(int32_t));
+        header->push_back(codec);
+        PutFixed32(header, BlockCrc(codec, payload.data(), payload.size()));
+    } else {
+        snappy::Compress(raw_buf.data(), raw_buf.size(), compressed_buf);
+        block_size = compressed_buf->size();
+        header->append((const char*)&block_size, sizeof(int32_t));
     }
-    snappy::Compress(raw_buf.data(), raw_buf.size(), &compressed_buf);
-    int32_t block_size = compressed_buf.size();
-    int64_t offset = fs_->Tell();
-    if (offset == -1) {
+}
+
+Status SortFileWriterImpl::AppendBlock(const std::string& header, const std::string& payload,
+                                       int64_t* offset, int64_t* size) {
+    *offset = fs_->Tell();
+    if (*offset == -1) {
         LOG(WARNING, "get cur offset fail");
         return kWriteFileFail;
     }
     //LOG(INFO, "file:%s, block_size: %ld", path_.c_str(), block_size);
-    int32_t h_ret = fs_->Write((void*)&block_size, sizeof(int32_t));
-    if (h_ret != sizeof(int32_t) ) {
-        LOG(WARNING, "write block size fail");
+    int32_t h_ret = fs_->Write((void*)header.data(), header.size());
+    if (h_ret != (int32_t)header.size()) {
+        LOG(WARNING, "write block header fail");
         return kWriteFileFail;
     }
-    h_ret = fs_->Write((void*)compressed_buf.data(), compressed_buf.size());
-    if (h_ret != (int32_t)compressed_buf.size() ) {
-        LOG(WARNING, "write data block fail");
+    h_ret = fs_->Write((void*)payload.data(), payload.size());
+    if (h_ret != (int32_t)payload.size()) {
+        LOG(WARNING, "write block fail");
         return kWriteFileFail;
     }
+    *size = header.size() + payload.size();
+    return kOk;
+}
 
+Status SortFileWriterImpl::WriteBlock(const std::string& raw_buf,
+                                      int64_t* offset, int64_t* size, char flags) {
+    std::string header;
+    std::string compressed_buf;
+    bool stored_raw = false;
+    EncodeBlock(raw_buf, &header, &compressed_buf, &stored_raw, flags);
+    return AppendBlock(header, stored_raw ? raw_buf : compressed_buf, offset, size);
+}
+
+// Called in block order once a data block is in the file
+Status SortFileWriterImpl::AddBlockIndex(const std::string& first_key,
+                                         int64_t offset, int64_t size) {
+    (void)size;
     data_block_count_++;
+    block_offsets_.push_back(offset);
+    if (options_.version == kSortFileV3) {
+        KeyOffset* item = segment_index_.add_items();
+        item->set_key(first_key);
+        item->set_offset(offset);
+        if (segment_index_.items_size() >= sSegmentBlocks) {
+            return FlushIndexSegment();
+        }
+        return kOk;
+    }
+    //v1 and v2 keep a random sample of the blocks
     KeyOffset sample_item;
-    sample_item.set_key(cur_block_.items(0).key());
+    sample_item.set_key(first_key);
     sample_item.set_offset(offset);
 
     if ((int)idx_buffer_.size() < sMaxIndexSize) {
@@ -493,8 +1550,196 @@ Status SortFileWriterImpl::FlushCurBlock() {
             idx_buffer_[rnd_k] = sample_item; 
         }    
     }
+    return kOk;
+}
+
+// Write the index of the blocks since the last segment right behind them,
+// flagged so that a sequential scan steps over it
+Status SortFileWriterImpl::FlushIndexSegment() {
+    std::string tmp_buf;
+    bool ret = segment_index_.SerializeToString(&tmp_buf);
+    if (!ret) {
+        LOG(WARNING, "serialize index segment fail");
+        return kUnKnown;
+    }
+    int64_t offset = 0;
+    int64_t size = 0;
+    Status status = WriteBlock(tmp_buf, &offset, &size, sIndexSegmentFlag);
+    if (status != kOk) {
+        LOG(WARNING, "write index segment fail");
+        return status;
+    }
+    KeyOffset* item = idx_block_.add_items();
+    item->set_key(segment_index_.items(0).key());
+    item->set_offset(offset);
+    segment_index_.Clear();
+    return kOk;
+}
+
+// The top level of a v3 index written out as index segments of
+// sSegmentBlocks items, the new top level points to them
+Status SortFileWriterImpl::AddIndexLevel() {
+    IndexBlock lower;
+    lower.Swap(&idx_block_);
+    idx_block_.set_restart_interval(lower.restart_interval());
+    idx_block_.set_levels(lower.levels() + 1);
+    LOG(INFO, "index of %d items goes to level %d: %s",
+        lower.items_size(), idx_block_.levels(), path_.c_str());
+    for (int i = 0; i < lower.items_size(); i += sSegmentBlocks) {
+        IndexBlock segment;
+        int end = std::min(i + sSegmentBlocks, lower.items_size());
+        for (int j = i; j < end; j++) {
+            segment.add_items()->Swap(lower.mutable_items(j));
+        }
+        std::string tmp_buf;
+        if (!segment.SerializeToString(&tmp_buf)) {
+            LOG(WARNING, "serialize index segment fail");
+            return kUnKnown;
+        }
+        int64_t offset = 0;
+        int64_t size = 0;
+        Status status = WriteBlock(tmp_buf, &offset, &size, sIndexSegmentFlag);
+        if (status != kOk) {
+            LOG(WARNING, "write index segment fail");
+            return status;
+        }
+        KeyOffset* item = idx_block_.add_items();
+        item->set_key(segment.items(0).key());
+        item->set_offset(offset);
+    }
+    return kOk;
+}
+
+// Queue a block for the compressor threads, blocks while the queue is full
+Status SortFileWriterImpl::SubmitBlock(PendingBlock* block) {
+    {
+        MutexLock lock(&mu_);
+        size_t max_pending = options_.compress_threads * sPendingBlocksPerThread + 1;
+        while (pending_.size() >= max_pending) {
+            cond_.Wait();
+        }
+        if (pipeline_status_ != kOk) {
+            delete block;
+            return pipeline_status_;
+        }
+        pending_.push_back(block);
+    }
+    compress_pool_->AddTask(boost::bind(&SortFileWriterImpl::CompressTask, this, block));
+    return kOk;
+}
+
+void SortFileWriterImpl::CompressTask(PendingBlock* block) {
+    EncodeBlock(block->raw_buf, &block->header,
+                &block->compressed_buf, &block->stored_raw, 0);
+    {
+        MutexLock lock(&mu_);
+        block->ready = true;
+    }
+    append_pool_->AddTask(boost::bind(&SortFileWriterImpl::AppendTask, this));
+}
+
+// Runs on the single append thread: write out the finished blocks at the
+// head of the queue, so the file keeps the order of Put
+void SortFileWriterImpl::AppendTask() {
+    MutexLock lock(&mu_);
+    while (!pending_.empty() && pending_.front()->ready) {
+        PendingBlock* block = pending_.front();
+        if (pipeline_status_ == kOk) {
+            mu_.Unlock();
+            int64_t offset = 0;
+            int64_t size = 0;
+            Status status = AppendBlock(block->header,
+                                        block->stored_raw ? block->raw_buf
+                                                          : block->compressed_buf,
+                                        &offset, &size);
+            if (status == kOk) {
+                status = AddBlockIndex(block->first_key, offset, size);
+            }
+            if (status != kOk) {
+                LOG(WARNING, "write data block fail: %s", path_.c_str());
+            }
+            mu_.Lock();
+            if (status != kOk) {
+                pipeline_status_ = status;
+            }
+        }
+        pending_.pop_front();
+        delete block;
+        cond_.Broadcast();
+    }
+}
+
+void SortFileWriterImpl::WaitPending() {
+    MutexLock lock(&mu_);
+    while (!pending_.empty()) {
+        cond_.Wait();
+    }
+}
+
+void SortFileWriterImpl::MakeIndexSparse() {
+    IndexBlock tmp_index;
+    tmp_index.Swap(&idx_block_);
+    if (tmp_index.has_restart_interval()) {
+        idx_block_.set_restart_interval(tmp_index.restart_interval());
+    }
+    if (tmp_index.has_levels()) {
+        idx_block_.set_levels(tmp_index.levels());
+    }
+    assert(idx_block_.items_size() == 0);
+    for (int i = 0; i < tmp_index.items_size(); i+=2) {
+        KeyOffset* item = idx_block_.add_items();
+        item->CopyFrom(tmp_index.items(i));
+    }
+}
+
+Status SortFileWriterImpl::FlushCurBlock() {
+    if (block_items_ == 0) {
+        return kOk;
+    }
+    std::string raw_buf;
+    if (options_.version == kSortFileV1) {
+        bool ret = cur_block_.SerializeToString(&raw_buf);
+        if (!ret) {
+            LOG(WARNING, "serialize data block fail");
+            return kUnKnown;
+        }
+    } else {
+        if (options_.restart_interval > 0) {
+            for (size_t i = 0; i < restarts_.size(); i++) {
+                PutFixed32(&block_buf_, restarts_[i]);
+            }
+            PutFixed32(&block_buf_, restarts_.size());
+        }
+        raw_buf.swap(block_buf_);
+    }
+    Status status = kOk;
+    if (compress_pool_ != NULL) {
+        PendingBlock* block = new PendingBlock();
+        block->raw_buf.swap(raw_buf);
+        block->first_key = block_first_key_;
+        status = SubmitBlock(block);
+    } else {
+        int64_t offset = 0;
+        int64_t size = 0;
+        status = WriteBlock(raw_buf, &offset, &size);
+        if (options_.version != kSortFileV1) {
+            block_buf_.swap(raw_buf); //keep the capacity for the next block
+        }
+        if (status == kOk) {
+            status = AddBlockIndex(block_first_key_, offset, size);
+        }
+    }
+    if (status != kOk) {
+        LOG(WARNING, "write data block fail");
+        return status;
+    }
+    block_seq_++;
 
     cur_block_.Clear();
+    block_buf_.clear();
+    restarts_.clear();
+    restart_counter_ = 0;
+    block_items_ = 0;
     cur_block_size_ = 0;
     return kOk;
 }
@@ -504,6 +1749,13 @@ Status SortFileWriterImpl::Close() {
     if (status != kOk) {
         return status;
     }
+    if (compress_pool_ != NULL) {
+        WaitPending();
+        MutexLock lock(&mu_);
+        if (pipeline_status_ != kOk) {
+            return pipeline_status_;
+        }
+    }
     status = FlushIdxBlock();
     if (status != kOk) {
         return status;
@@ -3,12 +3,80 @@
 
 #include "sort_file.h"
 #include "common/filesystem.h"
+#include <deque>
+#include <list>
+#include <map>
+#include <set>
 #include <vector>
+#include <boost/shared_ptr.hpp>
 
 namespace baidu {
 namespace shuttle {
 
+// Process-wide LRU of parsed index blocks, keyed by path, size and mtime
+class IndexCache {
+public:
+    IndexCache();
+    void SetCapacity(int64_t capacity);
+    bool Enabled();
+    boost::shared_ptr<const IndexBlock> Lookup(const std::string& key);
+    void Insert(const std::string& key,
+                const boost::shared_ptr<const IndexBlock>& index);
+private:
+    struct Entry {
+        std::string key;
+        boost::shared_ptr<const IndexBlock> index;
+        int64_t charge;
+    };
+    void Evict();
+    Mutex mu_;
+    int64_t capacity_;
+    int64_t usage_;
+    std::list<Entry> lru_;
+    std::map<std::string, std::list<Entry>::iterator> table_;
+};
+
+class SortFileReaderImpl;
+
+// Keeps the next blocks of one iterator read and uncompressed by the
+// shared read-ahead pool, the depth grows when the consumer stalls
+class BlockPrefetcher {
+public:
+    BlockPrefetcher(SortFileReaderImpl* reader, ThreadPool* pool);
+    ~BlockPrefetcher();
+    // block points into buf, or into the file mapping for a raw block
+    Status Next(std::string* buf, Slice* block);
+    // Wait for the pending read and leave the reader alone afterwards,
+    // the blocks read already are still handed out. Called by the reader
+    void Detach();
+private:
+    struct Block {
+        std::string data;
+        // the block in place in the file mapping, data is unused then
+        Slice mapped;
+        bool in_place;
+        Status status;
+        Block() : in_place(false), status(kOk) { }
+    };
+    void Schedule();
+    void Fetch();
+    SortFileReaderImpl* reader_;
+    std::string path_;
+    ThreadPool* pool_;
+    Mutex mu_;
+    CondVar cond_;
+    std::deque<Block> ready_;
+    // drained blocks handed back by the consumer, reused for reading
+    std::vector<std::string> free_bufs_;
+    int depth_;
+    int idle_hits_;
+    bool fetching_;
+    bool eof_;
+    bool stop_;
+};
+
 class SortFileReaderImpl : public SortFileReader {
+    friend class BlockPrefetcher;
 public:
     class IteratorImpl : public Iterator {
     public:
@@ -20,36 +88,86 @@ public:
         virtual void Next();
         virtual const std::string& Key();
         virtual const std::string& Value();
+        virtual Slice KeySlice();
+        virtual Slice ValueSlice();
         virtual Status Error();
         void SetError(Status status);
         void SetHasMore(bool has_more);
         virtual void Init();
         const std::string GetFileName();
     private:
+        Status LoadNextBlock();
+        bool NextInBlock();
+        bool SeekInBlock(const Slice& target);
+        bool RestartKey(uint32_t index, Slice* key);
         SortFileReaderImpl* reader_;
+        BlockPrefetcher* prefetcher_;
         bool has_more_;
         Status error_;
-        DataBlock cur_block_;
-        int cur_offset_;
+        std::string block_buf_;
+        // the current block, in block_buf_ or in the file mapping
+        Slice block_;
+        DataBlock legacy_block_;
+        int legacy_offset_;
+        const char* cur_ptr_;
+        const char* limit_ptr_;
+        const char* restarts_;
+        uint32_t num_restarts_;
+        std::string key_buf_;
+        Slice key_slice_;
+        Slice value_slice_;
         std::string key_;
         std::string value_;
         std::string start_key_;
         std::string end_key_;
     }; //class IteratorImpl
 
-    SortFileReaderImpl(FileSystem* fs) : idx_offset_(0), fs_(fs) { }
-    virtual ~SortFileReaderImpl(){ delete fs_; };
+    SortFileReaderImpl(FileSystem* fs) : idx_offset_(0),
+                                         partition_offset_(0),
+                                         footer_loaded_(false),
+                                         version_(kSortFileV1),
+                                         restart_interval_(0),
+                                         fs_(fs) { }
+    virtual ~SortFileReaderImpl(){ StopReadAhead(); delete fs_; };
     virtual Status Open(const std::string& path, FileSystem::Param param);
     virtual Iterator* Scan(const std::string& start_key, const std::string& end_key);
+    virtual Iterator* ScanPartition(int partition);
+    virtual Status LoadIndex();
+    virtual Status ReadPartitionIndex(PartitionIndex* partitions);
     virtual Status Close();
     std::string GetFileName() {return path_;}
 private:
-    Status LoadIndexBlock(IndexBlock* idx_block);
+    // The file cursor is shared with the read-ahead of the iterators, one
+    // live iterator per reader: whatever moves the cursor ends the read-ahead
+    // of the iterators so far, which fail once their read blocks run out
+    void StopReadAhead();
+    Status LoadFooter();
+    Status LoadMetaBlock(int64_t offset, ::google::protobuf::Message* meta);
+    Status LoadIndexBlock();
+    Status LoadPartitionIndex();
     Status ReadFull(std::string* result_buf, int32_t len, bool is_read_data = false);
-    Status ReadNextRecord(DataBlock& data_block);
+    // block points into buf, or into the file mapping for a raw block
+    Status ReadNextBlock(std::string* buf, Slice* block);
+    Status ReadBlock(std::string* buf, Slice* block, bool is_read_data,
+                     bool* index_segment = NULL);
+    Status LocateBlock(const std::string& start_key, int64_t* offset);
+    Status LoadIndexSegment(int64_t offset,
+                            boost::shared_ptr<const IndexBlock>* segment);
 private:
     std::string path_;
     int64_t idx_offset_;
+    int64_t partition_offset_;
+    bool footer_loaded_;
+    // parsed once per reader, immutable afterwards
+    boost::shared_ptr<const IndexBlock> index_;
+    boost::shared_ptr<const PartitionIndex> partitions_;
+    std::string index_cache_key_;
+    // compressed bytes of the block being read, reused across blocks
+    std::string compressed_buf_;
+    Mutex prefetch_mu_;
+    std::set<BlockPrefetcher*> prefetchers_;
+    SortFileVersion version_;
+    int32_t restart_interval_;
     FileSystem* fs_;
 };
 
@@ -64,24 +182,66 @@ struct IndexSampleOrder{
 
 class SortFileWriterImpl : public SortFileWriter {
 public:
-    SortFileWriterImpl(FileSystem* fs);
-    virtual ~SortFileWriterImpl(){delete fs_; };
+    SortFileWriterImpl(FileSystem* fs, const Options& options);
+    virtual ~SortFileWriterImpl();
     virtual Status Open(const std::string& path, FileSystem::Param param);
-    virtual Status Put(const std::string& key, const std::string& value);
+    virtual Status Put(const Slice& key, const Slice& value);
     virtual Status Close();
 private:
+    // A data block handed to the compressor threads
+    struct PendingBlock {
+        std::string raw_buf;
+        std::string first_key;
+        std::string header;
+        std::string compressed_buf;
+        bool stored_raw;
+        bool ready;
+        PendingBlock() : stored_raw(false), ready(false) { }
+    };
     Status FlushCurBlock();
     Status FlushIdxBlock();
+    Status WriteBlock(const std::string& raw_buf, int64_t* offset, int64_t* size,
+                      char flags = 0);
+    void EncodeBlock(const std::string& raw_buf, std::string* header,
+                     std::string* compressed_buf, bool* stored_raw, char flags);
+    Status AppendBlock(const std::string& header, const std::string& payload,
+                       int64_t* offset, int64_t* size);
+    Status AddBlockIndex(const std::string& first_key, int64_t offset, int64_t size);
+    Status FlushIndexSegment();
+    Status AddIndexLevel();
+    Status SubmitBlock(PendingBlock* block);
+    void CompressTask(PendingBlock* block);
+    void AppendTask();
+    void WaitPending();
+    CompressCodec CompressBlock(const std::string& raw_buf, std::string* compressed_buf);
+    static int ParsePartition(const Slice& key);
     void MakeIndexSparse();
+    Options options_;
     DataBlock cur_block_;
+    std::string block_buf_;
+    std::string block_first_key_;
+    int32_t block_items_;
+    std::vector<uint32_t> restarts_;
+    int32_t restart_counter_;
+    int64_t block_seq_;
+    std::vector<int64_t> block_offsets_;
+    int32_t skip_compress_;
+    int32_t bad_compress_;
+    PartitionIndex partitions_;
     IndexBlock idx_block_;
+    IndexBlock segment_index_;
     std::vector<KeyOffset> idx_buffer_;
     int32_t cur_block_size_;
     std::string last_key_;
     FileSystem* fs_;
     std::string path_;
     int32_t data_block_count_;
-
+    ThreadPool* compress_pool_;
+    ThreadPool* append_pool_;
+    Mutex mu_;
+    CondVar cond_;
+    std::deque<PendingBlock*> pending_;
+    Status pipeline_status_;
 };
 
 } //namespace shuttle
@@ -0,0 +1,352 @@
+#include "tuo_merge.h"
+
+#include <assert.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sstream>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <boost/algorithm/string.hpp>
+#include <boost/bind.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <timer.h>
+#include "minion/partition.h"
+#include "logging.h"
+#include "thread.h"
+
+namespace baidu {
+namespace shuttle {
+
+using baidu::common::Log;
+using baidu::common::INFO;
+using baidu::common::WARNING;
+
+const static int sKeyLimit = 65536;
+
+bool TuoMerger::AddSortFiles(FileSystem* fs, const std::string& map_dir,
+                             std::vector<std::string>* file_names) {
+    assert(file_names);
+    std::vector<FileInfo> sort_files;
+    if (fs->List(map_dir, &sort_files)) {
+        std::vector<FileInfo>::iterator jt;
+        for (jt = sort_files.begin(); jt != sort_files.end(); jt++) {
+            const std::string& file_name = jt->name;
+            if (boost::ends_with(file_name, ".sort")) {
+                file_names->push_back(file_name);
+            }
+        }
+        return true;
+    } else {
+        LOG(WARNING, "fail to list %s", map_dir.c_str());
+        return false;
+    }
+}
+
+// Runs on a thread of its own: the merged records go to the stdin of the
+// combiner, a write error means the combiner has quit
+void TuoMerger::FeedCombiner(SortFileReader::Iterator* scan_it, int in_fd,
+                             int64_t* records, Status* status) {
+    FILE* in_file = fdopen(in_fd, "w");
+    while (!scan_it->Done()) {
+        Slice value = scan_it->ValueSlice();
+        bool write_ok = true;
+        if (options_.pipe == "streaming") {
+            if (!value.empty()) {
+                write_ok = fwrite(value.data(), 1, value.size(), in_file) == value.size()
+                           && fputc('\n', in_file) != EOF;
+            }
+        } else {
+            write_ok = fwrite(value.data(), 1, value.size(), in_file) == value.size();
+        }
+        if (!write_ok) {
+            LOG(WARNING, "fail to write to the combiner");
+            *status = kWriteFileFail;
+            break;
+        }
+        (*records)++;
+        scan_it->Next();
+    }
+    if (scan_it->Error() != kOk && scan_it->Error() != kNoMore) {
+        *status = scan_it->Error();
+    }
+    fclose(in_file);
+}
+
+// One record of the combiner output: the line, or the key and the
+// length-prefixed record of bistreaming, key is what the partitioner reads.
+// line and capacity are the getline buffer of the caller
+bool TuoMerger::ReadCombined(FILE* out_file, char** line, size_t* capacity,
+                             std::string* key, std::string* record, bool* eof) {
+    *eof = false;
+    if (options_.pipe == "streaming") {
+        ssize_t n = getline(line, capacity, out_file);
+        if (n < 0) {
+            *eof = feof(out_file);
+            return *eof;
+        }
+        if (n > 0 && (*line)[n - 1] == '\n') {
+            n--;
+        }
+        record->assign(*line, n);
+        *key = *record;
+        return true;
+    }
+    int32_t key_len = 0;
+    int32_t value_len = 0;
+    if (fread(&key_len, sizeof(key_len), 1, out_file) != 1) {
+        *eof = feof(out_file);
+        return *eof;
+    }
+    if (key_len < 0 || key_len > sKeyLimit) {
+        LOG(WARNING, "invalid key len: %d", key_len);
+        return false;
+    }
+    key->resize(key_len);
+    if (key_len > 0 && (int32_t)fread(&(*key)[0], 1, key_len, out_file) != key_len) {
+        LOG(WARNING, "read key fail");
+        return false;
+    }
+    if (fread(&value_len, sizeof(value_len), 1, out_file) != 1 || value_len < 0) {
+        LOG(WARNING, "read value_len fail");
+        return false;
+    }
+    record->clear();
+    record->append((const char*)&key_len, sizeof(key_len));
+    record->append(*key);
+    record->append((const char*)&value_len, sizeof(value_len));
+    record->resize(record->size() + value_len);
+    if (value_len > 0 && (int32_t)fread(&(*record)[record->size() - value_len], 1,
+                                        value_len, out_file) != value_len) {
+        LOG(WARNING, "read value fail");
+        return false;
+    }
+    return true;
+}
+
+// Stream the merged records through the user combiner into output_file,
+// its output is keyed and partitioned again the way the map side does.
+// The combiner has to keep the order of the keys
+Status TuoMerger::CombineManyFilesToOne(MergeFileReader* reader,
+                                        const std::string& output_file,
+                                        const SortFileWriter::Options& options,
+                                        int64_t* counter) {
+    KeyFieldBasedPartitioner key_field_partition(options_.num_key_fields,
+                                                 options_.num_partition_fields,
+                                                 options_.reduce_total, options_.separator);
+    IntHashPartitioner int_hash_partition(options_.reduce_total, options_.separator);
+    Partitioner* partitioner = &key_field_partition;
+    if (options_.is_inthash) {
+        partitioner = &int_hash_partition;
+    }
+    SortFileReader::Iterator* scan_it = reader->Scan("", "");
+    boost::scoped_ptr<SortFileReader::Iterator> scan_it_guard(scan_it);
+    if (scan_it->Error() != kOk && scan_it->Error() != kNoMore) {
+        LOG(WARNING, "fail to scan: %s", reader->GetErrorFile().c_str());
+        return scan_it->Error();
+    }
+    Status status = kOk;
+    SortFileWriter* writer = SortFileWriter::Create(kHdfsFile, options, &status);
+    boost::scoped_ptr<SortFileWriter> writer_guard(writer);
+    if (status != kOk) {
+        LOG(WARNING, "fail to create writer");
+        return status;
+    }
+    status = writer->Open(output_file, options_.param);
+    if (status != kOk) {
+        LOG(WARNING, "fail to open %s for write", output_file.c_str());
+        return status;
+    }
+    //close-on-exec, or the combiner of a tuo merged on another thread
+    //holds these pipes open and this combiner never sees its end of input
+    int stdin_pipes[2];
+    int stdout_pipes[2];
+    if (pipe2(stdin_pipes, O_CLOEXEC) != 0) {
+        LOG(WARNING, "fail to create pipes for the combiner");
+        return kUnKnown;
+    }
+    if (pipe2(stdout_pipes, O_CLOEXEC) != 0) {
+        LOG(WARNING, "fail to create pipes for the combiner");
+        close(stdin_pipes[0]);
+        close(stdin_pipes[1]);
+        return kUnKnown;
+    }
+    LOG(INFO, "invoke combiner: %s", options_.combine_cmd.c_str());
+    pid_t child_pid = fork();
+    if (child_pid == -1) {
+        LOG(WARNING, "failed to fork child process");
+        close(stdin_pipes[0]);
+        close(stdin_pipes[1]);
+        close(stdout_pipes[0]);
+        close(stdout_pipes[1]);
+        return kUnKnown;
+    } else if (child_pid == 0) { //child
+        dup2(stdin_pipes[0], 0);
+        dup2(stdout_pipes[1], 1);
+        char* cmd_argv[] = {(char*)"sh", (char*)"-c", (char*)options_.combine_cmd.c_str(), NULL};
+        char* env[] = {NULL};
+        ::execve("/bin/sh", cmd_argv, env);
+        _exit(127);
+    }
+    close(stdin_pipes[0]);
+    close(stdout_pipes[1]);
+    int64_t records_in = 0;
+    Status feed_status = kOk;
+    common::Thread feeder;
+    feeder.Start(boost::bind(&TuoMerger::FeedCombiner, this, scan_it, stdin_pipes[1],
+                             &records_in, &feed_status));
+    FILE* child_stdout = fdopen(stdout_pipes[0], "r");
+    char* line = NULL;
+    size_t capacity = 0;
+    std::string key;
+    std::string sort_key;
+    std::string record;
+    std::string raw_key;
+    char s_reduce_no[256];
+    while (true) {
+        bool eof = false;
+        if (!ReadCombined(child_stdout, &line, &capacity, &key, &record, &eof)) {
+            LOG(WARNING, "fail to read the output of the combiner");
+            status = kReadFileFail;
+            break;
+        }
+        if (eof) {
+            break;
+        }
+        if (options_.pipe == "streaming" && record.empty()) {
+            continue;
+        }
+        int reduce_no = partitioner->Calc(key, &sort_key);
+        snprintf(s_reduce_no, sizeof(s_reduce_no), "%05d\t", reduce_no);
+        raw_key = s_reduce_no;
+        raw_key += sort_key;
+        status = writer->Put(raw_key, record);
+        if (status != kOk) {
+            LOG(WARNING, "fail to put combined record to %s, the combiner may "
+                "not keep the order", output_file.c_str());
+            break;
+        }
+        (*counter)++;
+    }
+    free(line);
+    //a combiner still writing gets a broken pipe
+    fclose(child_stdout);
+    feeder.Join();
+    int exit_status = 0;
+    waitpid(child_pid, &exit_status, 0);
+    LOG(INFO, "combiner exit with status: %d, records: %lld -> %lld",
+        exit_status, records_in, *counter);
+    if (status == kOk) {
+        status = feed_status;
+    }
+    if (status == kOk && exit_status != 0) {
+        status = kUnKnown;
+    }
+    if (status == kOk) {
+        status = writer->Close();
+        if (status != kOk) {
+            LOG(WARNING, "fail to close writer: %s", output_file.c_str());
+        }
+    }
+    return status;
+}
+
+bool TuoMerger::MergeManyFilesToOne(FileSystem* fs,
+                                    const std::vector<std::string>& file_names,
+                                    const std::string& output_file, Stats* stats) {
+    MergeFileReader reader;
+    Status status = reader.Open(file_names, options_.param, kHdfsFile);
+    if (status != kOk) {
+        LOG(WARNING, "fail to open: %s", reader.GetErrorFile().c_str());
+        return false;
+    }
+
+    SortFileWriter::Options options;
+    options.version = static_cast<SortFileVersion>(options_.format);
+    options.partitioned = true;
+    if (!SortFileWriter::ParseCodec(options_.codec, &options.codec)) {
+        LOG(WARNING, "unknown codec: %s, use snappy", options_.codec.c_str());
+    }
+    options.codec_level = options_.codec_level;
+    options.compress_threads = options_.compress_threads;
+    int64_t counter = 0;
+    bool combined = false;
+    if (!options_.combine_cmd.empty()) {
+        status = CombineManyFilesToOne(&reader, output_file, options, &counter);
+        combined = (status == kOk);
+        if (!combined) {
+            //the combiner only saves bytes, the plain merge is still right
+            LOG(WARNING, "fail to combine into %s: %s, merge without the combiner",
+                output_file.c_str(), Status_Name(status).c_str());
+            fs->Remove(output_file);
+            counter = 0;
+        }
+    }
+    if (!combined) {
+        FileSystem::Param param_write = options_.param;
+        status = reader.MergeTo(output_file, param_write, kHdfsFile, options, &counter);
+    }
+    if (status != kOk) {
+        LOG(WARNING, "fail to merge to %s: %s, %s", output_file.c_str(),
+            reader.GetErrorFile().c_str(), Status_Name(status).c_str());
+        reader.Close();
+        return false;
+    }
+    status = reader.Close();
+    if (status != kOk) {
+        LOG(WARNING, "fail to close reader: %s", reader.GetErrorFile().c_str());
+        return false;
+    }
+    LOG(INFO, "totally written %lld records to %s",
+        counter, output_file.c_str());
+    if (stats != NULL) {
+        stats->inputs = file_names.size();
+        stats->records = counter;
+        stats->combined = combined;
+    }
+    return true;
+}
+
+bool TuoMerger::MergeOneTuo(int map_from, int map_to, int tuo_no, Stats* stats) {
+    int64_t start = common::timer::get_micros();
+    FileSystem::Param param = options_.param;
+    //a connection of its own, merges on other threads use theirs
+    boost::scoped_ptr<FileSystem> fs(FileSystem::CreateInfHdfs(param));
+    std::vector<std::string> file_names;
+    for (int i = map_from; i <= map_to; i++) {
+        std::stringstream ss;
+        ss << options_.work_dir << "/map_" << i;
+        const std::string& map_dir = ss.str();
+        if (!AddSortFiles(fs.get(), map_dir, &file_names) || file_names.empty()) {
+            return false;
+        }
+    }
+    char tuo_dir[4096];
+    snprintf(tuo_dir, sizeof(tuo_dir), "%s/tuo_%d_%d",
+             options_.work_dir.c_str(), options_.reduce_no, options_.attempt_id);
+    fs->Mkdirs(tuo_dir);
+    char output_file[4096];
+    snprintf(output_file, sizeof(output_file), "%s/tuo_%d_%d/%d.tuo",
+            options_.work_dir.c_str(), options_.reduce_no, options_.attempt_id, tuo_no);
+    if (!MergeManyFilesToOne(fs.get(), file_names, output_file, stats)) {
+        return false;
+    }
+    std::stringstream ss;
+    ss << options_.work_dir << "/" << tuo_no << ".tuo";
+    const std::string real_tuo_name = ss.str();
+    if (!fs->Rename(output_file, real_tuo_name)) {
+        fs->Remove(output_file);
+        return false;
+    }
+    std::vector<std::string>::iterator it;
+    for (it = file_names.begin(); it != file_names.end(); it++) {
+        fs->Remove(*it);
+    }
+    if (stats != NULL) {
+        stats->micros = common::timer::get_micros() - start;
+    }
+    return true;
+}
+
+}
+}
@@ -0,0 +1,71 @@
+#ifndef _BAIDU_SHUTTLE_SORT_TUO_MERGE_
+#define _BAIDU_SHUTTLE_SORT_TUO_MERGE_
+#include <stdio.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "sort_file.h"
+#include "common/filesystem.h"
+
+namespace baidu {
+namespace shuttle {
+
+// Merges the sort files of a range of maps into one tuo of the shuffle
+// work dir, tuos of different ranges can be merged on different threads
+class TuoMerger {
+public:
+    struct Options {
+        int32_t reduce_no;
+        int32_t attempt_id;
+        std::string work_dir;
+        FileSystem::Param param;
+        int32_t format;
+        std::string codec;
+        int32_t codec_level;
+        int32_t compress_threads;
+        //empty for no combiner, or the reduce side combiner and the way
+        //its output is partitioned again
+        std::string combine_cmd;
+        std::string pipe;
+        bool is_inthash;
+        int32_t num_key_fields;
+        int32_t num_partition_fields;
+        int32_t reduce_total;
+        std::string separator;
+        Options() : reduce_no(0), attempt_id(0), work_dir("/tmp"),
+                    format(kSortFileV2), codec("snappy"), codec_level(1),
+                    compress_threads(2), pipe("streaming"), is_inthash(false),
+                    num_key_fields(1), num_partition_fields(1), reduce_total(1),
+                    separator("\t") { }
+    };
+    // What one merge did, for the progress report
+    struct Stats {
+        int32_t inputs;
+        int64_t records;
+        int64_t micros;
+        bool combined;
+        Stats() : inputs(0), records(0), micros(0), combined(false) { }
+    };
+    explicit TuoMerger(const Options& options) : options_(options) { }
+    // Merge the sort files of map [map_from, map_to] into
+    // work_dir/<tuo_no>.tuo, thread safe
+    bool MergeOneTuo(int map_from, int map_to, int tuo_no, Stats* stats);
+private:
+    bool AddSortFiles(FileSystem* fs, const std::string& map_dir,
+                      std::vector<std::string>* file_names);
+    bool MergeManyFilesToOne(FileSystem* fs, const std::vector<std::string>& file_names,
+                             const std::string& output_file, Stats* stats);
+    Status CombineManyFilesToOne(MergeFileReader* reader, const std::string& output_file,
+                                 const SortFileWriter::Options& options, int64_t* counter);
+    void FeedCombiner(SortFileReader::Iterator* scan_it, int in_fd,
+                      int64_t* records, Status* status);
+    bool ReadCombined(FILE* out_file, char** line, size_t* capacity,
+                      std::string* key, std::string* record, bool* eof);
+private:
+    const Options options_;
+};
+
+}
+}
+
+#endif